@@ -3,9 +3,9 @@
 // Return a matrix to represent a counterclockwise rotation of "angle"
 // degrees around the axis "axis", where "axis" is one of the
 // characters 'x', 'y', or 'z'.
-Matrix4x4 Rotation(double angle, char axis)
+AffineTransform Rotation(double angle, char axis)
 {
-  Matrix4x4 r;
+  AffineTransform r;
   if (axis == 'x') {
     r[1][1] = cos(angle*M_PI/180);
     r[1][2] = -sin(angle*M_PI/180);
@@ -28,9 +28,9 @@ Matrix4x4 Rotation(double angle, char axis)
 }
 
 // Return a matrix to represent a displacement of the given vector.
-Matrix4x4 Translation(const Vector3D& displacement)
+AffineTransform Translation(const Vector3D& displacement)
 {
-  Matrix4x4 t;
+  AffineTransform t;
   t[0][3] = displacement[0];
   t[1][3] = displacement[1];
   t[2][3] = displacement[2];
@@ -38,9 +38,9 @@ Matrix4x4 Translation(const Vector3D& displacement)
 }
 
 // Return a matrix to represent a nonuniform scale with the given factors.
-Matrix4x4 Scaling(const Vector3D& scale)
+AffineTransform Scaling(const Vector3D& scale)
 {
-  Matrix4x4 s;
+  AffineTransform s;
   s[0][0] = scale[0];
   s[1][1] = scale[1];
   s[2][2] = scale[2];
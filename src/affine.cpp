@@ -0,0 +1,41 @@
+#include "affine.hpp"
+
+bool AffineTransform::is_rigid(double tolerance) const
+{
+  for (int i = 0; i < 3; ++i) {
+    for (int j = i; j < 3; ++j) {
+      double dot = v_[i] * v_[j] + v_[4 + i] * v_[4 + j] + v_[8 + i] * v_[8 + j];
+      if (fabs(dot - (i == j ? 1.0 : 0.0)) > tolerance) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+AffineTransform AffineTransform::invert() const
+{
+  const double* m = v_;
+  AffineTransform ret;
+  double* a = ret.v_;
+
+  if (!is_rigid()) {
+    // The adjugate of the linear part, by the matrix kernels
+    if (!matrix_kernels->invert_affine_3x4(m, a)) {
+      return AffineTransform();
+    }
+    return ret;
+  }
+
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      a[4*i + j] = m[4*j + i];
+    }
+  }
+
+  // The translation is undone after the linear part: -A^-1 t
+  for (int i = 0; i < 3; ++i) {
+    a[4*i + 3] = -(a[4*i] * m[3] + a[4*i + 1] * m[7] + a[4*i + 2] * m[11]);
+  }
+  return ret;
+}
@@ -0,0 +1,150 @@
+#ifndef CS488_AFFINE_HPP
+#define CS488_AFFINE_HPP
+
+#include "algebra.hpp"
+
+// An affine transform: a 3x4 row-major matrix whose implied bottom row
+// is 0 0 0 1. Every transform a scene is built from (rotations, scales
+// and translations) has this form, so scene nodes store these instead
+// of a general Matrix4x4: they take 96 bytes instead of 128, compose
+// with 36 multiplies instead of 64, and invert in closed form.
+class AffineTransform
+{
+public:
+  AffineTransform()
+  {
+    // Identity
+    std::fill(v_, v_ + 12, 0.0);
+    v_[0] = 1.0;
+    v_[5] = 1.0;
+    v_[10] = 1.0;
+  }
+  // Drops the bottom row of m, which must be 0 0 0 1 for the result
+  // to mean the same thing.
+  explicit AffineTransform(const Matrix4x4& m)
+  {
+    std::copy(m.begin(), m.begin() + 12, v_);
+  }
+
+  const double *operator[](size_t row) const
+  {
+    return v_ + 4*row;
+  }
+  double *operator[](size_t row)
+  {
+    return v_ + 4*row;
+  }
+
+  const double *begin() const
+  {
+    return v_;
+  }
+  const double *end() const
+  {
+    return v_ + 12;
+  }
+
+  Matrix4x4 to_matrix() const
+  {
+    Matrix4x4 m;
+    std::copy(v_, v_ + 12, m.begin());
+    return m;
+  }
+
+  // Write the full 4x4 matrix in column-major order, as glMultMatrix
+  // and glUniformMatrix4 expect.
+  template <typename T>
+  void to_gl(T* out) const
+  {
+    for (int c = 0; c < 4; ++c) {
+      out[4*c] = v_[c];
+      out[4*c + 1] = v_[4 + c];
+      out[4*c + 2] = v_[8 + c];
+      out[4*c + 3] = c == 3 ? 1 : 0;
+    }
+  }
+
+  // True if the linear part is a rotation (possibly with a
+  // reflection), i.e. its columns are orthonormal.
+  bool is_rigid(double tolerance = 1e-9) const;
+
+  // A rigid transform inverts by transposing its rotation; anything
+  // else by the adjugate of the 3x3 linear part. A singular transform
+  // returns the identity.
+  AffineTransform invert() const;
+
+  // Apply the transform to count packed xyz points or vectors through
+  // the matrix kernels. in and out may be the same array. For a single
+  // point the inline operators below are cheaper than the call.
+  void transform_points(const double* in, double* out, size_t count) const
+  {
+    matrix_kernels->transform_points(v_, in, out, count);
+  }
+  void transform_vectors(const double* in, double* out, size_t count) const
+  {
+    matrix_kernels->transform_vectors(v_, in, out, count);
+  }
+
+private:
+  double v_[12];
+};
+
+inline AffineTransform operator *(const AffineTransform& a, const AffineTransform& b)
+{
+  AffineTransform ret;
+  matrix_kernels->multiply_affine(a.begin(), b.begin(), ret[0]);
+  return ret;
+}
+
+// A general matrix (such as the camera's projection) after an affine
+// transform
+inline Matrix4x4 operator *(const Matrix4x4& a, const AffineTransform& b)
+{
+  Matrix4x4 ret;
+  const double* x = a.begin();
+  const double* y = b.begin();
+  double* r = ret.begin();
+
+  for (int i = 0; i < 4; ++i) {
+    const double* row = x + 4*i;
+    for (int j = 0; j < 4; ++j) {
+      r[4*i + j] = row[0] * y[j] + row[1] * y[4 + j] + row[2] * y[8 + j];
+    }
+    r[4*i + 3] += row[3];
+  }
+  return ret;
+}
+
+inline Vector3D operator *(const AffineTransform& M, const Vector3D& v)
+{
+  const double* m = M.begin();
+  return Vector3D(
+                  v[0] * m[0] + v[1] * m[1] + v[2] * m[2],
+                  v[0] * m[4] + v[1] * m[5] + v[2] * m[6],
+                  v[0] * m[8] + v[1] * m[9] + v[2] * m[10]);
+}
+
+inline Point3D operator *(const AffineTransform& M, const Point3D& p)
+{
+  const double* m = M.begin();
+  return Point3D(
+                 p[0] * m[0] + p[1] * m[1] + p[2] * m[2] + m[3],
+                 p[0] * m[4] + p[1] * m[5] + p[2] * m[6] + m[7],
+                 p[0] * m[8] + p[1] * m[9] + p[2] * m[10] + m[11]);
+}
+
+inline Vector3D transNorm(const AffineTransform& M, const Vector3D& n)
+{
+  const double* m = M.begin();
+  return Vector3D(
+                  n[0] * m[0] + n[1] * m[4] + n[2] * m[8],
+                  n[0] * m[1] + n[1] * m[5] + n[2] * m[9],
+                  n[0] * m[2] + n[1] * m[6] + n[2] * m[10]);
+}
+
+inline std::ostream& operator <<(std::ostream& os, const AffineTransform& M)
+{
+  return os << M.to_matrix();
+}
+
+#endif
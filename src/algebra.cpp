@@ -96,7 +96,7 @@ static void submultrow(Matrix4x4& a, size_t dest, size_t src, double fac)
  * from a different school.  I taught that course too, so I figured it
  * would be okay.
  */
-Matrix4x4 Matrix4x4::invert() const
+Matrix4x4 Matrix4x4::invert_general() const
 {
   /* The algorithm is plain old Gauss-Jordan elimination 
      with partial pivoting. */
@@ -141,3 +141,134 @@ Matrix4x4 Matrix4x4::invert() const
 
   return ret;
 }
+
+Matrix4x4 Matrix4x4::invert() const
+{
+  // Every transform the scene builds is affine, and those have a
+  // closed-form inverse. Singular matrices go the long way so they
+  // fail the same way as before.
+  if (v_[12] == 0.0 && v_[13] == 0.0 && v_[14] == 0.0 && v_[15] == 1.0) {
+    Matrix4x4 ret;
+    if (matrix_kernels->invert_affine(v_, ret.v_)) {
+      return ret;
+    }
+  }
+  return invert_general();
+}
+
+/*
+ * Scalar matrix kernels. These are the reference versions: the SIMD
+ * kernels in algebra_simd.cpp must agree with them up to rounding.
+ */
+
+static void multiply_scalar(const double* a, const double* b, double* out)
+{
+  for(size_t i = 0; i < 4; ++i) {
+    const double* row = a + 4*i;
+    for(size_t j = 0; j < 4; ++j) {
+      out[4*i + j] = row[0] * b[j] + row[1] * b[4 + j] +
+        row[2] * b[8 + j] + row[3] * b[12 + j];
+    }
+  }
+}
+
+static void transpose_scalar(const double* m, double* out)
+{
+  for(size_t i = 0; i < 4; ++i) {
+    for(size_t j = 0; j < 4; ++j) {
+      out[4*j + i] = m[4*i + j];
+    }
+  }
+}
+
+static bool invert_affine_3x4_scalar(const double* m, double* out)
+{
+  // The inverse of the linear part A is its adjugate over its
+  // determinant; the translation becomes -A^-1 t.
+  double c00 = m[5] * m[10] - m[6] * m[9];
+  double c01 = m[6] * m[8] - m[4] * m[10];
+  double c02 = m[4] * m[9] - m[5] * m[8];
+  double det = m[0] * c00 + m[1] * c01 + m[2] * c02;
+  if (det == 0.0) {
+    return false;
+  }
+  double inv = 1.0 / det;
+
+  double a[9];
+  a[0] = c00 * inv;
+  a[1] = (m[2] * m[9] - m[1] * m[10]) * inv;
+  a[2] = (m[1] * m[6] - m[2] * m[5]) * inv;
+  a[3] = c01 * inv;
+  a[4] = (m[0] * m[10] - m[2] * m[8]) * inv;
+  a[5] = (m[2] * m[4] - m[0] * m[6]) * inv;
+  a[6] = c02 * inv;
+  a[7] = (m[1] * m[8] - m[0] * m[9]) * inv;
+  a[8] = (m[0] * m[5] - m[1] * m[4]) * inv;
+
+  for(size_t i = 0; i < 3; ++i) {
+    out[4*i] = a[3*i];
+    out[4*i + 1] = a[3*i + 1];
+    out[4*i + 2] = a[3*i + 2];
+    out[4*i + 3] = -(a[3*i] * m[3] + a[3*i + 1] * m[7] + a[3*i + 2] * m[11]);
+  }
+  return true;
+}
+
+static bool invert_affine_scalar(const double* m, double* out)
+{
+  if (!invert_affine_3x4_scalar(m, out)) {
+    return false;
+  }
+  out[12] = 0.0;
+  out[13] = 0.0;
+  out[14] = 0.0;
+  out[15] = 1.0;
+  return true;
+}
+
+static void multiply_affine_scalar(const double* a, const double* b, double* out)
+{
+  for(size_t i = 0; i < 3; ++i) {
+    const double* row = a + 4*i;
+    for(size_t j = 0; j < 4; ++j) {
+      out[4*i + j] = row[0] * b[j] + row[1] * b[4 + j] + row[2] * b[8 + j];
+    }
+    out[4*i + 3] += row[3];
+  }
+}
+
+static void transform_points_scalar(const double* m, const double* in,
+                                    double* out, size_t count)
+{
+  for(size_t i = 0; i < count; ++i, in += 3, out += 3) {
+    double x = in[0], y = in[1], z = in[2];
+    out[0] = x * m[0] + y * m[1] + z * m[2] + m[3];
+    out[1] = x * m[4] + y * m[5] + z * m[6] + m[7];
+    out[2] = x * m[8] + y * m[9] + z * m[10] + m[11];
+  }
+}
+
+static void transform_vectors_scalar(const double* m, const double* in,
+                                     double* out, size_t count)
+{
+  for(size_t i = 0; i < count; ++i, in += 3, out += 3) {
+    double x = in[0], y = in[1], z = in[2];
+    out[0] = x * m[0] + y * m[1] + z * m[2];
+    out[1] = x * m[4] + y * m[5] + z * m[6];
+    out[2] = x * m[8] + y * m[9] + z * m[10];
+  }
+}
+
+extern const MatrixKernels scalar_matrix_kernels = {
+  "scalar",
+  multiply_scalar,
+  transpose_scalar,
+  invert_affine_scalar,
+  transform_points_scalar,
+  transform_vectors_scalar,
+  multiply_affine_scalar,
+  invert_affine_3x4_scalar
+};
+
+// Until algebra_simd.cpp picks something faster
+const MatrixKernels* matrix_kernels = &scalar_matrix_kernels;
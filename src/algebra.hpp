@@ -229,6 +229,39 @@ inline std::ostream& operator <<(std::ostream& os, const Vector3D& v)
 
 class Matrix4x4;
 
+// The low-level kernels behind the Matrix4x4 and AffineTransform
+// operations. Matrices are 16 doubles in row-major order, affine
+// transforms the top 12 of them, points and vectors packed xyz
+// triples. scalar_matrix_kernels is the portable reference; at startup
+// matrix_kernels is pointed at the fastest set the CPU supports (see
+// algebra_simd.cpp).
+struct MatrixKernels {
+  const char* name;
+  void (*multiply)(const double* a, const double* b, double* out);
+  void (*transpose)(const double* m, double* out);
+  // Inverse of a matrix whose bottom row is 0 0 0 1. Returns false,
+  // leaving out unspecified, if the matrix is singular.
+  bool (*invert_affine)(const double* m, double* out);
+  // Apply m to count points (w = 1) or vectors (w = 0). in and out
+  // may be the same array. Only the top three rows of m are read, so
+  // it may be an affine transform.
+  void (*transform_points)(const double* m, const double* in, double* out,
+                           size_t count);
+  void (*transform_vectors)(const double* m, const double* in, double* out,
+                            size_t count);
+  // The same products and inverse for affine transforms, reading and
+  // writing 12 doubles each
+  void (*multiply_affine)(const double* a, const double* b, double* out);
+  bool (*invert_affine_3x4)(const double* m, double* out);
+};
+
+extern const MatrixKernels scalar_matrix_kernels;
+extern const MatrixKernels* matrix_kernels;
+
+// Every kernel set this CPU can run, the scalar reference first and
+// terminated by NULL.
+const MatrixKernels* const* available_matrix_kernels();
+
 class Vector4D
 {
 public:
@@ -340,9 +373,9 @@ public:
     return Vector4D(v_[col], v_[4+col], v_[8+col], v_[12+col]);
   }
 
-  Vector4D operator[](size_t row) const
+  const double *operator[](size_t row) const
   {
-    return getRow(row);
+    return v_ + 4*row;
   }
   double *operator[](size_t row) 
   {
@@ -351,10 +384,16 @@ public:
 
   Matrix4x4 transpose() const
   {
-    return Matrix4x4(getColumn(0), getColumn(1), 
-                      getColumn(2), getColumn(3));
+    Matrix4x4 ret;
+    matrix_kernels->transpose(v_, ret.v_);
+    return ret;
   }
+  // Uses the closed-form affine inverse when the bottom row is
+  // 0 0 0 1, and invert_general() otherwise.
   Matrix4x4 invert() const;
+  // Gauss-Jordan elimination with partial pivoting; works for any
+  // invertible matrix, and is the reference for invert().
+  Matrix4x4 invert_general() const;
 
   const double *begin() const
   {
@@ -364,6 +403,14 @@ public:
   {
     return begin() + 16;
   }
+  double *begin()
+  {
+    return v_;
+  }
+  double *end()
+  {
+    return v_ + 16;
+  }
 		
 private:
   double v_[16];
@@ -372,41 +419,38 @@ private:
 inline Matrix4x4 operator *(const Matrix4x4& a, const Matrix4x4& b)
 {
   Matrix4x4 ret;
-
-  for(size_t i = 0; i < 4; ++i) {
-    Vector4D row = a.getRow(i);
-		
-    for(size_t j = 0; j < 4; ++j) {
-      ret[i][j] = row[0] * b[0][j] + row[1] * b[1][j] + 
-        row[2] * b[2][j] + row[3] * b[3][j];
-    }
-  }
-
+  matrix_kernels->multiply(a.begin(), b.begin(), ret.begin());
   return ret;
 }
 
+// Single points and vectors are too small to be worth a kernel call;
+// these read the matrix in place and leave the rest to the compiler.
+// Use matrix_kernels->transform_points for arrays.
 inline Vector3D operator *(const Matrix4x4& M, const Vector3D& v)
 {
+  const double* m = M.begin();
   return Vector3D(
-                  v[0] * M[0][0] + v[1] * M[0][1] + v[2] * M[0][2],
-                  v[0] * M[1][0] + v[1] * M[1][1] + v[2] * M[1][2],
-                  v[0] * M[2][0] + v[1] * M[2][1] + v[2] * M[2][2]);
+                  v[0] * m[0] + v[1] * m[1] + v[2] * m[2],
+                  v[0] * m[4] + v[1] * m[5] + v[2] * m[6],
+                  v[0] * m[8] + v[1] * m[9] + v[2] * m[10]);
 }
 
 inline Point3D operator *(const Matrix4x4& M, const Point3D& p)
 {
+  const double* m = M.begin();
   return Point3D(
-                 p[0] * M[0][0] + p[1] * M[0][1] + p[2] * M[0][2] + M[0][3],
-                 p[0] * M[1][0] + p[1] * M[1][1] + p[2] * M[1][2] + M[1][3],
-                 p[0] * M[2][0] + p[1] * M[2][1] + p[2] * M[2][2] + M[2][3]);
+                 p[0] * m[0] + p[1] * m[1] + p[2] * m[2] + m[3],
+                 p[0] * m[4] + p[1] * m[5] + p[2] * m[6] + m[7],
+                 p[0] * m[8] + p[1] * m[9] + p[2] * m[10] + m[11]);
 }
 
 inline Vector3D transNorm(const Matrix4x4& M, const Vector3D& n)
 {
+  const double* m = M.begin();
   return Vector3D(
-                  n[0] * M[0][0] + n[1] * M[1][0] + n[2] * M[2][0],
-                  n[0] * M[0][1] + n[1] * M[1][1] + n[2] * M[2][1],
-                  n[0] * M[0][2] + n[1] * M[1][2] + n[2] * M[2][2]);
+                  n[0] * m[0] + n[1] * m[4] + n[2] * m[8],
+                  n[0] * m[1] + n[1] * m[5] + n[2] * m[9],
+                  n[0] * m[2] + n[1] * m[6] + n[2] * m[10]);
 }
 
 inline std::ostream& operator <<(std::ostream& os, const Matrix4x4& M)
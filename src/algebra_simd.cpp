@@ -0,0 +1,376 @@
+//---------------------------------------------------------------------------
+//
+// algebra_simd.cpp
+//
+// SSE2 and AVX2 versions of the matrix kernels declared in
+// algebra.hpp. Each set is compiled for its own instruction set with
+// a target attribute, so the rest of the program still builds for the
+// baseline CPU; the best set the machine supports is installed in
+// matrix_kernels before main() runs.
+//
+//---------------------------------------------------------------------------
+
+#include "algebra.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ALGEBRA_X86 1
+#include <immintrin.h>
+#endif
+
+#ifdef ALGEBRA_X86
+
+/*
+ * SSE2: a matrix row is two __m128d halves.
+ */
+
+__attribute__((target("sse2")))
+static void multiply_sse2(const double* a, const double* b, double* out)
+{
+  __m128d b0l = _mm_loadu_pd(b),      b0h = _mm_loadu_pd(b + 2);
+  __m128d b1l = _mm_loadu_pd(b + 4),  b1h = _mm_loadu_pd(b + 6);
+  __m128d b2l = _mm_loadu_pd(b + 8),  b2h = _mm_loadu_pd(b + 10);
+  __m128d b3l = _mm_loadu_pd(b + 12), b3h = _mm_loadu_pd(b + 14);
+
+  for (int i = 0; i < 4; ++i) {
+    const double* row = a + 4*i;
+    __m128d x = _mm_set1_pd(row[0]);
+    __m128d y = _mm_set1_pd(row[1]);
+    __m128d z = _mm_set1_pd(row[2]);
+    __m128d w = _mm_set1_pd(row[3]);
+
+    __m128d lo = _mm_add_pd(_mm_add_pd(_mm_mul_pd(x, b0l), _mm_mul_pd(y, b1l)),
+                            _mm_add_pd(_mm_mul_pd(z, b2l), _mm_mul_pd(w, b3l)));
+    __m128d hi = _mm_add_pd(_mm_add_pd(_mm_mul_pd(x, b0h), _mm_mul_pd(y, b1h)),
+                            _mm_add_pd(_mm_mul_pd(z, b2h), _mm_mul_pd(w, b3h)));
+    _mm_storeu_pd(out + 4*i, lo);
+    _mm_storeu_pd(out + 4*i + 2, hi);
+  }
+}
+
+__attribute__((target("sse2")))
+static void transpose_sse2(const double* m, double* out)
+{
+  // Transpose each 2x2 block, swapping the off-diagonal blocks
+  for (int i = 0; i < 4; i += 2) {
+    for (int j = 0; j < 4; j += 2) {
+      __m128d r0 = _mm_loadu_pd(m + 4*i + j);
+      __m128d r1 = _mm_loadu_pd(m + 4*(i + 1) + j);
+      _mm_storeu_pd(out + 4*j + i, _mm_unpacklo_pd(r0, r1));
+      _mm_storeu_pd(out + 4*(j + 1) + i, _mm_unpackhi_pd(r0, r1));
+    }
+  }
+}
+
+__attribute__((target("sse2")))
+static void transform_sse2(const double* m, const double* in, double* out,
+                           size_t count, bool points)
+{
+  // x and y of the result come from the first two rows, as pairs
+  __m128d c0 = _mm_set_pd(m[4], m[0]);
+  __m128d c1 = _mm_set_pd(m[5], m[1]);
+  __m128d c2 = _mm_set_pd(m[6], m[2]);
+  __m128d c3 = points ? _mm_set_pd(m[7], m[3]) : _mm_setzero_pd();
+  double t = points ? m[11] : 0.0;
+
+  for (size_t i = 0; i < count; ++i, in += 3, out += 3) {
+    double x = in[0], y = in[1], z = in[2];
+    __m128d xy = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(x), c0),
+                                       _mm_mul_pd(_mm_set1_pd(y), c1)),
+                            _mm_add_pd(_mm_mul_pd(_mm_set1_pd(z), c2), c3));
+    out[2] = x * m[8] + y * m[9] + z * m[10] + t;
+    _mm_storeu_pd(out, xy);
+  }
+}
+
+static void transform_points_sse2(const double* m, const double* in,
+                                  double* out, size_t count)
+{
+  transform_sse2(m, in, out, count, true);
+}
+
+static void transform_vectors_sse2(const double* m, const double* in,
+                                   double* out, size_t count)
+{
+  transform_sse2(m, in, out, count, false);
+}
+
+static bool invert_affine_sse2(const double* m, double* out)
+{
+  // Mostly scalar dependencies; two-wide lanes do not help here
+  return scalar_matrix_kernels.invert_affine(m, out);
+}
+
+__attribute__((target("sse2")))
+static void multiply_affine_sse2(const double* a, const double* b, double* out)
+{
+  __m128d b0l = _mm_loadu_pd(b),      b0h = _mm_loadu_pd(b + 2);
+  __m128d b1l = _mm_loadu_pd(b + 4),  b1h = _mm_loadu_pd(b + 6);
+  __m128d b2l = _mm_loadu_pd(b + 8),  b2h = _mm_loadu_pd(b + 10);
+
+  for (int i = 0; i < 3; ++i) {
+    const double* row = a + 4*i;
+    __m128d x = _mm_set1_pd(row[0]);
+    __m128d y = _mm_set1_pd(row[1]);
+    __m128d z = _mm_set1_pd(row[2]);
+
+    __m128d lo = _mm_add_pd(_mm_add_pd(_mm_mul_pd(x, b0l), _mm_mul_pd(y, b1l)),
+                            _mm_mul_pd(z, b2l));
+    __m128d hi = _mm_add_pd(_mm_add_pd(_mm_mul_pd(x, b0h), _mm_mul_pd(y, b1h)),
+                            _mm_add_pd(_mm_mul_pd(z, b2h), _mm_set_pd(row[3], 0.0)));
+    _mm_storeu_pd(out + 4*i, lo);
+    _mm_storeu_pd(out + 4*i + 2, hi);
+  }
+}
+
+static bool invert_affine_3x4_sse2(const double* m, double* out)
+{
+  return scalar_matrix_kernels.invert_affine_3x4(m, out);
+}
+
+static const MatrixKernels sse2_matrix_kernels = {
+  "sse2",
+  multiply_sse2,
+  transpose_sse2,
+  invert_affine_sse2,
+  transform_points_sse2,
+  transform_vectors_sse2,
+  multiply_affine_sse2,
+  invert_affine_3x4_sse2
+};
+
+/*
+ * AVX2 + FMA: a matrix row fits in one __m256d.
+ */
+
+// Lane permutations for cross products
+#define AVX_YZXW 0xc9
+#define AVX_ZXYW 0xd2
+
+__attribute__((target("avx2,fma")))
+static void multiply_avx2(const double* a, const double* b, double* out)
+{
+  __m256d b0 = _mm256_loadu_pd(b);
+  __m256d b1 = _mm256_loadu_pd(b + 4);
+  __m256d b2 = _mm256_loadu_pd(b + 8);
+  __m256d b3 = _mm256_loadu_pd(b + 12);
+
+  for (int i = 0; i < 4; ++i) {
+    const double* row = a + 4*i;
+    __m256d r = _mm256_mul_pd(_mm256_broadcast_sd(row), b0);
+    r = _mm256_fmadd_pd(_mm256_broadcast_sd(row + 1), b1, r);
+    r = _mm256_fmadd_pd(_mm256_broadcast_sd(row + 2), b2, r);
+    r = _mm256_fmadd_pd(_mm256_broadcast_sd(row + 3), b3, r);
+    _mm256_storeu_pd(out + 4*i, r);
+  }
+}
+
+// Columns of the row-major matrix m
+__attribute__((target("avx2,fma")))
+static inline void columns_avx2(const double* m, __m256d& c0, __m256d& c1,
+                                __m256d& c2, __m256d& c3)
+{
+  __m256d r0 = _mm256_loadu_pd(m);
+  __m256d r1 = _mm256_loadu_pd(m + 4);
+  __m256d r2 = _mm256_loadu_pd(m + 8);
+  __m256d r3 = _mm256_loadu_pd(m + 12);
+
+  __m256d t0 = _mm256_unpacklo_pd(r0, r1);
+  __m256d t1 = _mm256_unpackhi_pd(r0, r1);
+  __m256d t2 = _mm256_unpacklo_pd(r2, r3);
+  __m256d t3 = _mm256_unpackhi_pd(r2, r3);
+
+  c0 = _mm256_permute2f128_pd(t0, t2, 0x20);
+  c1 = _mm256_permute2f128_pd(t1, t3, 0x20);
+  c2 = _mm256_permute2f128_pd(t0, t2, 0x31);
+  c3 = _mm256_permute2f128_pd(t1, t3, 0x31);
+}
+
+// Columns of the top three rows of m, as for an affine transform; the
+// fourth lane of each is 0
+__attribute__((target("avx2,fma")))
+static inline void affine_columns_avx2(const double* m, __m256d& c0, __m256d& c1,
+                                       __m256d& c2, __m256d& c3)
+{
+  __m256d r0 = _mm256_loadu_pd(m);
+  __m256d r1 = _mm256_loadu_pd(m + 4);
+  __m256d r2 = _mm256_loadu_pd(m + 8);
+  __m256d r3 = _mm256_setzero_pd();
+
+  __m256d t0 = _mm256_unpacklo_pd(r0, r1);
+  __m256d t1 = _mm256_unpackhi_pd(r0, r1);
+  __m256d t2 = _mm256_unpacklo_pd(r2, r3);
+  __m256d t3 = _mm256_unpackhi_pd(r2, r3);
+
+  c0 = _mm256_permute2f128_pd(t0, t2, 0x20);
+  c1 = _mm256_permute2f128_pd(t1, t3, 0x20);
+  c2 = _mm256_permute2f128_pd(t0, t2, 0x31);
+  c3 = _mm256_permute2f128_pd(t1, t3, 0x31);
+}
+
+__attribute__((target("avx2,fma")))
+static void transpose_avx2(const double* m, double* out)
+{
+  __m256d c0, c1, c2, c3;
+  columns_avx2(m, c0, c1, c2, c3);
+  _mm256_storeu_pd(out, c0);
+  _mm256_storeu_pd(out + 4, c1);
+  _mm256_storeu_pd(out + 8, c2);
+  _mm256_storeu_pd(out + 12, c3);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256d cross_avx2(__m256d u, __m256d v)
+{
+  __m256d u1 = _mm256_permute4x64_pd(u, AVX_YZXW);
+  __m256d v2 = _mm256_permute4x64_pd(v, AVX_ZXYW);
+  __m256d u2 = _mm256_permute4x64_pd(u, AVX_ZXYW);
+  __m256d v1 = _mm256_permute4x64_pd(v, AVX_YZXW);
+  return _mm256_fmsub_pd(u1, v2, _mm256_mul_pd(u2, v1));
+}
+
+__attribute__((target("avx2,fma")))
+static inline double dot3_avx2(__m256d u, __m256d v)
+{
+  double p[4];
+  _mm256_storeu_pd(p, _mm256_mul_pd(u, v));
+  return p[0] + p[1] + p[2];
+}
+
+__attribute__((target("avx2,fma")))
+static bool invert_affine_3x4_avx2(const double* m, double* out)
+{
+  // With a, b, c the columns of the linear part, the rows of its
+  // inverse are b x c, c x a and a x b over the determinant.
+  __m256d a, b, c, t;
+  affine_columns_avx2(m, a, b, c, t);
+
+  __m256d r0 = cross_avx2(b, c);
+  __m256d r1 = cross_avx2(c, a);
+  __m256d r2 = cross_avx2(a, b);
+
+  double det = dot3_avx2(a, r0);
+  if (det == 0.0) {
+    return false;
+  }
+  __m256d inv = _mm256_set1_pd(1.0 / det);
+  r0 = _mm256_mul_pd(r0, inv);
+  r1 = _mm256_mul_pd(r1, inv);
+  r2 = _mm256_mul_pd(r2, inv);
+
+  _mm256_storeu_pd(out, r0);
+  _mm256_storeu_pd(out + 4, r1);
+  _mm256_storeu_pd(out + 8, r2);
+  out[3] = -dot3_avx2(r0, t);
+  out[7] = -dot3_avx2(r1, t);
+  out[11] = -dot3_avx2(r2, t);
+  return true;
+}
+
+static bool invert_affine_avx2(const double* m, double* out)
+{
+  if (!invert_affine_3x4_avx2(m, out)) {
+    return false;
+  }
+  out[12] = 0.0;
+  out[13] = 0.0;
+  out[14] = 0.0;
+  out[15] = 1.0;
+  return true;
+}
+
+__attribute__((target("avx2,fma")))
+static void multiply_affine_avx2(const double* a, const double* b, double* out)
+{
+  __m256d b0 = _mm256_loadu_pd(b);
+  __m256d b1 = _mm256_loadu_pd(b + 4);
+  __m256d b2 = _mm256_loadu_pd(b + 8);
+
+  for (int i = 0; i < 3; ++i) {
+    const double* row = a + 4*i;
+    // The implied bottom row of b adds a's translation to the last lane
+    __m256d r = _mm256_set_pd(row[3], 0.0, 0.0, 0.0);
+    r = _mm256_fmadd_pd(_mm256_broadcast_sd(row), b0, r);
+    r = _mm256_fmadd_pd(_mm256_broadcast_sd(row + 1), b1, r);
+    r = _mm256_fmadd_pd(_mm256_broadcast_sd(row + 2), b2, r);
+    _mm256_storeu_pd(out + 4*i, r);
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void transform_avx2(const double* m, const double* in, double* out,
+                           size_t count, bool points)
+{
+  __m256d c0, c1, c2, c3;
+  affine_columns_avx2(m, c0, c1, c2, c3);
+  if (!points) {
+    c3 = _mm256_setzero_pd();
+  }
+  // Write x, y and z but not the fourth lane, which belongs to the
+  // next point
+  const __m256i xyz = _mm256_set_epi64x(0, -1, -1, -1);
+
+  for (size_t i = 0; i < count; ++i, in += 3, out += 3) {
+    __m256d r = _mm256_fmadd_pd(_mm256_broadcast_sd(in), c0, c3);
+    r = _mm256_fmadd_pd(_mm256_broadcast_sd(in + 1), c1, r);
+    r = _mm256_fmadd_pd(_mm256_broadcast_sd(in + 2), c2, r);
+    _mm256_maskstore_pd(out, xyz, r);
+  }
+}
+
+static void transform_points_avx2(const double* m, const double* in,
+                                  double* out, size_t count)
+{
+  transform_avx2(m, in, out, count, true);
+}
+
+static void transform_vectors_avx2(const double* m, const double* in,
+                                   double* out, size_t count)
+{
+  transform_avx2(m, in, out, count, false);
+}
+
+static const MatrixKernels avx2_matrix_kernels = {
+  "avx2",
+  multiply_avx2,
+  transpose_avx2,
+  invert_affine_avx2,
+  transform_points_avx2,
+  transform_vectors_avx2,
+  multiply_affine_avx2,
+  invert_affine_3x4_avx2
+};
+
+#endif // ALGEBRA_X86
+
+const MatrixKernels* const* available_matrix_kernels()
+{
+  static const MatrixKernels* kernels[4] = { NULL, NULL, NULL, NULL };
+  if (!kernels[0]) {
+    int n = 0;
+    kernels[n++] = &scalar_matrix_kernels;
+#ifdef ALGEBRA_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+      kernels[n++] = &sse2_matrix_kernels;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      kernels[n++] = &avx2_matrix_kernels;
+    }
+#endif
+  }
+  return kernels;
+}
+
+// Install the last (fastest) available set before main() runs. Code
+// that multiplies matrices during static initialisation just gets the
+// scalar kernels.
+static struct SelectMatrixKernels {
+  SelectMatrixKernels()
+  {
+    const MatrixKernels* const* kernels = available_matrix_kernels();
+    while (kernels[1]) {
+      ++kernels;
+    }
+    matrix_kernels = *kernels;
+  }
+} select_matrix_kernels;
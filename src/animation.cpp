@@ -0,0 +1,426 @@
+#include "animation.hpp"
+#include "scene.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ANIMATION_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Batched interpolation: out[i] = a[i] + w[i] (b[i] - a[i]), clamped
+ * to [lo[i], hi[i]].
+ */
+
+static void lerp_clamp_scalar(size_t count, const double* a, const double* b,
+                              const double* w, const double* lo,
+                              const double* hi, double* out)
+{
+  for (size_t i = 0; i < count; ++i) {
+    double v = a[i] + w[i] * (b[i] - a[i]);
+    out[i] = std::min(std::max(v, lo[i]), hi[i]);
+  }
+}
+
+#ifdef ANIMATION_X86
+
+__attribute__((target("avx")))
+static void lerp_clamp_avx(size_t count, const double* a, const double* b,
+                           const double* w, const double* lo,
+                           const double* hi, double* out)
+{
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256d va = _mm256_loadu_pd(a + i);
+    __m256d v = _mm256_add_pd(va, _mm256_mul_pd(_mm256_loadu_pd(w + i),
+                                                _mm256_sub_pd(_mm256_loadu_pd(b + i), va)));
+    v = _mm256_min_pd(_mm256_max_pd(v, _mm256_loadu_pd(lo + i)), _mm256_loadu_pd(hi + i));
+    _mm256_storeu_pd(out + i, v);
+  }
+  // The tail is a call into SSE code, which the compiler does not
+  // clear the upper halves for; left dirty they slow every SSE
+  // instruction after us, libm's included
+  _mm256_zeroupper();
+  lerp_clamp_scalar(count - i, a + i, b + i, w + i, lo + i, hi + i, out + i);
+}
+
+#endif // ANIMATION_X86
+
+typedef void (*LerpClampKernel)(size_t, const double*, const double*, const double*,
+                                const double*, const double*, double*);
+
+static LerpClampKernel select_lerp_clamp()
+{
+#ifdef ANIMATION_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx")) {
+    return lerp_clamp_avx;
+  }
+#endif
+  return lerp_clamp_scalar;
+}
+
+static const LerpClampKernel lerp_clamp = select_lerp_clamp();
+
+/*
+ * AnimationClip
+ */
+
+AnimationClip::AnimationClip()
+{
+}
+
+int AnimationClip::joint_track(const std::string& joint)
+{
+  for (size_t i = 0; i < m_joints.size(); ++i) {
+    if (m_joints[i].joint == joint) {
+      return i;
+    }
+  }
+  m_joints.push_back(JointTrack());
+  m_joints.back().joint = joint;
+  return m_joints.size() - 1;
+}
+
+void AnimationClip::add_key(Track& track, int columns, double time, const double* values)
+{
+  std::vector<double>::iterator it =
+    std::lower_bound(track.times.begin(), track.times.end(), time);
+  size_t i = it - track.times.begin();
+  if (it != track.times.end() && *it == time) {
+    for (int c = 0; c < columns; ++c) {
+      track.values[c][i] = values[c];
+    }
+    return;
+  }
+
+  track.times.insert(it, time);
+  for (int c = 0; c < columns; ++c) {
+    track.values[c].insert(track.values[c].begin() + i, values[c]);
+  }
+}
+
+void AnimationClip::add_joint_key(int track, double time, double x, double y)
+{
+  double values[2] = { x, y };
+  add_key(m_joints[track], 2, time, values);
+}
+
+void AnimationClip::add_root_key(double time, const Vector3D& offset)
+{
+  double values[3] = { offset[0], offset[1], offset[2] };
+  add_key(m_root, 3, time, values);
+}
+
+double AnimationClip::duration() const
+{
+  double end = m_root.times.empty() ? 0 : m_root.times.back();
+  for (std::vector<JointTrack>::const_iterator it = m_joints.begin(); it != m_joints.end(); ++it) {
+    if (!it->times.empty()) {
+      end = std::max(end, it->times.back());
+    }
+  }
+  return end;
+}
+
+void AnimationClip::clear()
+{
+  m_joints.clear();
+  m_root = Track();
+}
+
+bool AnimationClip::load(const std::string& filename)
+{
+  clear();
+  std::ifstream in(filename.c_str());
+  if (!in) {
+    return false;
+  }
+
+  // The track the following keys belong to: a joint track, or -1 for
+  // the root, or -2 before any header
+  int track = -2;
+  std::string line;
+  for (int number = 1; std::getline(in, line); ++number) {
+    std::istringstream fields(line);
+    std::string first;
+    if (!(fields >> first) || first[0] == '#') {
+      continue;
+    }
+
+    bool ok = true;
+    if (first == "joint") {
+      std::string name;
+      if (fields >> name) {
+        track = joint_track(name);
+      }
+      else {
+        ok = false;
+      }
+    }
+    else if (first == "root") {
+      track = -1;
+    }
+    else {
+      std::istringstream time_field(first);
+      double time, v[3];
+      ok = track != -2 && time_field >> time && fields >> v[0] >> v[1];
+      if (ok && track == -1 && !(fields >> v[2])) {
+        ok = false;
+      }
+      if (ok) {
+        if (track == -1) {
+          add_root_key(time, Vector3D(v[0], v[1], v[2]));
+        }
+        else {
+          add_joint_key(track, time, v[0], v[1]);
+        }
+      }
+    }
+
+    std::string rest;
+    if (!ok || fields >> rest) {
+      std::cerr << filename << ":" << number << ": malformed animation line" << std::endl;
+      clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool AnimationClip::save(const std::string& filename) const
+{
+  std::ofstream out(filename.c_str());
+  // Enough digits to read back the same doubles
+  out.precision(17);
+  for (std::vector<JointTrack>::const_iterator it = m_joints.begin(); it != m_joints.end(); ++it) {
+    out << "joint " << it->joint << "\n";
+    for (size_t k = 0; k < it->times.size(); ++k) {
+      out << it->times[k] << " " << it->values[0][k] << " " << it->values[1][k] << "\n";
+    }
+  }
+  if (!m_root.times.empty()) {
+    out << "root\n";
+    for (size_t k = 0; k < m_root.times.size(); ++k) {
+      out << m_root.times[k] << " " << m_root.values[0][k] << " "
+          << m_root.values[1][k] << " " << m_root.values[2][k] << "\n";
+    }
+  }
+  return out.good();
+}
+
+/*
+ * AnimationPlayer
+ */
+
+AnimationPlayer::AnimationPlayer(double rate)
+  : m_clip(NULL),
+    m_rate(rate > 0 ? rate : 60),
+    m_time(0),
+    m_pending(0),
+    m_looping(true),
+    m_playing(false),
+    m_root(NULL),
+    m_root_cursor(0)
+{
+}
+
+void AnimationPlayer::unbind()
+{
+  m_clip = NULL;
+  m_playing = false;
+  m_times.clear();
+  m_key_x.clear();
+  m_key_y.clear();
+  m_begin.clear();
+  m_end.clear();
+  m_cursor.clear();
+  m_joints.clear();
+  m_min_x.clear();
+  m_max_x.clear();
+  m_min_y.clear();
+  m_max_y.clear();
+  m_x0.clear();
+  m_x1.clear();
+  m_y0.clear();
+  m_y1.clear();
+  m_weight.clear();
+  m_x.clear();
+  m_y.clear();
+  m_root = NULL;
+}
+
+void AnimationPlayer::bind(const AnimationClip* clip, SceneRegistry* registry,
+                           SceneNode* root)
+{
+  unbind();
+  if (!clip) {
+    return;
+  }
+  m_clip = clip;
+
+  for (std::vector<AnimationClip::JointTrack>::const_iterator it = clip->m_joints.begin();
+       it != clip->m_joints.end(); ++it) {
+    JointNode* joint = registry ? registry->find_joint(it->joint) : NULL;
+    if (!joint || it->times.empty()) {
+      continue;
+    }
+
+    m_begin.push_back(m_times.size());
+    m_times.insert(m_times.end(), it->times.begin(), it->times.end());
+    m_key_x.insert(m_key_x.end(), it->values[0].begin(), it->values[0].end());
+    m_key_y.insert(m_key_y.end(), it->values[1].begin(), it->values[1].end());
+    m_end.push_back(m_times.size());
+
+    m_joints.push_back(joint);
+    m_min_x.push_back(joint->get_joint_x().min);
+    m_max_x.push_back(joint->get_joint_x().max);
+    m_min_y.push_back(joint->get_joint_y().min);
+    m_max_y.push_back(joint->get_joint_y().max);
+  }
+
+  size_t n = m_joints.size();
+  m_cursor.assign(n, 0);
+  m_x0.resize(n);
+  m_x1.resize(n);
+  m_y0.resize(n);
+  m_y1.resize(n);
+  m_weight.resize(n);
+  m_x.resize(n);
+  m_y.resize(n);
+
+  m_root = root;
+  if (root) {
+    m_root_base = root->get_transform();
+  }
+  m_root_cursor = 0;
+  m_root_offset = Vector3D();
+
+  m_time = 0;
+  m_pending = 0;
+  m_playing = true;
+}
+
+size_t AnimationPlayer::locate(const double* times, size_t count, size_t cursor,
+                               double t, double& weight)
+{
+  weight = 0;
+  if (t <= times[0]) {
+    return 0;
+  }
+  if (t >= times[count - 1]) {
+    return count - 1;
+  }
+
+  // Now times[0] < t < times[count - 1], so the key found has another
+  // after it
+  size_t k = cursor;
+  if (!(k + 1 < count && times[k] <= t && t < times[k + 1])) {
+    if (k + 2 < count && times[k + 1] <= t && t < times[k + 2]) {
+      ++k;
+    }
+    else {
+      k = std::upper_bound(times, times + count, t) - times - 1;
+    }
+  }
+  weight = (t - times[k]) / (times[k + 1] - times[k]);
+  return k;
+}
+
+void AnimationPlayer::evaluate(double time)
+{
+  // Gather each track's surrounding keys...
+  size_t n = m_joints.size();
+  for (size_t i = 0; i < n; ++i) {
+    size_t begin = m_begin[i], count = m_end[i] - begin;
+    size_t k = locate(&m_times[begin], count, m_cursor[i], time, m_weight[i]);
+    size_t next = k + 1 < count ? k + 1 : k;
+    m_cursor[i] = k;
+    m_x0[i] = m_key_x[begin + k];
+    m_x1[i] = m_key_x[begin + next];
+    m_y0[i] = m_key_y[begin + k];
+    m_y1[i] = m_key_y[begin + next];
+  }
+
+  // ...then blend them all in one pass per angle
+  if (n) {
+    lerp_clamp(n, &m_x0[0], &m_x1[0], &m_weight[0], &m_min_x[0], &m_max_x[0], &m_x[0]);
+    lerp_clamp(n, &m_y0[0], &m_y1[0], &m_weight[0], &m_min_y[0], &m_max_y[0], &m_y[0]);
+  }
+
+  const AnimationClip::Track& root = m_clip->m_root;
+  if (!root.times.empty()) {
+    double w;
+    size_t count = root.times.size();
+    size_t k = locate(&root.times[0], count, m_root_cursor, time, w);
+    size_t next = k + 1 < count ? k + 1 : k;
+    m_root_cursor = k;
+    for (int c = 0; c < 3; ++c) {
+      m_root_offset[c] = root.values[c][k] + w * (root.values[c][next] - root.values[c][k]);
+    }
+  }
+}
+
+void AnimationPlayer::apply()
+{
+  for (size_t i = 0; i < m_joints.size(); ++i) {
+    JointNode* joint = m_joints[i];
+    if (m_x[i] != joint->get_angle_x() || m_y[i] != joint->get_angle_y()) {
+      joint->set_angles(m_x[i], m_y[i]);
+    }
+  }
+
+  if (m_root && m_clip && !m_clip->m_root.times.empty()) {
+    m_root->set_transform(m_root_base * Translation(m_root_offset));
+  }
+}
+
+void AnimationPlayer::seek(double time)
+{
+  if (!m_clip) {
+    return;
+  }
+  m_time = time;
+  m_pending = 0;
+  m_playing = true;
+  evaluate(time);
+  apply();
+}
+
+bool AnimationPlayer::advance(double seconds)
+{
+  if (!m_clip || !m_playing) {
+    return false;
+  }
+
+  m_pending += seconds;
+  // Round up what is a whole step but for rounding error
+  double steps = floor(m_pending * m_rate + 1e-6);
+  if (steps < 1) {
+    return false;
+  }
+  m_pending = std::max(m_pending - steps / m_rate, 0.0);
+
+  double time = m_time + steps / m_rate;
+  double duration = m_clip->duration();
+  bool finished = false;
+  if (time >= duration) {
+    if (m_looping && duration > 0) {
+      time = fmod(time, duration);
+    }
+    else {
+      time = duration;
+      finished = true;
+    }
+  }
+
+  m_time = time;
+  evaluate(time);
+  apply();
+  m_playing = !finished;
+  return true;
+}
@@ -0,0 +1,152 @@
+#ifndef CS488_ANIMATION_HPP
+#define CS488_ANIMATION_HPP
+
+#include <string>
+#include <vector>
+#include "affine.hpp"
+
+class SceneNode;
+class JointNode;
+class SceneRegistry;
+
+// Recorded motion for a puppet: for each animated joint a track of
+// keyframed x and y angles (in degrees, as JointNode::set_angles()
+// takes them), and a track of the root's translation. Values between
+// keys are interpolated linearly; before the first key and after the
+// last a track holds its end value.
+//
+// Joints are named rather than pointed at, so one clip can drive any
+// scene that has joints of those names.
+class AnimationClip {
+public:
+  AnimationClip();
+
+  // The track animating the named joint, made if it does not exist
+  int joint_track(const std::string& joint);
+  // Keys are cheapest added in time order. A key at the time of an
+  // existing one replaces it.
+  void add_joint_key(int track, double time, double x, double y);
+  void add_root_key(double time, const Vector3D& offset);
+
+  size_t joint_track_count() const { return m_joints.size(); }
+  const std::string& joint_name(int track) const { return m_joints[track].joint; }
+  size_t joint_key_count(int track) const { return m_joints[track].times.size(); }
+  size_t root_key_count() const { return m_root.times.size(); }
+
+  // Time of the last key of any track
+  double duration() const;
+
+  void clear();
+
+  // Clips are kept as text:
+  //
+  //   # comment
+  //   joint <name>
+  //   <time> <x angle> <y angle>
+  //   ...
+  //   root
+  //   <time> <x> <y> <z>
+  //   ...
+  //
+  // Times are in seconds. Returns false if the file cannot be read or
+  // is malformed, leaving the clip empty.
+  bool load(const std::string& filename);
+  bool save(const std::string& filename) const;
+
+private:
+  friend class AnimationPlayer;
+
+  // One component track per column of values
+  struct Track {
+    std::vector<double> times;
+    std::vector<double> values[3];
+  };
+  struct JointTrack : public Track {
+    std::string joint;
+  };
+
+  static void add_key(Track& track, int columns, double time, const double* values);
+
+  std::vector<JointTrack> m_joints;
+  Track m_root;
+};
+
+// Plays an AnimationClip on a scene at a fixed rate.
+//
+// bind() packs the clip's keys into flat arrays and resolves its
+// joints, so that playing allocates nothing. Sampling keeps a cursor
+// per track: when time moves forward by a frame, each track checks its
+// current and next key interval before falling back to a binary
+// search. The interpolation and clamping to the joint ranges then run
+// as one batched pass over all tracks, vectorized where the CPU
+// allows.
+class AnimationPlayer {
+public:
+  // rate is in samples per second
+  explicit AnimationPlayer(double rate = 60);
+
+  // Drive the joints of the scene under root from clip. Tracks naming
+  // no joint in registry are ignored. The root's translation track is
+  // applied on top of its transform as it is now. The clip must stay
+  // alive and unchanged while bound.
+  void bind(const AnimationClip* clip, SceneRegistry* registry, SceneNode* root);
+  void unbind();
+  bool is_bound() const { return m_clip != NULL; }
+
+  // At the end of the clip, start again rather than stop
+  void set_looping(bool looping) { m_looping = looping; }
+  // True until a clip that does not loop has played to its end
+  bool is_playing() const { return m_playing; }
+
+  // Let seconds of real time pass. The pose moves in whole steps of
+  // 1/rate, whatever the caller's timing, and only the last step of
+  // the span is evaluated. Returns true if it posed the scene.
+  bool advance(double seconds);
+  // Jump to time and pose the scene there
+  void seek(double time);
+  double time() const { return m_time; }
+  double rate() const { return m_rate; }
+
+  // Sample every bound track at time into angles_x()/angles_y() and
+  // root_offset(), without touching the scene
+  void evaluate(double time);
+  // Pose the scene from the last evaluate()
+  void apply();
+
+  size_t track_count() const { return m_joints.size(); }
+  const double* angles_x() const { return m_x.empty() ? NULL : &m_x[0]; }
+  const double* angles_y() const { return m_y.empty() ? NULL : &m_y[0]; }
+  const Vector3D& root_offset() const { return m_root_offset; }
+
+private:
+  // The key at or before t among count sorted times, or 0 if t is
+  // before them all, searching from the cursor's key first. weight is
+  // set to how far t is towards the key after it.
+  static size_t locate(const double* times, size_t count, size_t cursor,
+                       double t, double& weight);
+
+  const AnimationClip* m_clip;
+  double m_rate;
+  double m_time;
+  double m_pending;
+  bool m_looping, m_playing;
+
+  // All key times and values of the bound joint tracks, one track
+  // after another; track i owns [m_begin[i], m_end[i])
+  std::vector<double> m_times, m_key_x, m_key_y;
+  std::vector<size_t> m_begin, m_end, m_cursor;
+  std::vector<JointNode*> m_joints;
+  std::vector<double> m_min_x, m_max_x, m_min_y, m_max_y;
+
+  // Per-track scratch and results of evaluate(), laid out for the
+  // batched interpolation
+  std::vector<double> m_x0, m_x1, m_y0, m_y1, m_weight;
+  std::vector<double> m_x, m_y;
+
+  SceneNode* m_root;
+  AffineTransform m_root_base;
+  size_t m_root_cursor;
+  Vector3D m_root_offset;
+};
+
+#endif
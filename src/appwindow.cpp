@@ -14,6 +14,12 @@ AppWindow::AppWindow()
   m_menu_app.items().push_back(MenuElem("_Quit", Gtk::AccelKey("q"),
     sigc::mem_fun(*this, &AppWindow::hide)));
 
+  m_menu_app.items().push_back(MenuElem("Re_load Scene", Gtk::AccelKey("l"),
+    sigc::mem_fun(m_viewer, &Viewer::reload_scene)));
+
+  m_menu_app.items().push_back(MenuElem("Play _Animation", Gtk::AccelKey("a"),
+    sigc::mem_fun(m_viewer, &Viewer::play_animation)));
+
   m_menu_app.items().push_back(MenuElem("_Reset Position", Gtk::AccelKey("i"),
     sigc::mem_fun(m_viewer, &Viewer::reset_position)));
 
@@ -40,6 +46,18 @@ AppWindow::AppWindow()
 
   m_menu_option.items().push_back(MenuElem("_Back-Cull", Gtk::AccelKey("b"),
     sigc::mem_fun(m_viewer, &Viewer::set_back_cull)));
+
+  m_menu_option.items().push_back(MenuElem("_View-Cull", Gtk::AccelKey("v"),
+    sigc::mem_fun(m_viewer, &Viewer::set_frustum_cull)));
+
+  m_menu_option.items().push_back(MenuElem("_Instancing", Gtk::AccelKey("n"),
+    sigc::mem_fun(m_viewer, &Viewer::set_instancing)));
+
+  m_menu_option.items().push_back(MenuElem("_Crowd", Gtk::AccelKey("c"),
+    sigc::mem_fun(m_viewer, &Viewer::set_crowd)));
+
+  m_menu_option.items().push_back(MenuElem("_Stats Overlay", Gtk::AccelKey("s"),
+    sigc::mem_fun(m_viewer, &Viewer::set_hud)));
   
   // Set up the menu bar
   m_menubar.items().push_back(Gtk::Menu_Helpers::MenuElem("_Application", m_menu_app));
@@ -69,3 +87,24 @@ AppWindow::AppWindow()
 void AppWindow::set_scene_node(SceneNode *root) {
   m_viewer.set_scene_node(root);
 }
+
+void AppWindow::set_scene_file(const std::string& filename) {
+  m_viewer.set_scene_file(filename);
+}
+
+bool AppWindow::load_animation(const std::string& filename) {
+  return m_viewer.load_animation(filename);
+}
+
+void AppWindow::set_crowd(size_t count) {
+  m_viewer.set_crowd_size(count);
+  m_viewer.set_crowd();
+}
+
+void AppWindow::set_profiling(bool profiling) {
+  m_viewer.set_profiling(profiling);
+}
+
+bool AppWindow::save_profile(const std::string& filename) const {
+  return m_viewer.save_profile(filename);
+}
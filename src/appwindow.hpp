@@ -8,6 +8,14 @@ class AppWindow : public Gtk::Window {
 public:
   AppWindow();
   void set_scene_node(SceneNode *root);
+  void set_scene_file(const std::string& filename);
+  // The clip Application > Play Animation plays
+  bool load_animation(const std::string& filename);
+  // Start with a crowd of count copies of the scene showing
+  void set_crowd(size_t count);
+  // Record frame timings, and write them out as CSV or JSON
+  void set_profiling(bool profiling);
+  bool save_profile(const std::string& filename) const;
 protected:
 
 private:
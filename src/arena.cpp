@@ -0,0 +1,50 @@
+#include "arena.hpp"
+#include <cstdlib>
+#include <new>
+
+SceneArena::SceneArena(size_t block_size)
+  : m_block_size(block_size),
+    m_next(NULL),
+    m_end(NULL),
+    m_used(0),
+    m_reserved(0)
+{
+}
+
+SceneArena::~SceneArena()
+{
+  release();
+}
+
+void* SceneArena::allocate(size_t size)
+{
+  size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+
+  if (size > (size_t)(m_end - m_next)) {
+    // Oversized requests get a block of their own
+    size_t bytes = size > m_block_size ? size : m_block_size;
+    char* block = (char*)malloc(bytes);
+    if (!block) {
+      throw std::bad_alloc();
+    }
+    m_blocks.push_back(block);
+    m_reserved += bytes;
+    m_next = block;
+    m_end = block + bytes;
+  }
+
+  void* p = m_next;
+  m_next += size;
+  m_used += size;
+  return p;
+}
+
+void SceneArena::release()
+{
+  for (std::vector<char*>::iterator it = m_blocks.begin(); it != m_blocks.end(); ++it) {
+    free(*it);
+  }
+  m_blocks.clear();
+  m_next = m_end = NULL;
+  m_used = m_reserved = 0;
+}
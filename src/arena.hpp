@@ -0,0 +1,53 @@
+#ifndef CS488_ARENA_HPP
+#define CS488_ARENA_HPP
+
+#include <vector>
+#include <stddef.h>
+
+// A bump allocator. Memory comes from large blocks handed out front to
+// back, so objects allocated one after another sit next to each other,
+// and it is all given back at once by release() or the destructor.
+//
+// The arena never runs destructors; whoever creates objects in it
+// destroys them (see SceneRegistry) before releasing the memory.
+class SceneArena {
+public:
+  // Every allocation is aligned to this many bytes
+  enum { ALIGNMENT = 16 };
+
+  explicit SceneArena(size_t block_size = 64 * 1024);
+  ~SceneArena();
+
+  void* allocate(size_t size);
+
+  // Free every block
+  void release();
+
+  // Bytes handed out, and bytes held in blocks
+  size_t bytes_used() const { return m_used; }
+  size_t bytes_reserved() const { return m_reserved; }
+
+private:
+  SceneArena(const SceneArena&);
+  SceneArena& operator=(const SceneArena&);
+
+  size_t m_block_size;
+  std::vector<char*> m_blocks;
+  char* m_next;
+  char* m_end;
+  size_t m_used, m_reserved;
+};
+
+// Construct objects in an arena with new (arena) T(...)
+inline void* operator new(size_t size, SceneArena& arena)
+{
+  return arena.allocate(size);
+}
+
+// Only called if a constructor throws; the memory goes back with the
+// rest of the arena
+inline void operator delete(void*, SceneArena&)
+{
+}
+
+#endif
@@ -0,0 +1,959 @@
+// bench.cpp -- performance harness for the puppeteer.
+//
+// Generates a synthetic puppet of configurable depth, branching factor
+// and size, then times each stage of the pipeline separately: Lua
+// import (from the script and from its compiled cache), transform
+// update, frustum culling, traversal (drawing), picking, undo/redo,
+// joint drags, keyframe playback, posing a crowd of copies and solving
+// inverse kinematics for a limb of each, and for a leg whose knee bends
+// one way only, and reports the memory held by the undo history and by
+// each crowd instance and how many IK targets were reached. The full
+// update and crowd posing are timed again spread over a pool of threads.
+// It also checks each SIMD matrix kernel set against the scalar
+// reference and times them. Results are written as JSON, one entry per
+// stage with the median and 99th percentile latency, so runs of
+// different builds can be compared by a script.
+//
+// Build and run with "make bench"; pass options with BENCH_ARGS.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "scene_lua.hpp"
+#include "renderer.hpp"
+#include "headless.hpp"
+#include "undo.hpp"
+#include "scene_cache.hpp"
+#include "animation.hpp"
+#include "crowd.hpp"
+#include "taskpool.hpp"
+#include "ik.hpp"
+
+struct BenchOptions {
+  BenchOptions()
+    : depth(6), branching(3), nodes(2000), iterations(200),
+      width(512), height(512), seed(1), crowd(100), threads(0), output("-")
+  {
+  }
+
+  int depth, branching;
+  // Upper bound on the number of nodes generated, joints and spheres
+  // together
+  int nodes;
+  int iterations;
+  int width, height;
+  unsigned seed;
+  // Instances in the crowd stage
+  int crowd;
+  // Threads for the parallel stages, 0 for one per CPU
+  int threads;
+  std::string output;
+};
+
+// Largest difference between a kernel set and the scalar reference
+struct KernelCheck {
+  std::string name;
+  double max_error;
+};
+
+// Results beyond this are reported as failures
+static const double KERNEL_TOLERANCE = 1e-9;
+
+// Latency samples for one stage, in microseconds
+struct Timing {
+  Timing(const std::string& n) : name(n) {}
+
+  std::string name;
+  std::vector<double> samples;
+};
+
+static double now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+}
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t i = (size_t)ceil(p * sorted.size());
+  return sorted[std::min(sorted.size() - 1, i > 0 ? i - 1 : 0)];
+}
+
+static double random_unit()
+{
+  return rand() / (double)RAND_MAX;
+}
+
+// A joint waiting to be written by generate_puppet()
+struct PendingJoint {
+  std::string parent;
+  int level, child;
+};
+
+// Write a puppet script: a tree of joints, each with a sphere for its
+// limb, where every joint above the given depth has `branching`
+// children. Generation is breadth first and stops at the node limit,
+// so the tree is as complete as the limit allows. Returns the number
+// of nodes written.
+static int generate_puppet(std::ostream& out, const BenchOptions& options)
+{
+  out << "rootnode = gr.node('root')\n"
+      << "mats = {\n"
+      << "  gr.material({1.0, 0.0, 0.0}, {0.1, 0.1, 0.1}, 10),\n"
+      << "  gr.material({0.0, 1.0, 0.0}, {0.1, 0.1, 0.1}, 10),\n"
+      << "  gr.material({0.0, 0.0, 1.0}, {0.1, 0.1, 0.1}, 10),\n"
+      << "  gr.material({1.0, 1.0, 0.0}, {0.1, 0.1, 0.1}, 10)\n"
+      << "}\n";
+
+  std::vector<PendingJoint> queue;
+  PendingJoint first = { "rootnode", 0, 0 };
+  queue.push_back(first);
+
+  int count = 1;
+  for (size_t q = 0; q < queue.size() && count + 2 <= options.nodes; ++q) {
+    const PendingJoint p = queue[q];
+    std::ostringstream name;
+    name << "j" << q;
+    std::string joint = name.str();
+
+    // Spread siblings out, closer together the deeper they are, so
+    // the whole puppet stays a bounded size.
+    double spread = 4.0 / pow((double)options.branching, p.level);
+    double x = p.level == 0 ? 0 :
+      (p.child - (options.branching - 1) / 2.0) * spread;
+
+    out << joint << " = gr.joint('" << joint
+        << "', {-90.0, 0.0, 90.0}, {-90.0, 0.0, 90.0})\n"
+        << p.parent << ":add_child(" << joint << ")\n"
+        << joint << ":translate(" << x << ", " << (p.level ? -2 : 0) << ", 0)\n"
+        << "s" << q << " = gr.sphere('s" << q << "')\n"
+        << joint << ":add_child(s" << q << ")\n"
+        << "s" << q << ":set_material(mats[" << (q % 4 + 1) << "])\n"
+        << "s" << q << ":scale(" << 0.3 * spread << ", 0.8, "
+        << 0.3 * spread << ")\n"
+        << "s" << q << ":translate(0, -1, 0)\n";
+    count += 2;
+
+    if (p.level + 1 < options.depth) {
+      for (int c = 0; c < options.branching; ++c) {
+        PendingJoint next = { joint, p.level + 1, c };
+        queue.push_back(next);
+      }
+    }
+  }
+
+  // Back the puppet away from the camera far enough to see all of it
+  double distance = 10 + 3.0 * std::max(2.0 * options.depth, 8.0);
+  out << "rootnode:translate(0, " << options.depth << ", " << -distance << ")\n"
+      << "return rootnode\n";
+
+  return count;
+}
+
+static void time_import(const std::string& filename, int iterations, Timing& t)
+{
+  for (int i = 0; i < iterations; ++i) {
+    double start = now_us();
+    SceneNode* root = import_lua(filename);
+    t.samples.push_back(now_us() - start);
+    if (root) {
+      delete root->registry();
+    }
+  }
+}
+
+static void time_import_cached(const std::string& filename, int iterations,
+                               Timing& t)
+{
+  uint64_t hash;
+  std::string cache = scene_cache_name(filename);
+  SceneNode* root = import_lua(filename);
+  if (!root || !hash_file(filename, hash) ||
+      !write_scene_cache(cache, root, hash)) {
+    return;
+  }
+  delete root->registry();
+
+  for (int i = 0; i < iterations; ++i) {
+    double start = now_us();
+    root = read_scene_cache(cache, hash);
+    t.samples.push_back(now_us() - start);
+    if (root) {
+      delete root->registry();
+    }
+  }
+  unlink(cache.c_str());
+}
+
+static void time_update(SceneNode* root, FlatScene& flat, TaskPool& pool,
+                        int iterations, Timing& full, Timing& one, Timing& parallel)
+{
+  std::vector<int> joints;
+  for (size_t i = 0; i < flat.size(); ++i) {
+    if (flat.type(i) == FlatScene::NODE_JOINT) {
+      joints.push_back(i);
+    }
+  }
+
+  for (int i = 0; i < iterations; ++i) {
+    root->mark_dirty();
+    double start = now_us();
+    flat.update_transforms();
+    full.samples.push_back(now_us() - start);
+
+    if (!joints.empty()) {
+      SceneNode* joint = flat.node(joints[rand() % joints.size()]);
+      joint->set_transform(Rotation(1, 'x') * joint->get_transform());
+      start = now_us();
+      flat.update_transforms();
+      one.samples.push_back(now_us() - start);
+    }
+
+    root->mark_dirty();
+    start = now_us();
+    flat.update_transforms(&pool);
+    parallel.samples.push_back(now_us() - start);
+  }
+}
+
+static void time_drag(FlatScene& flat, int iterations, Timing& t)
+{
+  std::vector<JointNode*> joints;
+  for (size_t i = 0; i < flat.size(); ++i) {
+    if (flat.type(i) == FlatScene::NODE_JOINT) {
+      joints.push_back(static_cast<JointNode*>(flat.node(i)));
+    }
+  }
+  if (joints.empty()) {
+    return;
+  }
+
+  // As in the viewer: two limbs are selected, their joints resolved
+  // once, and each motion event turns them and updates their subtrees
+  // before the next frame.
+  JointNode* drag[2] = { joints[rand() % joints.size()],
+                         joints[rand() % joints.size()] };
+  for (int i = 0; i < iterations; ++i) {
+    double d = i % 2 ? 5 : -5;
+    double start = now_us();
+    drag[0]->drag(d, d);
+    drag[1]->drag(d, d);
+    flat.update_transforms();
+    t.samples.push_back(now_us() - start);
+  }
+}
+
+static void time_animation(SceneNode* root, FlatScene& flat, int iterations, Timing& t)
+{
+  // A clip keying every joint at random times over ten seconds
+  AnimationClip clip;
+  for (size_t i = 0; i < flat.size(); ++i) {
+    if (flat.type(i) != FlatScene::NODE_JOINT) {
+      continue;
+    }
+    int track = clip.joint_track(flat.node(i)->get_name());
+    for (double time = 0; time < 10; time += 0.1 + random_unit()) {
+      clip.add_joint_key(track, time, 90 * random_unit() - 45, 90 * random_unit() - 45);
+    }
+  }
+  clip.add_root_key(0, Vector3D(0, 0, 0));
+  clip.add_root_key(10, Vector3D(5, 0, 0));
+
+  // Each sample is one 60 Hz step of playback, through to fresh world
+  // matrices
+  AnimationPlayer player(60);
+  player.bind(&clip, root->registry(), root);
+  for (int i = 0; i < iterations; ++i) {
+    double start = now_us();
+    player.advance(1.0 / 60);
+    flat.update_transforms();
+    t.samples.push_back(now_us() - start);
+  }
+  root->reset_origin();
+}
+
+static void time_crowd(SceneNode* root, TaskPool& pool, int instances, int iterations,
+                       Timing& t, Timing& parallel, size_t& bytes_per_instance)
+{
+  SkeletonTemplate skeleton(root);
+  Crowd crowd(&skeleton);
+  crowd.spawn_grid(instances, 2.2 * skeleton.radius());
+  bytes_per_instance = instances ? crowd.memory_usage() / instances : 0;
+
+  // Each sample copies the puppet's pose to every instance and
+  // evaluates the world transforms of all their parts
+  std::vector<AffineTransform> parts(crowd.size() * skeleton.part_count());
+  std::vector<AffineTransform> scratch(skeleton.node_count());
+  for (int i = 0; i < iterations && !parts.empty(); ++i) {
+    double start = now_us();
+    crowd.follow_source();
+    crowd.part_transforms(0, crowd.size(), &parts[0], &scratch[0]);
+    t.samples.push_back(now_us() - start);
+
+    start = now_us();
+    crowd.follow_source();
+    crowd.part_transforms(&parts[0], scratch, pool);
+    parallel.samples.push_back(now_us() - start);
+  }
+}
+
+// Joints in the limb time_ik() solves for, as in a puppet's leg
+static const int LIMB_JOINTS = 3;
+
+// Solve the chain from from to to for a crowd of skeleton. Each sample
+// moves every instance's target a little, as an animated goal moves
+// from frame to frame, and solves the crowd's chains for them over the
+// pool. Targets are where the chain's end is in a pose that wanders
+// within the joints' ranges, so all of them can be reached. reached is
+// how many were in the last sample.
+static void time_ik_chain(const SkeletonTemplate& skeleton, const std::string& from,
+                          const std::string& to, TaskPool& pool, int instances,
+                          int iterations, Timing& t, int& joints, size_t& reached)
+{
+  IKSolver solver(&skeleton);
+  if (instances == 0 || !solver.set_chain(from, to)) {
+    return;
+  }
+  std::vector<int> chain;
+  solver.chain_joints(chain);
+  joints = chain.size();
+
+  Crowd crowd(&skeleton), goals(&skeleton);
+  crowd.spawn_grid(instances, 2.2 * skeleton.radius());
+  goals.spawn_grid(instances, 2.2 * skeleton.radius());
+  for (int i = 0; i < instances; ++i) {
+    for (size_t k = 0; k < chain.size(); ++k) {
+      int j = chain[k];
+      double min_x = skeleton.min_angle_x(j), min_y = skeleton.min_angle_y(j);
+      goals.set_angles(i, j, min_x + (skeleton.max_angle_x(j) - min_x) * random_unit(),
+                       min_y + (skeleton.max_angle_y(j) - min_y) * random_unit());
+    }
+  }
+
+  // Crowd::set_angles() keeps the wandering goals within range
+  std::vector<Point3D> targets(instances);
+  for (int it = 0; it < iterations; ++it) {
+    for (int i = 0; i < instances; ++i) {
+      for (size_t k = 0; k < chain.size(); ++k) {
+        int j = chain[k];
+        goals.set_angles(i, j, goals.angle_x(i, j) + 10 * random_unit() - 5,
+                         goals.angle_y(i, j) + 10 * random_unit() - 5);
+      }
+      targets[i] = solver.effector(goals, i);
+    }
+
+    double start = now_us();
+    reached = solver.solve(crowd, &targets[0], &pool);
+    t.samples.push_back(now_us() - start);
+  }
+}
+
+// The limb is the chain from j1 down through first children, whose
+// joints all turn +-90 degrees either way.
+static void time_ik(SceneNode* root, TaskPool& pool, int instances, int iterations,
+                    Timing& t, int& joints, size_t& reached)
+{
+  SkeletonTemplate skeleton(root);
+  int end = skeleton.find_node("j1");
+  if (end < 0) {
+    return;
+  }
+  for (int k = 1; k < LIMB_JOINTS; ++k) {
+    int next = -1;
+    for (size_t n = end + 1; n < skeleton.node_count() && next < 0; ++n) {
+      if (skeleton.parent(n) == end && skeleton.joint(n) >= 0) {
+        next = n;
+      }
+    }
+    if (next < 0) {
+      break;
+    }
+    end = next;
+  }
+
+  time_ik_chain(skeleton, "j1", skeleton.node_name(end), pool, instances, iterations,
+                t, joints, reached);
+}
+
+// The same for a leg whose knee only bends one way, [0, 150] degrees
+// from straight, and whose ankle turns +-45: ranges with an end where
+// the chain often rests, which the puppet's do not have.
+static void time_ik_leg(TaskPool& pool, int instances, int iterations, Timing& t,
+                        int& joints, size_t& reached)
+{
+  SceneRegistry* registry = new SceneRegistry();
+  SceneNode* root = registry->create_node("root");
+  JointNode* hip = registry->create_joint("hip");
+  hip->set_joint_x(-90, 0, 90);
+  hip->set_joint_y(-90, 0, 90);
+  root->add_child(hip);
+  SceneNode* thigh = registry->create_node("thigh");
+  thigh->translate(Vector3D(0, -2, 0));
+  hip->add_child(thigh);
+  JointNode* knee = registry->create_joint("knee");
+  knee->set_joint_x(0, 0, 150);
+  knee->set_joint_y(0, 0, 0);
+  thigh->add_child(knee);
+  SceneNode* shin = registry->create_node("shin");
+  shin->translate(Vector3D(0, -2, 0));
+  knee->add_child(shin);
+  JointNode* ankle = registry->create_joint("ankle");
+  ankle->set_joint_x(-45, 0, 45);
+  ankle->set_joint_y(-45, 0, 45);
+  shin->add_child(ankle);
+  SceneNode* foot = registry->create_node("foot");
+  foot->translate(Vector3D(0, 0, 1));
+  ankle->add_child(foot);
+
+  {
+    SkeletonTemplate skeleton(root);
+    time_ik_chain(skeleton, "hip", "foot", pool, instances, iterations, t, joints,
+                  reached);
+  }
+  // The registry owns the leg
+  delete registry;
+}
+
+// Each sample culls against the frustum the renderer would use for a
+// camera swinging from 30 degrees left to 30 right, so the puppet
+// goes in and out of view. stats counts the view straight ahead.
+static void time_cull(FlatScene& flat, const BenchOptions& options, Timing& t,
+                      FrameStats& stats)
+{
+  double f = 1 / tan(20.0 * M_PI / 180);
+  double aspect = (double)options.width / options.height;
+  double near = 0.1, far = 1000;
+  double rows[16] = {
+    f / aspect, 0, 0, 0,
+    0, f, 0, 0,
+    0, 0, (far + near) / (near - far), 2 * far * near / (near - far),
+    0, 0, -1, 0
+  };
+  Matrix4x4 projection(rows);
+
+  for (int i = 0; i < options.iterations; ++i) {
+    Frustum frustum(projection * Rotation((i % 21 - 10) * 3.0, 'y').to_matrix());
+    double start = now_us();
+    flat.cull(&frustum);
+    t.samples.push_back(now_us() - start);
+  }
+
+  Frustum ahead(projection);
+  flat.cull(&ahead, &stats);
+  flat.cull(NULL);
+}
+
+static void time_traversal(SceneRenderer& renderer, const BenchOptions& options,
+                           Timing& fixed, Timing& instanced, FrameStats& fixed_stats)
+{
+  for (int pass = 0; pass < 2; ++pass) {
+    renderer.instancing = pass == 1;
+    Timing& t = pass ? instanced : fixed;
+    for (int i = 0; i < options.iterations; ++i) {
+      double start = now_us();
+      renderer.render(options.width, options.height);
+      glFinish();
+      t.samples.push_back(now_us() - start);
+    }
+    if (pass == 0) {
+      fixed_stats = renderer.stats();
+    }
+  }
+}
+
+static void time_picking(FlatScene& flat, int iterations, Timing& t)
+{
+  if (flat.geometry_count() == 0) {
+    return;
+  }
+
+  // Aim from the camera at random geometry, jittered so some rays
+  // miss.
+  Point3D origin(0, 0, 0);
+  for (int i = 0; i < iterations; ++i) {
+    const AffineTransform& w = flat.world(flat.geometry_node(rand() % flat.geometry_count()));
+    Vector3D dir(w[0][3] + random_unit() - 0.5,
+                 w[1][3] + random_unit() - 0.5,
+                 w[2][3]);
+
+    FlatScene::Hit hit;
+    double start = now_us();
+    flat.pick(origin, dir, hit);
+    t.samples.push_back(now_us() - start);
+  }
+}
+
+static void time_undo(SceneNode* root, FlatScene& flat, int iterations,
+                      Timing& undo, Timing& redo, size_t& history_bytes)
+{
+  // Only geometry hanging off a joint can be dragged
+  std::vector<int> limbs;
+  for (size_t g = 0; g < flat.geometry_count(); ++g) {
+    int index = flat.geometry_node(g);
+    if (flat.parent(index) >= 0 &&
+        flat.type(flat.parent(index)) == FlatScene::NODE_JOINT) {
+      limbs.push_back(index);
+    }
+  }
+  if (limbs.empty()) {
+    return;
+  }
+
+  UndoHistory history;
+  history.set_registry(root->registry());
+
+  // Record a history of drags, as the viewer does between button
+  // press and release
+  for (int i = 0; i < iterations; ++i) {
+    SceneNode* limb = flat.node(limbs[rand() % limbs.size()]);
+    limb->toggle_selected();
+
+    std::vector<JointNode*> joints;
+    flat.selected_joints(joints);
+    history.begin_step(joints);
+    double dx = random_unit() * 20 - 10, dy = random_unit() * 20 - 10;
+    for (size_t j = 0; j < joints.size(); ++j) {
+      joints[j]->drag(dx, dy);
+    }
+    history.end_step();
+
+    limb->toggle_selected();
+  }
+  history_bytes = history.memory_usage();
+
+  for (int i = 0; i < iterations; ++i) {
+    double start = now_us();
+    history.undo();
+    undo.samples.push_back(now_us() - start);
+  }
+  for (int i = 0; i < iterations; ++i) {
+    double start = now_us();
+    history.redo();
+    redo.samples.push_back(now_us() - start);
+  }
+}
+
+// A random transform of the kind the scene builds: rotation, non-uniform
+// scale and translation
+static Matrix4x4 random_affine()
+{
+  return (Translation(Vector3D(random_unit() * 20 - 10, random_unit() * 20 - 10,
+                              random_unit() * 20 - 10)) *
+    Rotation(random_unit() * 360, 'x') * Rotation(random_unit() * 360, 'y') *
+    Rotation(random_unit() * 360, 'z') *
+    Scaling(Vector3D(random_unit() * 2 + 0.1, random_unit() * 2 + 0.1,
+                     random_unit() * 2 + 0.1))).to_matrix();
+}
+
+static double max_difference(const double* a, const double* b, size_t n)
+{
+  double err = 0;
+  for (size_t i = 0; i < n; ++i) {
+    err = std::max(err, fabs(a[i] - b[i]) / std::max(1.0, fabs(b[i])));
+  }
+  return err;
+}
+
+// Check every matrix kernel set the CPU supports against the scalar
+// reference, and time each one over batches of BATCH operations.
+static void time_matrix_kernels(int iterations, std::vector<Timing>& timings,
+                                std::vector<KernelCheck>& checks)
+{
+  const size_t BATCH = 1000;
+  std::vector<Matrix4x4> a(BATCH), b(BATCH), out(BATCH), ref(BATCH);
+  std::vector<double> points(3 * BATCH), out_points(3 * BATCH), ref_points(3 * BATCH);
+  for (size_t i = 0; i < BATCH; ++i) {
+    a[i] = random_affine();
+    b[i] = random_affine();
+  }
+  for (size_t i = 0; i < points.size(); ++i) {
+    points[i] = random_unit() * 20 - 10;
+  }
+
+  const MatrixKernels& scalar = scalar_matrix_kernels;
+  for (const MatrixKernels* const* k = available_matrix_kernels(); *k; ++k) {
+    const MatrixKernels& kernels = **k;
+    KernelCheck check;
+    check.name = kernels.name;
+    check.max_error = 0;
+
+    for (size_t i = 0; i < BATCH; ++i) {
+      kernels.multiply(a[i].begin(), b[i].begin(), out[i].begin());
+      scalar.multiply(a[i].begin(), b[i].begin(), ref[i].begin());
+      check.max_error = std::max(check.max_error,
+                                 max_difference(out[i].begin(), ref[i].begin(), 16));
+
+      kernels.transpose(a[i].begin(), out[i].begin());
+      scalar.transpose(a[i].begin(), ref[i].begin());
+      check.max_error = std::max(check.max_error,
+                                 max_difference(out[i].begin(), ref[i].begin(), 16));
+
+      // The reference inverse is the general Gauss-Jordan one
+      ref[i] = a[i].invert_general();
+      if (!kernels.invert_affine(a[i].begin(), out[i].begin())) {
+        check.max_error = HUGE_VAL;
+      }
+      check.max_error = std::max(check.max_error,
+                                 max_difference(out[i].begin(), ref[i].begin(), 16));
+
+      // The affine entries read and write only the top three rows
+      if (!kernels.invert_affine_3x4(a[i].begin(), out[i].begin())) {
+        check.max_error = HUGE_VAL;
+      }
+      check.max_error = std::max(check.max_error,
+                                 max_difference(out[i].begin(), ref[i].begin(), 12));
+      kernels.multiply_affine(a[i].begin(), b[i].begin(), out[i].begin());
+      scalar.multiply_affine(a[i].begin(), b[i].begin(), ref[i].begin());
+      check.max_error = std::max(check.max_error,
+                                 max_difference(out[i].begin(), ref[i].begin(), 12));
+    }
+
+    kernels.transform_points(a[0].begin(), &points[0], &out_points[0], BATCH);
+    scalar.transform_points(a[0].begin(), &points[0], &ref_points[0], BATCH);
+    check.max_error = std::max(check.max_error,
+                               max_difference(&out_points[0], &ref_points[0], 3 * BATCH));
+    kernels.transform_vectors(a[0].begin(), &points[0], &out_points[0], BATCH);
+    scalar.transform_vectors(a[0].begin(), &points[0], &ref_points[0], BATCH);
+    check.max_error = std::max(check.max_error,
+                               max_difference(&out_points[0], &ref_points[0], 3 * BATCH));
+    checks.push_back(check);
+
+    Timing multiply("matrix_multiply_x1000_" + check.name);
+    Timing invert("matrix_invert_x1000_" + check.name);
+    Timing transform("matrix_transform_points_x1000_" + check.name);
+    Timing affine_multiply("affine_multiply_x1000_" + check.name);
+    Timing affine_invert("affine_invert_x1000_" + check.name);
+    for (int it = 0; it < iterations; ++it) {
+      double start = now_us();
+      for (size_t i = 0; i < BATCH; ++i) {
+        kernels.multiply(a[i].begin(), b[i].begin(), out[i].begin());
+      }
+      multiply.samples.push_back(now_us() - start);
+
+      start = now_us();
+      for (size_t i = 0; i < BATCH; ++i) {
+        kernels.invert_affine(a[i].begin(), out[i].begin());
+      }
+      invert.samples.push_back(now_us() - start);
+
+      start = now_us();
+      kernels.transform_points(a[it % BATCH].begin(), &points[0], &out_points[0], BATCH);
+      transform.samples.push_back(now_us() - start);
+
+      start = now_us();
+      for (size_t i = 0; i < BATCH; ++i) {
+        kernels.multiply_affine(a[i].begin(), b[i].begin(), out[i].begin());
+      }
+      affine_multiply.samples.push_back(now_us() - start);
+
+      start = now_us();
+      for (size_t i = 0; i < BATCH; ++i) {
+        kernels.invert_affine_3x4(a[i].begin(), out[i].begin());
+      }
+      affine_invert.samples.push_back(now_us() - start);
+    }
+    timings.push_back(multiply);
+    timings.push_back(invert);
+    timings.push_back(transform);
+    timings.push_back(affine_multiply);
+    timings.push_back(affine_invert);
+  }
+
+  // The general inverse, for comparison
+  Timing general("matrix_invert_general_x1000");
+  for (int it = 0; it < iterations; ++it) {
+    double start = now_us();
+    for (size_t i = 0; i < BATCH; ++i) {
+      out[i] = a[i].invert_general();
+    }
+    general.samples.push_back(now_us() - start);
+  }
+  timings.push_back(general);
+
+  // AffineTransform, which is what scene nodes store, through the
+  // active kernels
+  std::vector<AffineTransform> fa(BATCH), fb(BATCH), fout(BATCH);
+  KernelCheck check;
+  check.name = "affine";
+  check.max_error = 0;
+  for (size_t i = 0; i < BATCH; ++i) {
+    fa[i] = AffineTransform(a[i]);
+    fb[i] = AffineTransform(b[i]);
+    Matrix4x4 product = (fa[i] * fb[i]).to_matrix();
+    Matrix4x4 inverse = fa[i].invert().to_matrix();
+    check.max_error = std::max(check.max_error,
+                               max_difference(product.begin(), (a[i] * b[i]).begin(), 16));
+    check.max_error = std::max(check.max_error,
+                               max_difference(inverse.begin(), a[i].invert_general().begin(), 16));
+  }
+  checks.push_back(check);
+
+  Timing compose("affine_multiply_x1000");
+  Timing invert("affine_invert_x1000");
+  for (int it = 0; it < iterations; ++it) {
+    double start = now_us();
+    for (size_t i = 0; i < BATCH; ++i) {
+      fout[i] = fa[i] * fb[i];
+    }
+    compose.samples.push_back(now_us() - start);
+
+    start = now_us();
+    for (size_t i = 0; i < BATCH; ++i) {
+      fout[i] = fa[i].invert();
+    }
+    invert.samples.push_back(now_us() - start);
+  }
+  timings.push_back(compose);
+  timings.push_back(invert);
+}
+
+static void write_json(std::ostream& out, const BenchOptions& options,
+                       int nodes, size_t geometry, size_t history_bytes,
+                       size_t crowd_bytes, int ik_joints, size_t ik_reached,
+                       int leg_joints, size_t leg_reached,
+                       int threads, const FrameStats& cull_stats,
+                       const FrameStats& fixed_stats,
+                       const std::vector<KernelCheck>& checks,
+                       std::vector<Timing>& timings)
+{
+  out << "{\n"
+      << "  \"scene\": { \"depth\": " << options.depth
+      << ", \"branching\": " << options.branching
+      << ", \"nodes\": " << nodes
+      << ", \"geometry\": " << geometry << " },\n"
+      << "  \"viewport\": [" << options.width << ", " << options.height << "],\n"
+      << "  \"threads\": " << threads << ",\n"
+      << "  \"undo_history_bytes\": " << history_bytes << ",\n"
+      << "  \"crowd\": { \"instances\": " << options.crowd
+      << ", \"bytes_per_instance\": " << crowd_bytes
+      << ", \"ik\": { \"joints\": " << ik_joints
+      << ", \"reached\": " << ik_reached
+      << ", \"reach_rate\": " << (options.crowd ? (double)ik_reached / options.crowd : 0)
+      << " }, \"ik_leg\": { \"joints\": " << leg_joints
+      << ", \"reached\": " << leg_reached
+      << ", \"reach_rate\": " << (options.crowd ? (double)leg_reached / options.crowd : 0)
+      << " } },\n"
+      << "  \"culling\": { \"visible\": " << cull_stats.visible
+      << ", \"culled\": " << cull_stats.culled << " },\n"
+      << "  \"fixed_function_materials\": { \"changes\": " << fixed_stats.material_changes
+      << ", \"skipped\": " << fixed_stats.material_changes_skipped << " },\n"
+      << "  \"matrix_kernels\": { \"active\": \"" << matrix_kernels->name
+      << "\", \"checked\": [";
+  for (size_t i = 0; i < checks.size(); ++i) {
+    out << (i ? ", " : "") << "{ \"name\": \"" << checks[i].name
+        << "\", \"max_error\": " << checks[i].max_error
+        << ", \"ok\": " << (checks[i].max_error <= KERNEL_TOLERANCE ? "true" : "false")
+        << " }";
+  }
+  out << "] },\n"
+      << "  \"results\": [\n";
+
+  bool first = true;
+  for (std::vector<Timing>::iterator it = timings.begin(); it != timings.end(); ++it) {
+    if (it->samples.empty()) {
+      continue;
+    }
+    std::sort(it->samples.begin(), it->samples.end());
+    double mean = 0;
+    for (size_t i = 0; i < it->samples.size(); ++i) {
+      mean += it->samples[i];
+    }
+    mean /= it->samples.size();
+
+    out << (first ? "" : ",\n")
+        << "    { \"name\": \"" << it->name << "\""
+        << ", \"samples\": " << it->samples.size()
+        << ", \"median_us\": " << percentile(it->samples, 0.5)
+        << ", \"p99_us\": " << percentile(it->samples, 0.99)
+        << ", \"mean_us\": " << mean << " }";
+    first = false;
+  }
+  out << "\n  ]\n}\n";
+}
+
+static void usage(const char* name)
+{
+  std::cerr << "Usage: " << name << " [--depth N] [--branching N] [--nodes N]"
+            << " [--iterations N] [--size WxH] [--seed N] [--crowd N]"
+            << " [--threads N] [--output file]"
+            << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  BenchOptions options;
+  for (int i = 1; i < argc; ++i) {
+    bool more = i + 1 < argc;
+    if (more && strcmp(argv[i], "--depth") == 0) {
+      options.depth = atoi(argv[++i]);
+    }
+    else if (more && strcmp(argv[i], "--branching") == 0) {
+      options.branching = atoi(argv[++i]);
+    }
+    else if (more && strcmp(argv[i], "--nodes") == 0) {
+      options.nodes = atoi(argv[++i]);
+    }
+    else if (more && strcmp(argv[i], "--iterations") == 0) {
+      options.iterations = atoi(argv[++i]);
+    }
+    else if (more && strcmp(argv[i], "--size") == 0) {
+      if (sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2) {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    else if (more && strcmp(argv[i], "--seed") == 0) {
+      options.seed = atoi(argv[++i]);
+    }
+    else if (more && strcmp(argv[i], "--crowd") == 0) {
+      options.crowd = atoi(argv[++i]);
+    }
+    else if (more && strcmp(argv[i], "--threads") == 0) {
+      options.threads = atoi(argv[++i]);
+    }
+    else if (more && strcmp(argv[i], "--output") == 0) {
+      options.output = argv[++i];
+    }
+    else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (options.depth < 1 || options.branching < 1 || options.nodes < 3 ||
+      options.iterations < 1 || options.crowd < 0 || options.threads < 0 ||
+      options.width <= 0 || options.height <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  srand(options.seed);
+
+  // import_lua reads from a file, so the puppet goes through one
+  char filename[] = "/tmp/puppet-bench-XXXXXX";
+  int fd = mkstemp(filename);
+  if (fd < 0) {
+    std::cerr << "Could not create a temporary scene file" << std::endl;
+    return 1;
+  }
+  close(fd);
+
+  int nodes;
+  {
+    std::ofstream script(filename);
+    nodes = generate_puppet(script, options);
+  }
+
+  std::vector<Timing> timings;
+  timings.push_back(Timing("import"));
+  timings.push_back(Timing("import_cached"));
+  timings.push_back(Timing("update_full"));
+  timings.push_back(Timing("update_one_joint"));
+  timings.push_back(Timing("traverse_fixed"));
+  timings.push_back(Timing("traverse_instanced"));
+  timings.push_back(Timing("pick"));
+  timings.push_back(Timing("undo"));
+  timings.push_back(Timing("redo"));
+  timings.push_back(Timing("drag"));
+  timings.push_back(Timing("animate"));
+  timings.push_back(Timing("crowd_pose"));
+  timings.push_back(Timing("update_full_parallel"));
+  timings.push_back(Timing("crowd_pose_parallel"));
+  timings.push_back(Timing("cull"));
+  timings.push_back(Timing("ik_crowd"));
+  timings.push_back(Timing("ik_crowd_leg"));
+
+  time_import(filename, std::min(options.iterations, 20), timings[0]);
+  time_import_cached(filename, std::min(options.iterations, 20), timings[1]);
+
+  SceneNode* root = import_lua(filename);
+  unlink(filename);
+  if (!root) {
+    std::cerr << "Could not import the generated puppet" << std::endl;
+    return 1;
+  }
+
+  TaskPool pool(options.threads);
+  SceneRenderer renderer;
+  renderer.set_task_pool(&pool);
+  renderer.set_scene_node(root);
+  FlatScene& flat = renderer.scene();
+  flat.update_transforms();
+
+  time_update(root, flat, pool, options.iterations, timings[2], timings[3], timings[12]);
+  FrameStats cull_stats;
+  time_cull(flat, options, timings[14], cull_stats);
+
+  // Traversal needs GL; the other stages are still worth reporting
+  // without it.
+  OffscreenContext context;
+  FrameStats fixed_stats;
+  if (context.create(options.width, options.height)) {
+    renderer.init_gl();
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    time_traversal(renderer, options, timings[4], timings[5], fixed_stats);
+  }
+  else {
+    std::cerr << "No GL context, skipping traversal" << std::endl;
+  }
+
+  renderer.sync();
+  time_picking(flat, options.iterations, timings[6]);
+  size_t history_bytes = 0;
+  time_undo(root, flat, options.iterations, timings[7], timings[8], history_bytes);
+  time_drag(flat, options.iterations, timings[9]);
+  time_animation(root, flat, options.iterations, timings[10]);
+  size_t crowd_bytes = 0;
+  time_crowd(root, pool, options.crowd, options.iterations, timings[11], timings[13],
+             crowd_bytes);
+  int ik_joints = 0;
+  size_t ik_reached = 0;
+  time_ik(root, pool, options.crowd, options.iterations, timings[15], ik_joints, ik_reached);
+  int leg_joints = 0;
+  size_t leg_reached = 0;
+  time_ik_leg(pool, options.crowd, options.iterations, timings[16], leg_joints, leg_reached);
+
+  std::vector<KernelCheck> checks;
+  time_matrix_kernels(options.iterations, timings, checks);
+
+  if (options.output == "-") {
+    write_json(std::cout, options, nodes, flat.geometry_count(), history_bytes,
+               crowd_bytes, ik_joints, ik_reached, leg_joints, leg_reached,
+               pool.thread_count(), cull_stats,
+               fixed_stats, checks, timings);
+  }
+  else {
+    std::ofstream out(options.output.c_str());
+    write_json(out, options, nodes, flat.geometry_count(), history_bytes,
+               crowd_bytes, ik_joints, ik_reached, leg_joints, leg_reached,
+               pool.thread_count(), cull_stats,
+               fixed_stats, checks, timings);
+    if (!out) {
+      std::cerr << "Could not write " << options.output << std::endl;
+      return 1;
+    }
+  }
+
+  // A kernel set that disagrees with the reference is a bug, not a
+  // slow result
+  for (size_t i = 0; i < checks.size(); ++i) {
+    if (checks[i].max_error > KERNEL_TOLERANCE) {
+      std::cerr << "Matrix kernels " << checks[i].name
+                << " differ from the scalar reference by "
+                << checks[i].max_error << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,377 @@
+#include "bvh.hpp"
+
+AABB AABB::of_unit_sphere(const AffineTransform& m)
+{
+  // Each row of the linear part, as a vector, has the ellipsoid's
+  // extent along that axis as its length.
+  AABB box;
+  for (int k = 0; k < 3; ++k) {
+    double extent = sqrt(m[k][0]*m[k][0] + m[k][1]*m[k][1] + m[k][2]*m[k][2]);
+    box.min[k] = m[k][3] - extent;
+    box.max[k] = m[k][3] + extent;
+  }
+  return box;
+}
+
+void BoundingSphere::expand(const BoundingSphere& other)
+{
+  if (other.empty()) {
+    return;
+  }
+  if (empty()) {
+    *this = other;
+    return;
+  }
+
+  Vector3D d = other.centre - centre;
+  double distance = d.length();
+  if (distance + other.radius <= radius) {
+    return;
+  }
+  if (distance + radius <= other.radius) {
+    *this = other;
+    return;
+  }
+
+  // The new sphere spans both along the line through their centres
+  double r = (distance + radius + other.radius) / 2;
+  centre = centre + ((r - radius) / distance) * d;
+  radius = r;
+}
+
+BoundingSphere BoundingSphere::of_unit_sphere(const AffineTransform& m)
+{
+  // The radius is the largest singular value of the linear part L,
+  // the square root of the largest eigenvalue of L^T L. Both the
+  // trace and Gershgorin's largest row sum bound that eigenvalue from
+  // above; the row sum is exact when L^T L is diagonal, as it is for
+  // a rotation times a scaling.
+  double a[3][3];
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      a[i][j] = m[0][i]*m[0][j] + m[1][i]*m[1][j] + m[2][i]*m[2][j];
+    }
+  }
+  double rows = 0;
+  for (int i = 0; i < 3; ++i) {
+    rows = std::max(rows, fabs(a[i][0]) + fabs(a[i][1]) + fabs(a[i][2]));
+  }
+  double trace = a[0][0] + a[1][1] + a[2][2];
+  return BoundingSphere(Point3D(m[0][3], m[1][3], m[2][3]), sqrt(std::min(rows, trace)));
+}
+
+Frustum::Frustum(const Matrix4x4& clip)
+{
+  // Gribb and Hartmann: each plane is the last row of the clip matrix
+  // plus or minus one of the others.
+  for (int k = 0; k < 3; ++k) {
+    for (int c = 0; c < 4; ++c) {
+      planes[2*k][c] = clip[3][c] + clip[k][c];
+      planes[2*k + 1][c] = clip[3][c] - clip[k][c];
+    }
+  }
+
+  for (int p = 0; p < 6; ++p) {
+    double len = sqrt(planes[p][0]*planes[p][0] + planes[p][1]*planes[p][1] +
+                      planes[p][2]*planes[p][2]);
+    if (len > 0) {
+      for (int c = 0; c < 4; ++c) {
+        planes[p][c] /= len;
+      }
+    }
+  }
+}
+
+bool Frustum::outside(const AABB& box) const
+{
+  for (int p = 0; p < 6; ++p) {
+    // The corner furthest along the plane normal
+    double d = planes[p][3];
+    for (int k = 0; k < 3; ++k) {
+      d += planes[p][k] * (planes[p][k] >= 0 ? box.max[k] : box.min[k]);
+    }
+    if (d < 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Frustum::outside(const Point3D& centre, double radius) const
+{
+  for (int p = 0; p < 6; ++p) {
+    double d = planes[p][0] * centre[0] + planes[p][1] * centre[1] +
+               planes[p][2] * centre[2] + planes[p][3];
+    if (d < -radius) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Ray against box, clipped to [0, tmax]. Returns the entry parameter,
+// or HUGE_VAL on a miss.
+static double ray_box(const AABB& box, const Point3D& origin,
+                      const double inv_dir[3], double tmax)
+{
+  double t0 = 0, t1 = tmax;
+  for (int k = 0; k < 3; ++k) {
+    double near = (box.min[k] - origin[k]) * inv_dir[k];
+    double far = (box.max[k] - origin[k]) * inv_dir[k];
+    if (near > far) {
+      std::swap(near, far);
+    }
+    // NaN (0 * inf) leaves the interval alone
+    if (near > t0) t0 = near;
+    if (far < t1) t1 = far;
+    if (t0 > t1) {
+      return HUGE_VAL;
+    }
+  }
+  return t0;
+}
+
+// Orders item ids by one coordinate of their box centres
+struct CentreLess {
+  CentreLess(const std::vector<Point3D>& centres, int axis)
+    : centres(centres), axis(axis)
+  {
+  }
+
+  bool operator()(int a, int b) const
+  {
+    return centres[a][axis] < centres[b][axis];
+  }
+
+  const std::vector<Point3D>& centres;
+  int axis;
+};
+
+BVH::BVH()
+{
+}
+
+void BVH::clear()
+{
+  m_nodes.clear();
+  m_items.clear();
+  m_boxes.clear();
+  m_leaf.clear();
+  m_stale.clear();
+  m_refit.clear();
+}
+
+void BVH::build(const std::vector<AABB>& boxes)
+{
+  clear();
+  if (boxes.empty()) {
+    return;
+  }
+
+  m_boxes = boxes;
+  m_leaf.resize(boxes.size());
+  m_centres.resize(boxes.size());
+  for (size_t i = 0; i < boxes.size(); ++i) {
+    m_items.push_back(i);
+    m_centres[i] = Point3D((boxes[i].min[0] + boxes[i].max[0]) / 2,
+                           (boxes[i].min[1] + boxes[i].max[1]) / 2,
+                           (boxes[i].min[2] + boxes[i].max[2]) / 2);
+  }
+
+  m_nodes.reserve(2 * boxes.size() / LEAF_SIZE + 1);
+  build_node(-1, 0, boxes.size());
+  m_stale.assign(m_nodes.size(), 0);
+}
+
+int BVH::build_node(int parent, int begin, int end)
+{
+  int index = m_nodes.size();
+  m_nodes.push_back(Node());
+  m_nodes[index].parent = parent;
+
+  AABB box, centres;
+  for (int i = begin; i < end; ++i) {
+    box.expand(m_boxes[m_items[i]]);
+    const Point3D& c = m_centres[m_items[i]];
+    for (int k = 0; k < 3; ++k) {
+      centres.min[k] = std::min(centres.min[k], c[k]);
+      centres.max[k] = std::max(centres.max[k], c[k]);
+    }
+  }
+  m_nodes[index].box = box;
+
+  if (end - begin <= LEAF_SIZE) {
+    m_nodes[index].left = m_nodes[index].right = -1;
+    m_nodes[index].first = begin;
+    m_nodes[index].count = end - begin;
+    for (int i = begin; i < end; ++i) {
+      m_leaf[m_items[i]] = index;
+    }
+    return index;
+  }
+
+  // Median split along the axis where the centres spread the most
+  int axis = 0;
+  for (int k = 1; k < 3; ++k) {
+    if (centres.max[k] - centres.min[k] > centres.max[axis] - centres.min[axis]) {
+      axis = k;
+    }
+  }
+  int mid = (begin + end) / 2;
+  std::nth_element(m_items.begin() + begin, m_items.begin() + mid,
+                   m_items.begin() + end, CentreLess(m_centres, axis));
+
+  int left = build_node(index, begin, mid);
+  int right = build_node(index, mid, end);
+  m_nodes[index].left = left;
+  m_nodes[index].right = right;
+  m_nodes[index].first = m_nodes[index].count = 0;
+  return index;
+}
+
+void BVH::update(int item, const AABB& box)
+{
+  m_boxes[item] = box;
+
+  // Queue the leaf and every ancestor not already queued
+  for (int n = m_leaf[item]; n >= 0 && !m_stale[n]; n = m_nodes[n].parent) {
+    m_stale[n] = 1;
+    m_refit.push_back(n);
+  }
+}
+
+void BVH::refit()
+{
+  // Children come after their parents, so refitting in decreasing
+  // index order sees every child before its parent.
+  std::sort(m_refit.begin(), m_refit.end());
+  for (size_t i = m_refit.size(); i-- > 0; ) {
+    refit_node(m_refit[i]);
+    m_stale[m_refit[i]] = 0;
+  }
+  m_refit.clear();
+}
+
+void BVH::refit_node(int index)
+{
+  Node& node = m_nodes[index];
+  node.box.clear();
+  if (node.left < 0) {
+    for (int i = node.first; i < node.first + node.count; ++i) {
+      node.box.expand(m_boxes[m_items[i]]);
+    }
+  }
+  else {
+    node.box.expand(m_nodes[node.left].box);
+    node.box.expand(m_nodes[node.right].box);
+  }
+}
+
+int BVH::raycast(const Point3D& origin, const Vector3D& dir, double tmax,
+                 RayTest& test, double& t) const
+{
+  int best = -1;
+  t = tmax;
+  if (m_nodes.empty()) {
+    return best;
+  }
+
+  double inv_dir[3];
+  for (int k = 0; k < 3; ++k) {
+    inv_dir[k] = 1.0 / dir[k];
+  }
+
+  std::vector<int> stack;
+  stack.push_back(0);
+  while (!stack.empty()) {
+    const Node& node = m_nodes[stack.back()];
+    stack.pop_back();
+
+    if (ray_box(node.box, origin, inv_dir, t) == HUGE_VAL) {
+      continue;
+    }
+
+    if (node.left < 0) {
+      for (int i = node.first; i < node.first + node.count; ++i) {
+        double hit = test.intersect(m_items[i]);
+        if (hit > 0 && hit < t) {
+          t = hit;
+          best = m_items[i];
+        }
+      }
+      continue;
+    }
+
+    // Visit the nearer child first so it can shrink t for the other
+    double tl = ray_box(m_nodes[node.left].box, origin, inv_dir, t);
+    double tr = ray_box(m_nodes[node.right].box, origin, inv_dir, t);
+    if (tl <= tr) {
+      if (tr != HUGE_VAL) stack.push_back(node.right);
+      if (tl != HUGE_VAL) stack.push_back(node.left);
+    }
+    else {
+      if (tl != HUGE_VAL) stack.push_back(node.left);
+      stack.push_back(node.right);
+    }
+  }
+
+  return best;
+}
+
+void BVH::query(const AABB& box, std::vector<int>& items) const
+{
+  if (m_nodes.empty()) {
+    return;
+  }
+
+  std::vector<int> stack;
+  stack.push_back(0);
+  while (!stack.empty()) {
+    const Node& node = m_nodes[stack.back()];
+    stack.pop_back();
+
+    if (!node.box.overlaps(box)) {
+      continue;
+    }
+    if (node.left < 0) {
+      for (int i = node.first; i < node.first + node.count; ++i) {
+        if (m_boxes[m_items[i]].overlaps(box)) {
+          items.push_back(m_items[i]);
+        }
+      }
+    }
+    else {
+      stack.push_back(node.right);
+      stack.push_back(node.left);
+    }
+  }
+}
+
+void BVH::query(const Frustum& frustum, std::vector<int>& items) const
+{
+  if (m_nodes.empty()) {
+    return;
+  }
+
+  std::vector<int> stack;
+  stack.push_back(0);
+  while (!stack.empty()) {
+    const Node& node = m_nodes[stack.back()];
+    stack.pop_back();
+
+    if (frustum.outside(node.box)) {
+      continue;
+    }
+    if (node.left < 0) {
+      for (int i = node.first; i < node.first + node.count; ++i) {
+        if (!frustum.outside(m_boxes[m_items[i]])) {
+          items.push_back(m_items[i]);
+        }
+      }
+    }
+    else {
+      stack.push_back(node.right);
+      stack.push_back(node.left);
+    }
+  }
+}
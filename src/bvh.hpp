@@ -0,0 +1,145 @@
+#ifndef CS488_BVH_HPP
+#define CS488_BVH_HPP
+
+#include <vector>
+#include "algebra.hpp"
+#include "affine.hpp"
+
+// Axis-aligned bounding box
+struct AABB {
+  AABB()
+  {
+    clear();
+  }
+
+  // Make the box empty, so that any expand() replaces it
+  void clear()
+  {
+    for (int k = 0; k < 3; ++k) {
+      min[k] = HUGE_VAL;
+      max[k] = -HUGE_VAL;
+    }
+  }
+
+  void expand(const AABB& other)
+  {
+    for (int k = 0; k < 3; ++k) {
+      min[k] = std::min(min[k], other.min[k]);
+      max[k] = std::max(max[k], other.max[k]);
+    }
+  }
+
+  bool overlaps(const AABB& other) const
+  {
+    for (int k = 0; k < 3; ++k) {
+      if (min[k] > other.max[k] || max[k] < other.min[k]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Bounds of the unit sphere under the affine transform m
+  static AABB of_unit_sphere(const AffineTransform& m);
+
+  double min[3], max[3];
+};
+
+// A sphere bounding a set of parts; a negative radius means the set
+// is empty
+struct BoundingSphere {
+  BoundingSphere() : radius(-1) {}
+  BoundingSphere(const Point3D& centre, double radius) : centre(centre), radius(radius) {}
+
+  bool empty() const { return radius < 0; }
+
+  // Grow to the smallest sphere enclosing both this and other
+  void expand(const BoundingSphere& other);
+
+  // A sphere around the unit sphere under the affine transform m,
+  // tight when m's linear part is a rotation times a scaling
+  static BoundingSphere of_unit_sphere(const AffineTransform& m);
+
+  Point3D centre;
+  double radius;
+};
+
+// The six clip planes of a view frustum, each stored as (a, b, c, d)
+// with a*x + b*y + c*z + d >= 0 on the inside.
+struct Frustum {
+  // Extract the planes from a row-major projection * view matrix;
+  // the frustum is then expressed in that matrix's input space.
+  Frustum(const Matrix4x4& clip);
+
+  bool outside(const AABB& box) const;
+  bool outside(const Point3D& centre, double radius) const;
+  bool outside(const BoundingSphere& sphere) const
+  {
+    return outside(sphere.centre, sphere.radius);
+  }
+
+  double planes[6][4];
+};
+
+// A bounding volume hierarchy over a set of numbered boxes.
+//
+// Nodes are stored in one array with every child after its parent,
+// so refitting is a backwards sweep over the nodes whose bounds may
+// have changed. Leaves hold up to LEAF_SIZE items.
+class BVH {
+public:
+  enum { LEAF_SIZE = 4 };
+
+  // Exact ray test for one item, supplied by the caller of raycast()
+  struct RayTest {
+    virtual ~RayTest() {}
+    // The ray parameter of the first hit with item, or HUGE_VAL
+    virtual double intersect(int item) = 0;
+  };
+
+  BVH();
+
+  // Build from scratch over items 0 .. boxes.size() - 1
+  void build(const std::vector<AABB>& boxes);
+  void clear();
+  bool empty() const { return m_nodes.empty(); }
+
+  // Record a new box for item; the tree is not correct again until
+  // refit() has been called.
+  void update(int item, const AABB& box);
+  // Recompute the bounds of every node above an updated item
+  void refit();
+
+  // Nearest hit of origin + t * dir for 0 < t < tmax, or -1. t is set
+  // to the hit parameter.
+  int raycast(const Point3D& origin, const Vector3D& dir, double tmax,
+              RayTest& test, double& t) const;
+  // Append every item whose box overlaps box / is not outside frustum
+  void query(const AABB& box, std::vector<int>& items) const;
+  void query(const Frustum& frustum, std::vector<int>& items) const;
+
+private:
+  struct Node {
+    AABB box;
+    int parent;
+    // Inner nodes: the two children. Leaves: left == -1 and the items
+    // are m_items[first .. first + count).
+    int left, right;
+    int first, count;
+  };
+
+  int build_node(int parent, int begin, int end);
+  void refit_node(int node);
+
+  std::vector<Node> m_nodes;
+  std::vector<int> m_items;       // item ids, grouped by leaf
+  std::vector<AABB> m_boxes;      // by item id
+  std::vector<int> m_leaf;        // leaf node of each item id
+  std::vector<unsigned char> m_stale;
+  std::vector<int> m_refit;       // nodes queued for refit()
+
+  // Scratch space for build()
+  std::vector<Point3D> m_centres;
+};
+
+#endif
@@ -0,0 +1,335 @@
+#include "crowd.hpp"
+#include "scene.hpp"
+#include "a3.hpp"
+#include "taskpool.hpp"
+#include <algorithm>
+#include <math.h>
+
+// Rotation(z, 'z') * Rotation(x, 'x'), built directly with one sine
+// and cosine per angle
+static AffineTransform joint_turn(double x, double z)
+{
+  double sx = sin(x * M_PI / 180), cx = cos(x * M_PI / 180);
+  double sz = sin(z * M_PI / 180), cz = cos(z * M_PI / 180);
+  AffineTransform r;
+  r[0][0] = cz;
+  r[0][1] = -sz * cx;
+  r[0][2] = sz * sx;
+  r[1][0] = sz;
+  r[1][1] = cz * cx;
+  r[1][2] = -cz * sx;
+  r[2][1] = sx;
+  r[2][2] = cx;
+  return r;
+}
+
+// Poses runs of instances, each thread in its own scratch space
+class CrowdPoseJob : public TaskJob {
+public:
+  CrowdPoseJob(const Crowd& crowd, AffineTransform* out, AffineTransform* scratch)
+    : m_crowd(crowd), m_out(out), m_scratch(scratch)
+  {
+  }
+
+  virtual void run(size_t begin, size_t end, int worker)
+  {
+    const SkeletonTemplate& s = m_crowd.skeleton();
+    m_crowd.part_transforms(begin, end, m_out + begin * s.part_count(),
+                            m_scratch + worker * s.node_count());
+  }
+
+private:
+  const Crowd& m_crowd;
+  AffineTransform* m_out;
+  AffineTransform* m_scratch;
+};
+
+/*
+ * SkeletonTemplate
+ */
+
+SkeletonTemplate::SkeletonTemplate(SceneNode* root)
+  : m_source(root),
+    m_radius(0),
+    m_reach(0)
+{
+  if (!root) {
+    return;
+  }
+  flatten(root, -1);
+
+  order_by_material(m_part_material, m_materials.size(), m_draw_order);
+
+  // Bound the initial pose in the root's own frame
+  std::vector<AffineTransform> world(m_parent.size());
+  for (size_t i = 1; i < m_parent.size(); ++i) {
+    world[i] = world[m_parent[i]] * m_init[i];
+  }
+  for (size_t p = 0; p < m_part_node.size(); ++p) {
+    const AffineTransform& w = world[m_part_node[p]];
+    double extent = 0;
+    for (int c = 0; c < 3; ++c) {
+      extent = std::max(extent, w[0][c]*w[0][c] + w[1][c]*w[1][c] + w[2][c]*w[2][c]);
+    }
+    double centre = w[0][3]*w[0][3] + w[1][3]*w[1][3] + w[2][3]*w[2][3];
+    m_radius = std::max(m_radius, sqrt(centre) + sqrt(extent));
+  }
+
+  // Bound each node's distance from the root and the stretch of its
+  // linear part, neither of which a joint's turn can change
+  std::vector<double> reach(m_parent.size(), 0), stretch(m_parent.size(), 1);
+  for (size_t i = 1; i < m_parent.size(); ++i) {
+    const AffineTransform& m = m_init[i];
+    int p = m_parent[i];
+    double offset = sqrt(m[0][3]*m[0][3] + m[1][3]*m[1][3] + m[2][3]*m[2][3]);
+    reach[i] = reach[p] + stretch[p] * offset;
+    stretch[i] = stretch[p] * BoundingSphere::of_unit_sphere(m).radius;
+  }
+  for (size_t p = 0; p < m_part_node.size(); ++p) {
+    int n = m_part_node[p];
+    m_reach = std::max(m_reach, reach[n] + stretch[n]);
+  }
+}
+
+void SkeletonTemplate::flatten(SceneNode* node, int parent)
+{
+  int index = m_parent.size();
+  m_parent.push_back(parent);
+  m_name.push_back(node->get_name());
+  m_init.push_back(node->get_initial_transform());
+
+  JointNode* joint = node->is_joint() ? static_cast<JointNode*>(node) : NULL;
+  if (joint) {
+    m_joint.push_back(m_joint_node.size());
+    m_joint_node.push_back(index);
+    m_joint_source.push_back(joint);
+    m_init_x.push_back(joint->get_joint_x().init);
+    m_init_y.push_back(joint->get_joint_y().init);
+    m_min_x.push_back(joint->get_joint_x().min);
+    m_max_x.push_back(joint->get_joint_x().max);
+    m_min_y.push_back(joint->get_joint_y().min);
+    m_max_y.push_back(joint->get_joint_y().max);
+  }
+  else {
+    m_joint.push_back(-1);
+  }
+
+  GeometryNode* geometry = dynamic_cast<GeometryNode*>(node);
+  if (geometry) {
+    int slot = material_slot(m_materials, geometry->get_material());
+    m_part_node.push_back(index);
+    m_part_primitive.push_back(geometry->get_primitive());
+    m_part_material.push_back(slot);
+  }
+
+  for (SceneNode::ChildList::const_iterator it = node->children().begin();
+       it != node->children().end(); ++it) {
+    flatten(*it, index);
+  }
+}
+
+int SkeletonTemplate::find_node(const std::string& name) const
+{
+  for (size_t n = 0; n < m_name.size(); ++n) {
+    if (m_name[n] == name) {
+      return n;
+    }
+  }
+  return -1;
+}
+
+int SkeletonTemplate::find_joint(const std::string& name) const
+{
+  for (size_t j = 0; j < m_joint_node.size(); ++j) {
+    if (m_name[m_joint_node[j]] == name) {
+      return j;
+    }
+  }
+  return -1;
+}
+
+void SkeletonTemplate::current_pose(double* x, double* y) const
+{
+  for (size_t j = 0; j < m_joint_source.size(); ++j) {
+    x[j] = m_joint_source[j]->get_angle_x();
+    y[j] = m_joint_source[j]->get_angle_y();
+  }
+}
+
+const AffineTransform& SkeletonTemplate::current_root_transform() const
+{
+  return m_source->get_transform();
+}
+
+AffineTransform SkeletonTemplate::world_transform(int node, const AffineTransform& root,
+                                                  const double* x, const double* y) const
+{
+  if (node == 0) {
+    return root;
+  }
+  int j = m_joint[node];
+  if (j < 0 || (x[j] == m_init_x[j] && y[j] == m_init_y[j])) {
+    return world_transform(m_parent[node], root, x, y) * m_init[node];
+  }
+  return world_transform(m_parent[node], root, x, y)
+    * (joint_turn(x[j] - m_init_x[j], y[j] - m_init_y[j]) * m_init[node]);
+}
+
+/*
+ * Crowd
+ */
+
+Crowd::Crowd(const SkeletonTemplate* skeleton)
+  : m_skeleton(skeleton)
+{
+  if (skeleton->node_count()) {
+    m_root = skeleton->initial_transform(0);
+  }
+}
+
+size_t Crowd::spawn(const AffineTransform& placement)
+{
+  m_placement.push_back(placement);
+  for (size_t j = 0; j < m_skeleton->joint_count(); ++j) {
+    m_x.push_back(m_skeleton->initial_angle_x(j));
+    m_y.push_back(m_skeleton->initial_angle_y(j));
+  }
+  return m_placement.size() - 1;
+}
+
+size_t Crowd::spawn_grid(size_t count, double spacing)
+{
+  size_t first = m_placement.size();
+  size_t columns = (size_t)ceil(sqrt((double)count));
+  m_placement.reserve(first + count);
+  m_x.reserve(m_x.size() + count * m_skeleton->joint_count());
+  m_y.reserve(m_y.size() + count * m_skeleton->joint_count());
+
+  for (size_t k = 0; k < count; ++k) {
+    double column = k % columns - (columns - 1) / 2.0;
+    double row = k / columns + 1;
+    spawn(Translation(Vector3D(spacing * column, 0, -spacing * row)));
+  }
+  return first;
+}
+
+void Crowd::clear()
+{
+  m_placement.clear();
+  m_x.clear();
+  m_y.clear();
+}
+
+void Crowd::set_angles(size_t instance, int joint, double x, double y)
+{
+  const SkeletonTemplate& s = *m_skeleton;
+  size_t k = instance * s.joint_count() + joint;
+  m_x[k] = std::min(std::max(x, s.min_angle_x(joint)), s.max_angle_x(joint));
+  m_y[k] = std::min(std::max(y, s.min_angle_y(joint)), s.max_angle_y(joint));
+}
+
+void Crowd::set_pose(size_t instance, const double* x, const double* y)
+{
+  for (size_t j = 0; j < m_skeleton->joint_count(); ++j) {
+    set_angles(instance, j, x[j], y[j]);
+  }
+}
+
+void Crowd::follow_source()
+{
+  if (m_skeleton->node_count() == 0) {
+    return;
+  }
+  m_root = m_skeleton->current_root_transform();
+
+  // The source's angles are already within range
+  size_t joints = m_skeleton->joint_count();
+  if (joints == 0 || m_placement.empty()) {
+    return;
+  }
+  m_skeleton->current_pose(&m_x[0], &m_y[0]);
+  for (size_t i = 1; i < m_placement.size(); ++i) {
+    std::copy(m_x.begin(), m_x.begin() + joints, m_x.begin() + i * joints);
+    std::copy(m_y.begin(), m_y.begin() + joints, m_y.begin() + i * joints);
+  }
+}
+
+void Crowd::part_transforms(size_t first, size_t last, AffineTransform* out,
+                            AffineTransform* scratch) const
+{
+  const SkeletonTemplate& s = *m_skeleton;
+  size_t nodes = s.node_count(), joints = s.joint_count(), parts = s.part_count();
+  if (nodes == 0) {
+    return;
+  }
+
+  for (size_t i = first; i < last; ++i) {
+    const double* x = joints ? &m_x[i * joints] : NULL;
+    const double* y = joints ? &m_y[i * joints] : NULL;
+
+    scratch[0] = m_placement[i] * m_root;
+    for (size_t n = 1; n < nodes; ++n) {
+      int j = s.joint(n);
+      if (j < 0) {
+        scratch[n] = scratch[s.parent(n)] * s.initial_transform(n);
+        continue;
+      }
+
+      // As JointNode::set_angles(); a joint at its initial angles
+      // turns by the identity
+      double dx = x[j] - s.initial_angle_x(j), dy = y[j] - s.initial_angle_y(j);
+      if (dx == 0 && dy == 0) {
+        scratch[n] = scratch[s.parent(n)] * s.initial_transform(n);
+      }
+      else {
+        scratch[n] = scratch[s.parent(n)] * (joint_turn(dx, dy) * s.initial_transform(n));
+      }
+    }
+
+    AffineTransform* part = out + (i - first) * parts;
+    for (size_t p = 0; p < parts; ++p) {
+      part[p] = scratch[s.part_node(p)];
+    }
+  }
+}
+
+void Crowd::part_transforms(AffineTransform* out, std::vector<AffineTransform>& scratch,
+                            TaskPool& pool) const
+{
+  size_t nodes = m_skeleton->node_count();
+  if (nodes == 0 || m_placement.empty()) {
+    return;
+  }
+  scratch.resize(nodes * pool.thread_count());
+
+  CrowdPoseJob job(*this, out, &scratch[0]);
+  pool.run(job, m_placement.size(), grain());
+}
+
+size_t Crowd::grain() const
+{
+  // A few instances per piece keeps the splitting cheap next to the
+  // work, for all but the smallest skeletons
+  return std::max<size_t>(1, 4096 / std::max<size_t>(1, m_skeleton->node_count()));
+}
+
+AffineTransform Crowd::world_transform(size_t instance, int node) const
+{
+  size_t joints = m_skeleton->joint_count();
+  const double* x = joints ? &m_x[instance * joints] : NULL;
+  const double* y = joints ? &m_y[instance * joints] : NULL;
+  return m_skeleton->world_transform(node, m_placement[instance] * m_root, x, y);
+}
+
+BoundingSphere Crowd::bounds(size_t instance) const
+{
+  AffineTransform root = m_placement[instance] * m_root;
+  return BoundingSphere(Point3D(root[0][3], root[1][3], root[2][3]),
+                        m_skeleton->reach() * BoundingSphere::of_unit_sphere(root).radius);
+}
+
+size_t Crowd::memory_usage() const
+{
+  return m_placement.size() * sizeof(AffineTransform) +
+    (m_x.size() + m_y.size()) * sizeof(double);
+}
@@ -0,0 +1,190 @@
+#ifndef CS488_CROWD_HPP
+#define CS488_CROWD_HPP
+
+#include <string>
+#include <vector>
+#include "affine.hpp"
+#include "bvh.hpp"
+
+class SceneNode;
+class JointNode;
+class Material;
+class Primitive;
+class TaskPool;
+
+// The shared, immutable half of a crowd: a puppet's hierarchy compiled
+// from a loaded scene. It keeps the topology, each node's initial
+// transform, the joint ranges, and the primitive and material of each
+// geometry node ("part"), all in depth-first order so a parent comes
+// before its children.
+//
+// Materials and primitives are the source scene's; keep that scene
+// alive while the template is in use.
+class SkeletonTemplate {
+public:
+  explicit SkeletonTemplate(SceneNode* root);
+
+  size_t node_count() const { return m_parent.size(); }
+  size_t joint_count() const { return m_joint_node.size(); }
+  size_t part_count() const { return m_part_node.size(); }
+
+  int parent(int node) const { return m_parent[node]; }
+  const AffineTransform& initial_transform(int node) const { return m_init[node]; }
+  // Joint slot of a node, or -1 if it is not a joint
+  int joint(int node) const { return m_joint[node]; }
+
+  // The node or joint with this name, or -1
+  int find_node(const std::string& name) const;
+  int find_joint(const std::string& name) const;
+  const std::string& node_name(int node) const { return m_name[node]; }
+  const std::string& joint_name(int joint) const { return m_name[m_joint_node[joint]]; }
+  // Node of a joint slot
+  int joint_node(int joint) const { return m_joint_node[joint]; }
+  // The source scene's JointNode of a joint slot
+  JointNode* source_joint(int joint) const { return m_joint_source[joint]; }
+  double initial_angle_x(int joint) const { return m_init_x[joint]; }
+  double initial_angle_y(int joint) const { return m_init_y[joint]; }
+  double min_angle_x(int joint) const { return m_min_x[joint]; }
+  double max_angle_x(int joint) const { return m_max_x[joint]; }
+  double min_angle_y(int joint) const { return m_min_y[joint]; }
+  double max_angle_y(int joint) const { return m_max_y[joint]; }
+
+  // The source scene's joint angles and root transform as they are
+  // now, for copying its pose onto instances
+  void current_pose(double* x, double* y) const;
+  const AffineTransform& current_root_transform() const;
+  // The scene the template was compiled from
+  const SceneNode* source() const { return m_source; }
+
+  // World transform of one node with the root at root and every joint
+  // at the angles x and y, walking up from the node; for a few nodes,
+  // where Crowd::part_transforms() would evaluate them all
+  AffineTransform world_transform(int node, const AffineTransform& root,
+                                  const double* x, const double* y) const;
+
+  int part_node(int part) const { return m_part_node[part]; }
+  Primitive* part_primitive(int part) const { return m_part_primitive[part]; }
+  // Index into the distinct materials, or -1
+  int part_material(int part) const { return m_part_material[part]; }
+  size_t material_count() const { return m_materials.size(); }
+  const Material* material(int index) const { return m_materials[index]; }
+  // Parts grouped by material, those without one first
+  const std::vector<int>& draw_order() const { return m_draw_order; }
+
+  // Radius about the root's origin enclosing every part in the initial
+  // pose, for spacing instances
+  double radius() const { return m_radius; }
+  // Radius about the root's origin, in the root's frame, enclosing
+  // every part in any pose. Joints only turn, so each part is at most
+  // as far out as the chain of offsets above it laid end to end.
+  double reach() const { return m_reach; }
+
+private:
+  void flatten(SceneNode* node, int parent);
+
+  const SceneNode* m_source;
+
+  std::vector<int> m_parent;
+  std::vector<std::string> m_name;
+  std::vector<AffineTransform> m_init;
+  std::vector<int> m_joint;
+
+  std::vector<int> m_joint_node;
+  std::vector<JointNode*> m_joint_source;
+  std::vector<double> m_init_x, m_init_y;
+  std::vector<double> m_min_x, m_max_x, m_min_y, m_max_y;
+
+  std::vector<int> m_part_node;
+  std::vector<Primitive*> m_part_primitive;
+  std::vector<int> m_part_material;
+  std::vector<const Material*> m_materials;
+  std::vector<int> m_draw_order;
+
+  double m_radius;
+  double m_reach;
+};
+
+// Many copies of one SkeletonTemplate. Each instance is only its
+// placement and the two angles of every joint, so memory grows with
+// the joints per instance rather than with whole node objects: 96 +
+// 16 * joint_count() bytes each.
+//
+// An instance's root sits at placement * root_transform(), and every
+// other node under its parent as the template says, turned at joints
+// as JointNode::set_angles() would turn them.
+class Crowd {
+public:
+  explicit Crowd(const SkeletonTemplate* skeleton);
+
+  const SkeletonTemplate& skeleton() const { return *m_skeleton; }
+
+  // Add an instance in the template's initial pose. Returns its index.
+  size_t spawn(const AffineTransform& placement);
+  // Add count instances on a grid in the x-z plane, spacing apart,
+  // in rows going away from the viewer behind the origin. Returns the
+  // index of the first.
+  size_t spawn_grid(size_t count, double spacing);
+  void clear();
+  size_t size() const { return m_placement.size(); }
+
+  const AffineTransform& placement(size_t instance) const { return m_placement[instance]; }
+  void set_placement(size_t instance, const AffineTransform& placement)
+  {
+    m_placement[instance] = placement;
+  }
+
+  // The root's own transform, shared by every instance. Starts as the
+  // template root's initial transform.
+  const AffineTransform& root_transform() const { return m_root; }
+  void set_root_transform(const AffineTransform& root) { m_root = root; }
+
+  // Pose a joint, clamped to its ranges
+  void set_angles(size_t instance, int joint, double x, double y);
+  // Pose every joint, from joint_count() angles each
+  void set_pose(size_t instance, const double* x, const double* y);
+  // Pose every instance, and the shared root transform, as the
+  // template's source scene is posed now
+  void follow_source();
+  double angle_x(size_t instance, int joint) const
+  {
+    return m_x[instance * m_skeleton->joint_count() + joint];
+  }
+  double angle_y(size_t instance, int joint) const
+  {
+    return m_y[instance * m_skeleton->joint_count() + joint];
+  }
+
+  // World transforms of every part of the instances in [first, last),
+  // instance by instance: part p of instance i goes to
+  // out[(i - first) * part_count() + p]. scratch must hold
+  // node_count() transforms. Instances are independent, so disjoint
+  // ranges may be evaluated at the same time.
+  void part_transforms(size_t first, size_t last, AffineTransform* out,
+                       AffineTransform* scratch) const;
+  // The same for every instance, shared out among pool's threads in
+  // runs of instances. scratch is resized to node_count() transforms
+  // per thread.
+  void part_transforms(AffineTransform* out, std::vector<AffineTransform>& scratch,
+                       TaskPool& pool) const;
+  // Instances per piece when a pool shares out work on the crowd
+  size_t grain() const;
+
+  // World transform of one node of an instance
+  AffineTransform world_transform(size_t instance, int node) const;
+
+  // A sphere enclosing the instance in any pose, for culling it
+  // before it is posed
+  BoundingSphere bounds(size_t instance) const;
+
+  // Bytes of per-instance state
+  size_t memory_usage() const;
+
+private:
+  const SkeletonTemplate* m_skeleton;
+  AffineTransform m_root;
+  std::vector<AffineTransform> m_placement;
+  // joint_count() angles per instance, instance by instance
+  std::vector<double> m_x, m_y;
+};
+
+#endif
@@ -0,0 +1,585 @@
+#include "flatscene.hpp"
+#include "scene.hpp"
+#include "taskpool.hpp"
+#include <algorithm>
+
+// Fraction by which the projected radius must cross a level boundary
+// before the level changes.
+static const double LOD_HYSTERESIS = 0.15;
+
+// Dirty subtrees smaller than this are updated serially, as waking
+// the pool would cost more than it saves; larger ones are cut into
+// pieces of at most SUBTREE_TASK_NODES nodes.
+static const int PARALLEL_MIN_NODES = 1024;
+static const int SUBTREE_TASK_NODES = 256;
+
+// Updates the subtrees in FlatScene::m_tasks. They are disjoint and
+// their parents are done, so each touches only its own nodes.
+class SubtreeUpdateJob : public TaskJob {
+public:
+  explicit SubtreeUpdateJob(FlatScene& scene) : m_scene(scene) {}
+
+  virtual void run(size_t begin, size_t end, int /*worker*/)
+  {
+    for (size_t k = begin; k < end; ++k) {
+      int root = m_scene.m_tasks[k];
+      m_scene.update_range(root, m_scene.m_subtree_end[root], false);
+    }
+  }
+
+private:
+  FlatScene& m_scene;
+};
+
+FlatScene::FlatScene()
+  : m_triangle_budget(0),
+    m_stale(false)
+{
+}
+
+FlatScene::~FlatScene()
+{
+  clear();
+}
+
+void FlatScene::clear()
+{
+  for (size_t i = 0; i < m_nodes.size(); ++i) {
+    if (m_nodes[i]->m_flat == this) {
+      m_nodes[i]->m_flat = NULL;
+      m_nodes[i]->m_flat_index = -1;
+    }
+  }
+
+  m_parent.clear();
+  m_subtree_end.clear();
+  m_type.clear();
+  m_nodes.clear();
+  m_local.clear();
+  m_world.clear();
+  m_world_gl.clear();
+  m_world_inv.clear();
+  m_dirty.clear();
+  m_geometry.clear();
+  m_material.clear();
+  m_materials.clear();
+  m_primitives.clear();
+  m_lod.clear();
+  m_bounds.clear();
+  m_visible.clear();
+  m_spheres.clear();
+  m_draw_order.clear();
+  m_geometry_slot.clear();
+  m_bvh.clear();
+
+  m_dirty_roots.clear();
+  m_stale = false;
+}
+
+void FlatScene::compile(SceneNode* root)
+{
+  clear();
+  if (!root) {
+    return;
+  }
+
+  flatten(root, -1);
+
+  m_world.resize(m_nodes.size());
+  m_world_gl.resize(16 * m_nodes.size());
+  m_world_inv.resize(m_nodes.size());
+  m_dirty.assign(m_nodes.size(), 1);
+  m_bounds.resize(m_geometry.size());
+  m_visible.assign(m_geometry.size(), 1);
+  m_spheres.resize(m_nodes.size());
+  m_dirty_roots.push_back(0);
+
+  order_by_material(m_material, m_materials.size(), m_draw_order);
+}
+
+int FlatScene::flatten(SceneNode* node, int parent)
+{
+  int index = m_nodes.size();
+
+  node->m_flat = this;
+  node->m_flat_index = index;
+
+  m_parent.push_back(parent);
+  m_subtree_end.push_back(index + 1);
+  m_nodes.push_back(node);
+  m_local.push_back(node->get_transform());
+
+  GeometryNode* geometry = dynamic_cast<GeometryNode*>(node);
+  if (geometry) {
+    m_type.push_back(NODE_GEOMETRY);
+
+    int material = material_slot(m_materials, geometry->m_material);
+    m_geometry_slot.push_back(m_geometry.size());
+    m_geometry.push_back(index);
+    m_material.push_back(material);
+    m_primitives.push_back(geometry->m_primitive);
+    m_lod.push_back(geometry->m_primitive->lod_levels() - 1);
+  }
+  else if (node->is_joint()) {
+    m_type.push_back(NODE_JOINT);
+    m_geometry_slot.push_back(-1);
+  }
+  else {
+    m_type.push_back(NODE_PLAIN);
+    m_geometry_slot.push_back(-1);
+  }
+
+  for (SceneNode::ChildList::const_iterator it = node->m_children.begin();
+       it != node->m_children.end(); it++) {
+    flatten(*it, index);
+  }
+
+  m_subtree_end[index] = m_nodes.size();
+  return index;
+}
+
+void FlatScene::invalidate(int index)
+{
+  m_local[index] = m_nodes[index]->get_transform();
+
+  // Dragging a joint invalidates it on every motion event; after the
+  // first, its subtree is already marked.
+  if (m_dirty[index]) {
+    return;
+  }
+
+  int end = m_subtree_end[index];
+  for (int i = index; i < end; ++i) {
+    m_dirty[i] = 1;
+  }
+  m_dirty_roots.push_back(index);
+}
+
+void FlatScene::update_transforms(TaskPool* pool)
+{
+  bool parallel = pool && pool->thread_count() > 1;
+
+  // Parents precede their children, so one forward pass over each
+  // dirty subtree suffices. Sorting the roots puts any root nested in
+  // another's subtree after it, where it is skipped.
+  std::sort(m_dirty_roots.begin(), m_dirty_roots.end());
+  int done = 0;
+  for (std::vector<int>::const_iterator root = m_dirty_roots.begin();
+       root != m_dirty_roots.end(); ++root) {
+    if (*root < done) {
+      continue;
+    }
+    done = m_subtree_end[*root];
+    m_moved.push_back(*root);
+    if (parallel && done - *root >= PARALLEL_MIN_NODES) {
+      split_subtree(*root);
+    }
+    else {
+      update_subtree(*root);
+    }
+  }
+  m_dirty_roots.clear();
+
+  if (!m_tasks.empty()) {
+    SubtreeUpdateJob job(*this);
+    // Pieces vary in size, so hand them out a few at a time
+    size_t grain = std::max<size_t>(1, m_tasks.size() / (8 * pool->thread_count()));
+    pool->run(job, m_tasks.size(), grain);
+
+    // The BVH's refit queue is shared, so it hears of the moves here
+    if (!m_bvh.empty()) {
+      for (std::vector<int>::const_iterator it = m_tasks.begin(); it != m_tasks.end(); ++it) {
+        for (int i = *it; i < m_subtree_end[*it]; ++i) {
+          if (m_type[i] == NODE_GEOMETRY) {
+            int g = m_geometry_slot[i];
+            m_bvh.update(g, m_bounds[g]);
+          }
+        }
+      }
+    }
+    m_tasks.clear();
+  }
+
+  for (std::vector<int>::const_iterator it = m_moved.begin(); it != m_moved.end(); ++it) {
+    refit_spheres(*it);
+  }
+  m_moved.clear();
+
+  if (m_bvh.empty()) {
+    m_bvh.build(m_bounds);
+  }
+  else {
+    m_bvh.refit();
+  }
+}
+
+void FlatScene::update_subtree(int index)
+{
+  update_range(index, m_subtree_end[index], true);
+}
+
+void FlatScene::split_subtree(int index)
+{
+  if (m_subtree_end[index] - index <= SUBTREE_TASK_NODES) {
+    m_tasks.push_back(index);
+    return;
+  }
+
+  update_range(index, index + 1, true);
+  for (int child = index + 1; child < m_subtree_end[index]; child = m_subtree_end[child]) {
+    split_subtree(child);
+  }
+}
+
+void FlatScene::refit_spheres(int index)
+{
+  // Children follow their parent, so a backward sweep fits them first
+  for (int i = m_subtree_end[index] - 1; i >= index; --i) {
+    fit_sphere(i);
+  }
+
+  // Above the subtree only the path to the root can have changed, and
+  // once a sphere comes out the same the rest of the path is current
+  for (int p = m_parent[index]; p >= 0; p = m_parent[p]) {
+    BoundingSphere old = m_spheres[p];
+    fit_sphere(p);
+    if (m_spheres[p].radius == old.radius && m_spheres[p].centre[0] == old.centre[0] &&
+        m_spheres[p].centre[1] == old.centre[1] && m_spheres[p].centre[2] == old.centre[2]) {
+      break;
+    }
+  }
+}
+
+void FlatScene::fit_sphere(int i)
+{
+  BoundingSphere sphere;
+  if (m_type[i] == NODE_GEOMETRY) {
+    sphere = BoundingSphere::of_unit_sphere(m_world[i]);
+  }
+  for (int child = i + 1; child < m_subtree_end[i]; child = m_subtree_end[child]) {
+    sphere.expand(m_spheres[child]);
+  }
+  m_spheres[i] = sphere;
+}
+
+void FlatScene::cull(const Frustum* frustum, FrameStats* stats)
+{
+  if (!frustum) {
+    std::fill(m_visible.begin(), m_visible.end(), 1);
+    if (stats) {
+      stats->visible += m_geometry.size();
+    }
+    return;
+  }
+
+  std::fill(m_visible.begin(), m_visible.end(), 0);
+  size_t visible = 0;
+  int i = 0, end = m_nodes.size();
+  while (i < end) {
+    if (m_spheres[i].empty() || frustum->outside(m_spheres[i])) {
+      i = m_subtree_end[i];
+      continue;
+    }
+    if (m_type[i] == NODE_GEOMETRY) {
+      m_visible[m_geometry_slot[i]] = 1;
+      visible++;
+    }
+    ++i;
+  }
+
+  if (stats) {
+    stats->visible += visible;
+    stats->culled += m_geometry.size() - visible;
+  }
+}
+
+void FlatScene::update_range(int begin, int end, bool notify)
+{
+  for (int i = begin; i < end; ++i) {
+
+    int p = m_parent[i];
+    if (p < 0) {
+      m_world[i] = m_local[i];
+    }
+    else {
+      m_world[i] = m_world[p] * m_local[i];
+    }
+    m_world[i].to_gl(&m_world_gl[16 * i]);
+    if (m_type[i] == NODE_GEOMETRY) {
+      int g = m_geometry_slot[i];
+      m_world_inv[i] = m_world[i].invert();
+      m_bounds[g] = AABB::of_unit_sphere(m_world[i]);
+      if (notify && !m_bvh.empty()) {
+        m_bvh.update(g, m_bounds[g]);
+      }
+    }
+    m_dirty[i] = 0;
+  }
+}
+
+double FlatScene::projected_radius(const Matrix4x4& view, const AffineTransform& world,
+                                   double pixels_per_unit)
+{
+  Matrix4x4 m = view * world;
+
+  // The unit sphere maps to an ellipsoid whose largest semi-axis is
+  // (for the rotations and scales a puppet uses) the longest column
+  // of the linear part.
+  double radius2 = 0;
+  for (int c = 0; c < 3; ++c) {
+    double len2 = m[0][c]*m[0][c] + m[1][c]*m[1][c] + m[2][c]*m[2][c];
+    radius2 = std::max(radius2, len2);
+  }
+
+  double depth = -m[2][3];
+  if (depth <= 1e-6) {
+    return -1;
+  }
+  return sqrt(radius2) * pixels_per_unit / depth;
+}
+
+void FlatScene::select_lod(const Matrix4x4& view, double pixels_per_unit,
+                           FrameStats* stats)
+{
+  for (size_t g = 0; g < m_geometry.size(); ++g) {
+    const Primitive* primitive = m_primitives[g];
+    int levels = primitive->lod_levels();
+    if (!m_visible[g]) {
+      // Keeps its level until it comes back into view
+      continue;
+    }
+    if (levels <= 1) {
+      m_lod[g] = 0;
+      continue;
+    }
+
+    double pixels = projected_radius(view, m_world[m_geometry[g]], pixels_per_unit);
+    if (pixels < 0) {
+      // The centre is at or behind the eye: assume it is close.
+      m_lod[g] = levels - 1;
+      continue;
+    }
+
+    int level = m_lod[g];
+    while (level < levels - 1 &&
+           pixels > primitive->lod_max_radius(level) * (1 + LOD_HYSTERESIS)) {
+      ++level;
+    }
+    while (level > 0 &&
+           pixels < primitive->lod_max_radius(level - 1) * (1 - LOD_HYSTERESIS)) {
+      --level;
+    }
+    m_lod[g] = level;
+  }
+
+  if (stats) {
+    stats->lod_cap = -1;
+  }
+  if (m_triangle_budget == 0) {
+    return;
+  }
+
+  // Lower the finest allowed level until the frame fits the budget.
+  int cap = FrameStats::MAX_LOD_LEVELS - 1;
+  for (; cap > 0; --cap) {
+    size_t triangles = 0;
+    for (size_t g = 0; g < m_geometry.size(); ++g) {
+      if (m_visible[g]) {
+        triangles += m_primitives[g]->triangle_count(std::min(m_lod[g], cap));
+      }
+    }
+    if (triangles <= m_triangle_budget) {
+      break;
+    }
+  }
+
+  bool capped = false;
+  for (size_t g = 0; g < m_geometry.size(); ++g) {
+    if (m_visible[g] && m_lod[g] > cap) {
+      m_lod[g] = cap;
+      capped = true;
+    }
+  }
+  if (stats && capped) {
+    stats->lod_cap = cap;
+  }
+}
+
+void FlatScene::walk_gl(bool picking, FrameStats* stats)
+{
+  // GL state left by whoever drew before us is not trusted
+  int current = MATERIAL_UNKNOWN;
+
+  m_selected_draws.clear();
+  for (size_t k = 0; k < m_draw_order.size(); ++k) {
+    int g = m_draw_order[k];
+    if (!m_visible[g]) {
+      continue;
+    }
+    if (!picking) {
+      if (geometry_selected(g)) {
+        m_selected_draws.push_back(g);
+        continue;
+      }
+      apply_material_gl(m_material[g], current, stats);
+    }
+    draw_geometry_gl(g, picking, stats);
+  }
+
+  // Every selected node shares the highlight, so they go together
+  for (size_t k = 0; k < m_selected_draws.size(); ++k) {
+    apply_material_gl(MATERIAL_HIGHLIGHT, current, stats);
+    draw_geometry_gl(m_selected_draws[k], picking, stats);
+  }
+}
+
+void FlatScene::apply_material_gl(int material, int& current, FrameStats* stats) const
+{
+  if (material == current) {
+    if (stats) {
+      stats->material_changes_skipped++;
+    }
+    return;
+  }
+
+  if (material == MATERIAL_HIGHLIGHT) {
+    GeometryNode::apply_highlight_gl();
+  }
+  else if (material == -1) {
+    apply_default_material_gl();
+  }
+  else {
+    m_materials[material]->apply_gl();
+  }
+  current = material;
+  if (stats) {
+    stats->material_changes++;
+  }
+}
+
+void FlatScene::draw_geometry_gl(int g, bool picking, FrameStats* stats) const
+{
+  int i = m_geometry[g];
+
+  glPushMatrix();
+  glMultMatrixd(&m_world_gl[16 * i]);
+
+  if (picking) {
+    glPushName(m_nodes[i]->m_id);
+  }
+
+  m_primitives[g]->walk_gl_lod(m_lod[g]);
+
+  if (stats) {
+    stats->draws++;
+    stats->triangles += m_primitives[g]->triangle_count(m_lod[g]);
+    stats->lod_counts[m_lod[g]]++;
+  }
+
+  if (picking) {
+    glPopName();
+  }
+
+  glPopMatrix();
+}
+
+bool FlatScene::geometry_selected(size_t g) const
+{
+  return static_cast<GeometryNode*>(m_nodes[m_geometry[g]])->selected;
+}
+
+void FlatScene::selected_joints(std::vector<JointNode*>& joints) const
+{
+  for (size_t g = 0; g < m_geometry.size(); ++g) {
+    int p = m_parent[m_geometry[g]];
+    if (p < 0 || m_type[p] != NODE_JOINT || !geometry_selected(g)) {
+      continue;
+    }
+    JointNode* joint = static_cast<JointNode*>(m_nodes[p]);
+    if (std::find(joints.begin(), joints.end(), joint) == joints.end()) {
+      joints.push_back(joint);
+    }
+  }
+}
+
+// Ray parameter of the first hit with the unit sphere under the
+// transform whose inverse is inv, or HUGE_VAL. The map is affine, so t
+// means the same thing in object and world space.
+static double ray_unit_sphere(const AffineTransform& inv, const Point3D& origin,
+                              const Vector3D& dir)
+{
+  Point3D o = inv * origin;
+  Vector3D d = inv * dir;
+  Vector3D ov(o[0], o[1], o[2]);
+
+  double a = d.dot(d);
+  double b = 2 * ov.dot(d);
+  double c = ov.dot(ov) - 1;
+  double disc = b*b - 4*a*c;
+  if (a == 0 || disc < 0) {
+    return HUGE_VAL;
+  }
+
+  double root = sqrt(disc);
+  double t = (-b - root) / (2*a);
+  if (t <= 0) {
+    // The origin is inside the sphere
+    t = (-b + root) / (2*a);
+  }
+  return t > 0 ? t : HUGE_VAL;
+}
+
+// Exact test of a ray against geometry entries, for BVH::raycast
+struct EllipsoidRayTest : public BVH::RayTest {
+  EllipsoidRayTest(const std::vector<AffineTransform>& inverses,
+                   const std::vector<int>& geometry,
+                   const Point3D& origin, const Vector3D& dir)
+    : inverses(inverses), geometry(geometry), origin(origin), dir(dir)
+  {
+  }
+
+  virtual double intersect(int g)
+  {
+    return ray_unit_sphere(inverses[geometry[g]], origin, dir);
+  }
+
+  const std::vector<AffineTransform>& inverses;
+  const std::vector<int>& geometry;
+  Point3D origin;
+  Vector3D dir;
+};
+
+bool FlatScene::pick(const Point3D& origin, const Vector3D& dir, Hit& hit) const
+{
+  hit.index = -1;
+  hit.node = NULL;
+
+  EllipsoidRayTest test(m_world_inv, m_geometry, origin, dir);
+  int g = m_bvh.raycast(origin, dir, HUGE_VAL, test, hit.t);
+  if (g < 0) {
+    return false;
+  }
+
+  hit.index = m_geometry[g];
+  hit.node = m_nodes[hit.index];
+  hit.point = origin + hit.t * dir;
+  return true;
+}
+
+void FlatScene::query(const AABB& box, std::vector<int>& nodes) const
+{
+  size_t first = nodes.size();
+  m_bvh.query(box, nodes);
+  for (size_t i = first; i < nodes.size(); ++i) {
+    nodes[i] = m_geometry[nodes[i]];
+  }
+}
+
+void FlatScene::query(const Frustum& frustum, std::vector<int>& nodes) const
+{
+  size_t first = nodes.size();
+  m_bvh.query(frustum, nodes);
+  for (size_t i = first; i < nodes.size(); ++i) {
+    nodes[i] = m_geometry[nodes[i]];
+  }
+}
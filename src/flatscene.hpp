@@ -0,0 +1,228 @@
+#ifndef CS488_FLATSCENE_HPP
+#define CS488_FLATSCENE_HPP
+
+#include <vector>
+#include "algebra.hpp"
+#include "affine.hpp"
+#include "framestats.hpp"
+#include "bvh.hpp"
+
+class SceneNode;
+class JointNode;
+class GeometryNode;
+class Material;
+class Primitive;
+class TaskPool;
+
+// A compiled, flattened copy of a SceneNode hierarchy.
+//
+// Nodes are stored in depth-first order, so every subtree occupies the
+// contiguous index range [i, m_subtree_end[i]) and a parent always
+// comes before its children. Transform updates, drawing and picking
+// are plain loops over these arrays instead of virtual calls down a
+// tree of std::lists.
+//
+// The flat scene stays in sync with the SceneNode API: every node it
+// compiled points back at it, so SceneNode::mark_dirty() reports
+// transform edits and add_child()/remove_child() mark it stale.
+class FlatScene {
+public:
+  enum NodeType {
+    NODE_PLAIN,
+    NODE_JOINT,
+    NODE_GEOMETRY
+  };
+
+  // Result of a ray cast against the scene
+  struct Hit {
+    int index;          // flat index of the node that was hit
+    SceneNode* node;
+    double t;           // ray parameter of the hit
+    Point3D point;      // hit point, in the root's coordinate frame
+  };
+
+  FlatScene();
+  ~FlatScene();
+
+  // Rebuild the arrays from the tree rooted at root.
+  void compile(SceneNode* root);
+  // Drop the compiled arrays and detach every node.
+  void clear();
+
+  // True once the tree's structure has changed since compile().
+  bool is_stale() const { return m_stale; }
+  void invalidate_structure() { m_stale = true; }
+
+  // Called when the local transform of node index has changed. Takes
+  // constant time if the node is already dirty, otherwise time
+  // proportional to its subtree.
+  void invalidate(int index);
+
+  // Recompute the world matrices of all dirty nodes. Given a pool,
+  // large dirty subtrees are split into independent subtrees that its
+  // threads update at the same time; the nodes above them are done
+  // first, so a parent is always ready before its children.
+  void update_transforms(TaskPool* pool = NULL);
+
+  // Mark the geometry that may be seen through frustum, skipping each
+  // subtree whose bounding sphere lies wholly outside it, and count
+  // the visible and culled parts into stats. NULL shows everything.
+  // select_lod() and the draws then ignore culled geometry.
+  void cull(const Frustum* frustum, FrameStats* stats = NULL);
+
+  // Choose a level of detail for every geometry node from the
+  // projected size of its world-space bounding ellipsoid. view is the
+  // camera (modelview) matrix and pixels_per_unit the viewport height
+  // divided by 2 tan(fovy / 2). Levels only change once the size has
+  // moved past a threshold by LOD_HYSTERESIS, so parts near a boundary
+  // do not pop back and forth. Culled geometry keeps its level and
+  // does not count against the triangle budget.
+  void select_lod(const Matrix4x4& view, double pixels_per_unit,
+                  FrameStats* stats = NULL);
+
+  // On-screen radius in pixels of the unit sphere under world, seen
+  // through view, or -1 if its centre is at or behind the eye.
+  static double projected_radius(const Matrix4x4& view, const AffineTransform& world,
+                                 double pixels_per_unit);
+
+  // Upper bound on the triangles select_lod() may choose per frame;
+  // 0 means unlimited.
+  void set_triangle_budget(size_t budget) { m_triangle_budget = budget; }
+  size_t get_triangle_budget() const { return m_triangle_budget; }
+
+  // Draw every visible geometry node at its selected level of
+  // detail. When picking, each draw is wrapped in glPushName(node id).
+  // Draws are made in material order, selected nodes last, and a
+  // material is only set when it differs from the one the previous
+  // draw used.
+  void walk_gl(bool picking = false, FrameStats* stats = NULL);
+
+  // Append the joints a drag would move: those with a selected
+  // geometry child.
+  void selected_joints(std::vector<JointNode*>& joints) const;
+
+  // Cast the ray origin + t * dir (t > 0) against every geometry
+  // node, treating each as the unit sphere under its world transform,
+  // and report the nearest hit. Coordinates are in the root's frame,
+  // i.e. before the camera (modelview) transform. World matrices must
+  // be up to date.
+  bool pick(const Point3D& origin, const Vector3D& dir, Hit& hit) const;
+
+  // Append the flat index of every geometry node whose world bounds
+  // overlap box, or are not entirely outside frustum.
+  void query(const AABB& box, std::vector<int>& nodes) const;
+  void query(const Frustum& frustum, std::vector<int>& nodes) const;
+
+  // World-space bounds of geometry entry g
+  const AABB& geometry_bounds(size_t g) const { return m_bounds[g]; }
+  // A sphere around every geometry node in the subtree at index;
+  // empty if it has none
+  const BoundingSphere& subtree_bounds(int index) const { return m_spheres[index]; }
+
+  size_t size() const { return m_nodes.size(); }
+  size_t geometry_count() const { return m_geometry.size(); }
+
+  int parent(int index) const { return m_parent[index]; }
+  int subtree_end(int index) const { return m_subtree_end[index]; }
+  NodeType type(int index) const { return (NodeType)m_type[index]; }
+  SceneNode* node(int index) const { return m_nodes[index]; }
+  const AffineTransform& local(int index) const { return m_local[index]; }
+  const AffineTransform& world(int index) const { return m_world[index]; }
+  // The world matrix as 16 column-major doubles, for glMultMatrixd
+  const double* world_gl(int index) const { return &m_world_gl[16 * index]; }
+  // Only maintained for geometry nodes
+  const AffineTransform& world_inverse(int index) const { return m_world_inv[index]; }
+
+  // Geometry entries, g in [0, geometry_count())
+  int geometry_node(size_t g) const { return m_geometry[g]; }
+  Primitive* geometry_primitive(size_t g) const { return m_primitives[g]; }
+  int geometry_lod(size_t g) const { return m_lod[g]; }
+  bool geometry_selected(size_t g) const;
+  // False if the last cull() found it outside the frustum
+  bool geometry_visible(size_t g) const { return m_visible[g]; }
+  // Index into the distinct materials, or -1 if the node has none
+  int geometry_material(size_t g) const { return m_material[g]; }
+
+  size_t material_count() const { return m_materials.size(); }
+  const Material* material(int index) const { return m_materials[index]; }
+
+private:
+  // Pseudo material indices for walk_gl()
+  enum {
+    MATERIAL_HIGHLIGHT = -2,
+    MATERIAL_UNKNOWN = -3
+  };
+
+  int flatten(SceneNode* node, int parent);
+  // Set material unless it is current, the state walk_gl() last set
+  void apply_material_gl(int material, int& current, FrameStats* stats) const;
+  void draw_geometry_gl(int g, bool picking, FrameStats* stats) const;
+  // Recompute the world matrices of a dirty subtree
+  void update_subtree(int index);
+  // Recompute nodes [begin, end), whose parents outside the range are
+  // up to date, and tell the BVH about moved geometry if notify. Only
+  // notifying touches anything shared beyond the range.
+  void update_range(int begin, int end, bool notify);
+  // Update the top of a large subtree in place and append the roots
+  // of its pieces to m_tasks
+  void split_subtree(int index);
+  // Refit the bounding spheres of the subtree at index, which has
+  // moved, and of the nodes above it
+  void refit_spheres(int index);
+  // Recompute the sphere of node i from its own and its children's
+  void fit_sphere(int i);
+
+  friend class SubtreeUpdateJob;
+
+  // Topology, in depth-first order
+  std::vector<int> m_parent;
+  std::vector<int> m_subtree_end;
+  std::vector<unsigned char> m_type;
+  std::vector<SceneNode*> m_nodes;
+
+  // Transforms. Each node's 3x4 is kept whole, one array per kind of
+  // transform: every use reads a full matrix (a parent's world times a
+  // child's local, a draw's world, a pick's inverse), so splitting the
+  // twelve components into arrays of their own would turn each access
+  // into twelve streams, and parent lookups into twelve misses.
+  std::vector<AffineTransform> m_local;
+  std::vector<AffineTransform> m_world;
+  std::vector<double> m_world_gl;       // 16 per node
+  std::vector<AffineTransform> m_world_inv;
+  // A dirty node's whole subtree is dirty
+  std::vector<unsigned char> m_dirty;
+  // Roots of the dirty subtrees, in the order they were invalidated.
+  // Every dirty node lies under one of them, so an update costs the
+  // size of the edited subtrees rather than of the scene.
+  std::vector<int> m_dirty_roots;
+  // Subtrees handed to the pool by update_transforms(), and the
+  // roots of all it updated; scratch
+  std::vector<int> m_tasks;
+  std::vector<int> m_moved;
+  // Bounds of each subtree, refitted after every update
+  std::vector<BoundingSphere> m_spheres;
+
+  // Geometry, indexed by position in m_geometry
+  std::vector<int> m_geometry;
+  std::vector<int> m_material;
+  std::vector<const Material*> m_materials;
+  std::vector<Primitive*> m_primitives;
+  std::vector<int> m_lod;
+  std::vector<AABB> m_bounds;
+  std::vector<unsigned char> m_visible;
+  // Geometry entries grouped by material, nodes without one first
+  std::vector<int> m_draw_order;
+  // Selected entries walk_gl() puts off until the end; scratch
+  std::vector<int> m_selected_draws;
+  // Geometry entry of each node, or -1
+  std::vector<int> m_geometry_slot;
+
+  // Over m_bounds; built on the first update_transforms() after
+  // compile() and refitted as parts move.
+  BVH m_bvh;
+
+  size_t m_triangle_budget;
+  bool m_stale;
+};
+
+#endif
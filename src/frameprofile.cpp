@@ -0,0 +1,187 @@
+#include "frameprofile.hpp"
+#include <fstream>
+#include <algorithm>
+#include <time.h>
+
+FrameProfiler::FrameProfiler(size_t capacity)
+  : m_frames(capacity ? capacity : 1),
+    m_next(0),
+    m_count(0),
+    m_number(0),
+    m_start_us(0),
+    m_pending_pick_us(0),
+    m_enabled(false),
+    m_keep_all(false)
+{
+}
+
+double FrameProfiler::now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+}
+
+void FrameProfiler::set_enabled(bool enabled)
+{
+  if (enabled && !m_enabled) {
+    m_next = 0;
+    m_count = 0;
+    m_number = 0;
+    m_start_us = now_us();
+    m_pending_pick_us = 0;
+  }
+  m_enabled = enabled;
+}
+
+void FrameProfiler::add_pick(double us)
+{
+  if (m_enabled) {
+    m_pending_pick_us += us;
+  }
+}
+
+void FrameProfiler::add_frame(const FrameStats& stats, double swap_us)
+{
+  if (!m_enabled) {
+    return;
+  }
+
+  if (m_keep_all && m_count == m_frames.size()) {
+    // Put the full ring in order and grow it instead of overwriting
+    std::rotate(m_frames.begin(), m_frames.begin() + m_next, m_frames.end());
+    m_next = m_frames.size();
+    m_frames.push_back(Frame());
+  }
+
+  Frame& f = m_frames[m_next];
+  f.number = m_number++;
+  f.time_ms = (now_us() - m_start_us) * 1e-3;
+  f.update_us = stats.update_us;
+  f.traverse_us = stats.traverse_us;
+  f.pick_us = m_pending_pick_us;
+  f.swap_us = swap_us;
+  f.draws = stats.draws;
+  f.triangles = stats.triangles;
+  f.visible = stats.visible;
+  f.culled = stats.culled;
+  f.material_changes = stats.material_changes;
+  f.material_changes_skipped = stats.material_changes_skipped;
+  m_pending_pick_us = 0;
+
+  m_next = (m_next + 1) % m_frames.size();
+  if (m_count < m_frames.size()) {
+    m_count++;
+  }
+}
+
+const FrameProfiler::Frame& FrameProfiler::frame(size_t i) const
+{
+  // The oldest frame is the one add_frame() will overwrite next
+  size_t oldest = m_count < m_frames.size() ? 0 : m_next;
+  return m_frames[(oldest + i) % m_frames.size()];
+}
+
+FrameProfiler::Frame FrameProfiler::average(size_t n) const
+{
+  Frame mean = Frame();
+  n = std::min(n, m_count);
+  if (n == 0) {
+    return mean;
+  }
+
+  double draws = 0, triangles = 0, visible = 0, culled = 0, changes = 0, skipped = 0;
+  for (size_t i = m_count - n; i < m_count; ++i) {
+    const Frame& f = frame(i);
+    mean.update_us += f.update_us;
+    mean.traverse_us += f.traverse_us;
+    mean.pick_us += f.pick_us;
+    mean.swap_us += f.swap_us;
+    draws += f.draws;
+    triangles += f.triangles;
+    visible += f.visible;
+    culled += f.culled;
+    changes += f.material_changes;
+    skipped += f.material_changes_skipped;
+  }
+  const Frame& last = frame(m_count - 1);
+  mean.number = last.number;
+  mean.time_ms = last.time_ms;
+  mean.update_us /= n;
+  mean.traverse_us /= n;
+  mean.pick_us /= n;
+  mean.swap_us /= n;
+  mean.draws = draws / n + 0.5;
+  mean.triangles = triangles / n + 0.5;
+  mean.visible = visible / n + 0.5;
+  mean.culled = culled / n + 0.5;
+  mean.material_changes = changes / n + 0.5;
+  mean.material_changes_skipped = skipped / n + 0.5;
+  return mean;
+}
+
+double FrameProfiler::frames_per_second(size_t n) const
+{
+  n = std::min(n, m_count);
+  if (n < 2) {
+    return 0;
+  }
+  double elapsed = frame(m_count - 1).time_ms - frame(m_count - n).time_ms;
+  return elapsed > 0 ? (n - 1) * 1e3 / elapsed : 0;
+}
+
+void FrameProfiler::write_csv(std::ostream& out) const
+{
+  out << "frame,time_ms,update_us,traverse_us,pick_us,swap_us,"
+      << "draws,triangles,visible,culled,material_changes,material_changes_skipped\n";
+  for (size_t i = 0; i < m_count; ++i) {
+    const Frame& f = frame(i);
+    out << f.number << ',' << f.time_ms << ','
+        << f.update_us << ',' << f.traverse_us << ','
+        << f.pick_us << ',' << f.swap_us << ','
+        << f.draws << ',' << f.triangles << ','
+        << f.visible << ',' << f.culled << ','
+        << f.material_changes << ',' << f.material_changes_skipped << '\n';
+  }
+}
+
+void FrameProfiler::write_json(std::ostream& out) const
+{
+  out << "{\n  \"frames\": [";
+  for (size_t i = 0; i < m_count; ++i) {
+    const Frame& f = frame(i);
+    out << (i ? ",\n" : "\n")
+        << "    { \"frame\": " << f.number
+        << ", \"time_ms\": " << f.time_ms
+        << ", \"update_us\": " << f.update_us
+        << ", \"traverse_us\": " << f.traverse_us
+        << ", \"pick_us\": " << f.pick_us
+        << ", \"swap_us\": " << f.swap_us
+        << ", \"draws\": " << f.draws
+        << ", \"triangles\": " << f.triangles
+        << ", \"visible\": " << f.visible
+        << ", \"culled\": " << f.culled
+        << ", \"material_changes\": " << f.material_changes
+        << ", \"material_changes_skipped\": " << f.material_changes_skipped
+        << " }";
+  }
+  out << "\n  ]\n}\n";
+}
+
+bool FrameProfiler::save(const std::string& filename) const
+{
+  std::ofstream out(filename.c_str());
+  if (!out) {
+    return false;
+  }
+
+  const std::string json = ".json";
+  if (filename.size() >= json.size() &&
+      filename.compare(filename.size() - json.size(), json.size(), json) == 0) {
+    write_json(out);
+  }
+  else {
+    write_csv(out);
+  }
+  return out.good();
+}
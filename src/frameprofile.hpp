@@ -0,0 +1,77 @@
+#ifndef CS488_FRAMEPROFILE_HPP
+#define CS488_FRAMEPROFILE_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "framestats.hpp"
+
+// Keeps the timings and counters of recent frames, for the viewer's
+// stats overlay and for dumping to a file.
+//
+// Nothing is recorded while the profiler is disabled, and callers only
+// read the clock when is_enabled() says so, so a disabled profiler
+// costs a branch per frame.
+class FrameProfiler {
+public:
+  struct Frame {
+    unsigned long number;   // counted from when recording started
+    double time_ms;         // when the frame ended, from the same point
+    double update_us;       // bringing world transforms up to date
+    double traverse_us;     // level of detail and issuing the draws
+    double pick_us;         // ray picks since the previous frame
+    double swap_us;         // presenting the frame
+    size_t draws;
+    size_t triangles;
+    size_t visible;
+    size_t culled;
+    size_t material_changes;
+    size_t material_changes_skipped;
+  };
+
+  // Keeps the last capacity frames
+  explicit FrameProfiler(size_t capacity = 4096);
+
+  bool is_enabled() const { return m_enabled; }
+  // Enabling starts a fresh recording
+  void set_enabled(bool enabled);
+
+  // Keep every frame recorded, growing past capacity, so a dump holds
+  // the whole run. Otherwise the oldest frames are overwritten, which
+  // is all the overlay's averages need.
+  void set_keep_all(bool keep_all) { m_keep_all = keep_all; }
+
+  // Count a pick against the next frame
+  void add_pick(double us);
+  // Record a finished frame. stats must hold the renderer's timings.
+  void add_frame(const FrameStats& stats, double swap_us);
+
+  // The frames kept, oldest first
+  size_t frame_count() const { return m_count; }
+  const Frame& frame(size_t i) const;
+
+  // Mean of every field over the last n frames (fewer if fewer are
+  // kept), and the rate at which they were drawn
+  Frame average(size_t n) const;
+  double frames_per_second(size_t n) const;
+
+  void write_csv(std::ostream& out) const;
+  void write_json(std::ostream& out) const;
+  // JSON if filename ends in ".json", otherwise CSV
+  bool save(const std::string& filename) const;
+
+  // A monotonic clock in microseconds
+  static double now_us();
+
+private:
+  std::vector<Frame> m_frames;    // a ring of the last frames
+  size_t m_next;
+  size_t m_count;
+  unsigned long m_number;
+  double m_start_us;
+  double m_pending_pick_us;
+  bool m_enabled;
+  bool m_keep_all;
+};
+
+#endif
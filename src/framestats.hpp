@@ -0,0 +1,71 @@
+#ifndef CS488_FRAMESTATS_HPP
+#define CS488_FRAMESTATS_HPP
+
+#include <iostream>
+#include <algorithm>
+
+// Counters gathered while drawing one frame.
+struct FrameStats {
+  enum { MAX_LOD_LEVELS = 8 };
+
+  FrameStats()
+  {
+    reset();
+  }
+
+  void reset()
+  {
+    draws = 0;
+    triangles = 0;
+    visible = 0;
+    culled = 0;
+    lod_cap = -1;
+    material_changes = 0;
+    material_changes_skipped = 0;
+    update_us = 0;
+    traverse_us = 0;
+    std::fill(lod_counts, lod_counts + MAX_LOD_LEVELS, 0);
+  }
+
+  size_t draws;
+  size_t triangles;
+  // Parts found inside the view frustum, and parts skipped because
+  // they, or a subtree or crowd instance holding them, lay outside it
+  size_t visible;
+  size_t culled;
+  // Number of draws made at each level of detail, coarsest first
+  size_t lod_counts[MAX_LOD_LEVELS];
+  // Finest level allowed by the triangle budget this frame, or -1 if
+  // the budget did not bind
+  int lod_cap;
+  // Materials set on the fixed-function path, and draws that found
+  // their material already set and skipped it
+  size_t material_changes;
+  size_t material_changes_skipped;
+  // Time spent updating transforms and drawing, set only when the
+  // renderer is timing frames
+  double update_us;
+  double traverse_us;
+};
+
+inline std::ostream& operator <<(std::ostream& os, const FrameStats& s)
+{
+  os << "draws " << s.draws << " triangles " << s.triangles << " lod [";
+  for (int i = 0; i < FrameStats::MAX_LOD_LEVELS; ++i) {
+    os << (i ? " " : "") << s.lod_counts[i];
+  }
+  os << "]";
+  if (s.culled) {
+    os << " visible " << s.visible << " culled " << s.culled;
+  }
+  if (s.lod_cap >= 0) {
+    os << " capped at " << s.lod_cap;
+  }
+  if (s.material_changes || s.material_changes_skipped) {
+    os << " materials " << s.material_changes
+       << " (" << s.material_changes_skipped << " skipped)";
+  }
+  return os;
+}
+
+#endif
@@ -0,0 +1,365 @@
+#include "headless.hpp"
+#include "renderer.hpp"
+#include "frameprofile.hpp"
+#include "animation.hpp"
+#include "crowd.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+OffscreenContext::OffscreenContext()
+  : m_display(EGL_NO_DISPLAY),
+    m_surface(EGL_NO_SURFACE),
+    m_context(EGL_NO_CONTEXT)
+{
+}
+
+OffscreenContext::~OffscreenContext()
+{
+  if (m_display == EGL_NO_DISPLAY) {
+    return;
+  }
+  eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  if (m_context != EGL_NO_CONTEXT) eglDestroyContext(m_display, m_context);
+  if (m_surface != EGL_NO_SURFACE) eglDestroySurface(m_display, m_surface);
+  eglTerminate(m_display);
+}
+
+bool OffscreenContext::create(int width, int height)
+{
+  // Prefer the surfaceless platform, which works without X. Fall back
+  // to the default display otherwise.
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (get_platform_display) {
+    m_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                     EGL_DEFAULT_DISPLAY, NULL);
+  }
+  if (m_display == EGL_NO_DISPLAY) {
+    m_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  }
+
+  EGLint major, minor;
+  if (m_display == EGL_NO_DISPLAY || !eglInitialize(m_display, &major, &minor)) {
+    std::cerr << "Unable to initialise EGL" << std::endl;
+    return false;
+  }
+  // The fixed-function path needs desktop GL, not GLES
+  if (!eglBindAPI(EGL_OPENGL_API)) {
+    std::cerr << "EGL does not support desktop OpenGL" << std::endl;
+    return false;
+  }
+
+  const EGLint config_attribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_RED_SIZE, 8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8,
+    EGL_DEPTH_SIZE, 24,
+    EGL_NONE
+  };
+  EGLConfig config;
+  EGLint count = 0;
+  if (!eglChooseConfig(m_display, config_attribs, &config, 1, &count) || count == 0) {
+    std::cerr << "Unable to setup OpenGL Configuration!" << std::endl;
+    return false;
+  }
+
+  const EGLint surface_attribs[] = {
+    EGL_WIDTH, width,
+    EGL_HEIGHT, height,
+    EGL_NONE
+  };
+  m_surface = eglCreatePbufferSurface(m_display, config, surface_attribs);
+  m_context = eglCreateContext(m_display, config, EGL_NO_CONTEXT, NULL);
+  if (m_surface == EGL_NO_SURFACE || m_context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(m_display, m_surface, m_surface, m_context)) {
+    std::cerr << "Unable to create an offscreen GL context" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool ends_with(const std::string& s, const std::string& suffix)
+{
+  return s.size() >= suffix.size() &&
+    s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Where the frame number goes in an output name: a "%d", or "%0Nd" to
+// pad it with zeros to N digits
+struct FramePattern {
+  size_t at;            // std::string::npos if the name has none
+  size_t length;
+  int width;
+};
+
+// Widest padding asked for that is taken seriously
+static const int MAX_FRAME_WIDTH = 32;
+
+// Find the frame number in name. Returns false unless name holds no
+// '%' at all, or one that starts a "%d" or "%0Nd".
+static bool parse_frame_pattern(const std::string& name, FramePattern& pattern)
+{
+  pattern.at = name.find('%');
+  pattern.length = 0;
+  pattern.width = 0;
+  if (pattern.at == std::string::npos) {
+    return true;
+  }
+
+  size_t i = pattern.at + 1;
+  if (i < name.size() && name[i] == '0') {
+    size_t digits = ++i;
+    while (i < name.size() && name[i] >= '0' && name[i] <= '9') {
+      pattern.width = 10 * pattern.width + (name[i] - '0');
+      if (pattern.width > MAX_FRAME_WIDTH) {
+        return false;
+      }
+      ++i;
+    }
+    if (i == digits) {
+      return false;
+    }
+  }
+  if (i >= name.size() || name[i] != 'd') {
+    return false;
+  }
+  pattern.length = i + 1 - pattern.at;
+  return name.find('%', i + 1) == std::string::npos;
+}
+
+static std::string frame_filename(const std::string& name, const FramePattern& pattern,
+                                  int frame)
+{
+  if (pattern.at == std::string::npos) {
+    return name;
+  }
+  std::ostringstream number;
+  number << std::setw(pattern.width) << std::setfill('0') << frame;
+  return name.substr(0, pattern.at) + number.str() + name.substr(pattern.at + pattern.length);
+}
+
+bool write_ppm(const std::string& filename, int width, int height,
+               const unsigned char* rgb)
+{
+  std::ofstream out(filename.c_str(), std::ios::out | std::ios::binary);
+  if (!out) {
+    return false;
+  }
+  out << "P6\n" << width << " " << height << "\n255\n";
+  out.write((const char*)rgb, 3 * width * height);
+  return out.good();
+}
+
+// PNG output, kept dependency free: the image data is zlib-wrapped in
+// uncompressed ("stored") deflate blocks, so only the checksums need
+// computing.
+
+static unsigned long crc32_update(unsigned long crc, const unsigned char* data, size_t len)
+{
+  static unsigned long table[256];
+  static bool table_ready = false;
+  if (!table_ready) {
+    for (unsigned long n = 0; n < 256; ++n) {
+      unsigned long c = n;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+      }
+      table[n] = c;
+    }
+    table_ready = true;
+  }
+
+  crc ^= 0xffffffffUL;
+  for (size_t i = 0; i < len; ++i) {
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc ^ 0xffffffffUL;
+}
+
+static void put_u32(std::vector<unsigned char>& buf, unsigned long v)
+{
+  buf.push_back((v >> 24) & 0xff);
+  buf.push_back((v >> 16) & 0xff);
+  buf.push_back((v >> 8) & 0xff);
+  buf.push_back(v & 0xff);
+}
+
+static void write_chunk(std::ofstream& out, const char* type,
+                        const std::vector<unsigned char>& data)
+{
+  std::vector<unsigned char> chunk;
+  put_u32(chunk, data.size());
+  chunk.insert(chunk.end(), type, type + 4);
+  chunk.insert(chunk.end(), data.begin(), data.end());
+  put_u32(chunk, crc32_update(0, &chunk[4], chunk.size() - 4));
+  out.write((const char*)&chunk[0], chunk.size());
+}
+
+bool write_png(const std::string& filename, int width, int height,
+               const unsigned char* rgb)
+{
+  std::ofstream out(filename.c_str(), std::ios::out | std::ios::binary);
+  if (!out) {
+    return false;
+  }
+
+  static const unsigned char signature[8] =
+    { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  out.write((const char*)signature, 8);
+
+  std::vector<unsigned char> header;
+  put_u32(header, width);
+  put_u32(header, height);
+  header.push_back(8);    // bit depth
+  header.push_back(2);    // colour type: RGB
+  header.push_back(0);    // deflate
+  header.push_back(0);    // adaptive filtering
+  header.push_back(0);    // no interlace
+  write_chunk(out, "IHDR", header);
+
+  // Each scanline is prefixed with filter type 0 (none)
+  size_t row = 3 * width;
+  std::vector<unsigned char> raw;
+  raw.reserve((row + 1) * height);
+  for (int y = 0; y < height; ++y) {
+    raw.push_back(0);
+    raw.insert(raw.end(), rgb + y * row, rgb + (y + 1) * row);
+  }
+
+  std::vector<unsigned char> zlib;
+  zlib.push_back(0x78);
+  zlib.push_back(0x01);
+  const size_t max_block = 65535;
+  for (size_t pos = 0; pos < raw.size() || pos == 0; pos += max_block) {
+    size_t len = std::min(max_block, raw.size() - pos);
+    bool last = pos + len >= raw.size();
+    zlib.push_back(last ? 1 : 0);
+    zlib.push_back(len & 0xff);
+    zlib.push_back((len >> 8) & 0xff);
+    zlib.push_back(~len & 0xff);
+    zlib.push_back((~len >> 8) & 0xff);
+    zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + len);
+    if (last) break;
+  }
+
+  unsigned long a = 1, b = 0;
+  for (size_t i = 0; i < raw.size(); ++i) {
+    a = (a + raw[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  put_u32(zlib, (b << 16) | a);
+  write_chunk(out, "IDAT", zlib);
+
+  write_chunk(out, "IEND", std::vector<unsigned char>());
+  return out.good();
+}
+
+int render_headless(SceneNode* root, const HeadlessOptions& options)
+{
+  FramePattern pattern;
+  if (!parse_frame_pattern(options.output, pattern)) {
+    std::cerr << "Output name " << options.output
+              << " may only hold one %d or %0Nd, for the frame number" << std::endl;
+    return 1;
+  }
+  if (options.frames > 1 && pattern.at == std::string::npos) {
+    std::cerr << "Writing " << options.frames << " frames needs an output name with"
+              << " %d or %0Nd in it, for the frame number" << std::endl;
+    return 1;
+  }
+
+  OffscreenContext context;
+  if (!context.create(options.width, options.height)) {
+    return 1;
+  }
+
+  SceneRenderer renderer;
+  renderer.set_scene_node(root);
+  renderer.init_gl();
+
+  AnimationClip clip;
+  AnimationPlayer animator;
+  if (!options.animation.empty()) {
+    if (!clip.load(options.animation)) {
+      std::cerr << "Could not read " << options.animation << std::endl;
+      return 1;
+    }
+    animator.bind(&clip, root->registry(), root);
+  }
+
+  SkeletonTemplate skeleton(root);
+  Crowd crowd(&skeleton);
+  if (options.crowd) {
+    crowd.spawn_grid(options.crowd, 2.2 * skeleton.radius());
+    renderer.set_crowd(&crowd);
+  }
+
+  FrameProfiler profiler;
+  profiler.set_keep_all(true);
+  profiler.set_enabled(!options.profile.empty());
+  renderer.timing = profiler.is_enabled();
+
+  // The camera starts where the viewer's does
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+
+  bool png = ends_with(options.output, ".png");
+
+  int width = options.width, height = options.height;
+  std::vector<unsigned char> pixels(3 * width * height);
+  std::vector<unsigned char> flipped(pixels.size());
+
+  for (int frame = 0; frame < options.frames; ++frame) {
+    if (animator.is_bound()) {
+      animator.seek(frame / animator.rate());
+    }
+    if (options.crowd) {
+      crowd.follow_source();
+    }
+    renderer.render(width, height);
+
+    // Waiting for the GPU and reading back stand in for the swap
+    double start = profiler.is_enabled() ? FrameProfiler::now_us() : 0;
+    glFinish();
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+    if (profiler.is_enabled()) {
+      profiler.add_frame(renderer.stats(), FrameProfiler::now_us() - start);
+    }
+
+    // GL rows run bottom to top, image files top to bottom
+    size_t row = 3 * width;
+    for (int y = 0; y < height; ++y) {
+      std::copy(pixels.begin() + y * row, pixels.begin() + (y + 1) * row,
+                flipped.begin() + (height - 1 - y) * row);
+    }
+
+    std::string filename = frame_filename(options.output, pattern, frame);
+
+    bool ok = png ? write_png(filename, width, height, &flipped[0])
+                  : write_ppm(filename, width, height, &flipped[0]);
+    if (!ok) {
+      std::cerr << "Could not write " << filename << std::endl;
+      return 1;
+    }
+
+    std::cerr << filename << ": " << renderer.stats() << std::endl;
+  }
+
+  if (profiler.is_enabled() && !profiler.save(options.profile)) {
+    std::cerr << "Could not write " << options.profile << std::endl;
+    return 1;
+  }
+  return 0;
+}
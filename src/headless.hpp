@@ -0,0 +1,60 @@
+#ifndef CS488_HEADLESS_HPP
+#define CS488_HEADLESS_HPP
+
+#include <string>
+#include <EGL/egl.h>
+#include "scene.hpp"
+
+// Settings for rendering without a window
+struct HeadlessOptions {
+  HeadlessOptions()
+    : width(512), height(512), frames(1), output("frame.ppm"), crowd(0)
+  {
+  }
+
+  int width, height;
+  int frames;
+  // Where to write the frames. A name ending in ".png" is written as
+  // PNG, anything else as binary PPM. The frame number goes in place
+  // of a "%d", or of "%0Nd" padded to N digits (e.g. "frame%04d.png");
+  // the name may hold no other '%', and must hold one of these to
+  // write more than one frame.
+  std::string output;
+  // If set, per-frame timings are written here as CSV, or JSON for a
+  // name ending in ".json"
+  std::string profile;
+  // If set, a clip to play: frame n shows the pose at n / 60 seconds
+  std::string animation;
+  // If not 0, draw this many copies of the scene behind it, posed as
+  // it is
+  size_t crowd;
+};
+
+// An offscreen GL context with a width x height colour and depth
+// buffer, made current by create(). Uses Mesa's surfaceless EGL
+// platform where available, so no display server is needed.
+class OffscreenContext {
+public:
+  OffscreenContext();
+  ~OffscreenContext();
+
+  bool create(int width, int height);
+
+private:
+  EGLDisplay m_display;
+  EGLSurface m_surface;
+  EGLContext m_context;
+};
+
+// Render root through an OffscreenContext and write each frame to
+// disk. Drawing goes through the same SceneRenderer as the viewer.
+// Returns a process exit status.
+int render_headless(SceneNode* root, const HeadlessOptions& options);
+
+// Write tightly packed, top-down 8-bit RGB pixels to filename
+bool write_ppm(const std::string& filename, int width, int height,
+               const unsigned char* rgb);
+bool write_png(const std::string& filename, int width, int height,
+               const unsigned char* rgb);
+
+#endif
@@ -0,0 +1,623 @@
+#include "ik.hpp"
+#include "crowd.hpp"
+#include "scene.hpp"
+#include "taskpool.hpp"
+#include <algorithm>
+#include <math.h>
+
+// Blocks per piece of a crowd solve
+static const size_t SOLVE_GRAIN = 4;
+
+// Solves blocks of a crowd's instances, counting what each thread
+// reaches
+class IKSolveJob : public TaskJob {
+public:
+  IKSolveJob(const IKSolver& solver, Crowd& crowd, const Point3D* targets,
+             std::vector<size_t>& solved)
+    : m_solver(solver), m_crowd(crowd), m_targets(targets), m_solved(solved)
+  {
+  }
+
+  virtual void run(size_t begin, size_t end, int worker)
+  {
+    IKSolver::Block block;
+    for (size_t b = begin; b < end; ++b) {
+      size_t first = b * IKSolver::LANES;
+      size_t count = std::min(m_crowd.size() - first, size_t(IKSolver::LANES));
+      m_solved[worker] += m_solver.solve_instances(m_crowd, m_targets, first, count, block);
+    }
+  }
+
+private:
+  const IKSolver& m_solver;
+  Crowd& m_crowd;
+  const Point3D* m_targets;
+  std::vector<size_t>& m_solved;
+};
+
+IKSolver::IKSolver(const SkeletonTemplate* skeleton)
+  : m_skeleton(skeleton),
+    m_iterations(20),
+    m_tolerance(1e-3)
+{
+}
+
+bool IKSolver::set_chain(const std::string& from, const std::string& to)
+{
+  m_links.clear();
+
+  const SkeletonTemplate& s = *m_skeleton;
+  int top = s.find_node(from), end = s.find_node(to);
+  if (top <= 0 || end < 0) {
+    return false;
+  }
+
+  std::vector<int> path;
+  int joints = 0;
+  for (int n = end; n != top; n = s.parent(n)) {
+    if (n < 0 || path.size() == MAX_LINKS) {
+      return false;
+    }
+    path.push_back(n);
+    joints += s.joint(n) >= 0;
+  }
+  path.push_back(top);
+  joints += s.joint(top) >= 0;
+  if (joints == 0 || path.size() > MAX_LINKS) {
+    return false;
+  }
+
+  for (std::vector<int>::reverse_iterator it = path.rbegin(); it != path.rend(); ++it) {
+    Link link;
+    link.node = *it;
+    link.joint = s.joint(*it);
+    link.init = s.initial_transform(*it);
+    link.init_inverse = link.init.invert();
+    if (link.joint >= 0) {
+      link.init_x = s.initial_angle_x(link.joint);
+      link.init_y = s.initial_angle_y(link.joint);
+      link.x = turn_range(s.min_angle_x(link.joint), link.init_x, s.max_angle_x(link.joint));
+      link.y = turn_range(s.min_angle_y(link.joint), link.init_y, s.max_angle_y(link.joint));
+    }
+    else {
+      link.init_x = link.init_y = 0;
+      link.x = link.y = turn_range(0, 0, 0);
+    }
+    m_links.push_back(link);
+  }
+  return true;
+}
+
+void IKSolver::chain_joints(std::vector<int>& joints) const
+{
+  joints.clear();
+  for (std::vector<Link>::const_iterator it = m_links.begin(); it != m_links.end(); ++it) {
+    if (it->joint >= 0) {
+      joints.push_back(it->joint);
+    }
+  }
+}
+
+size_t IKSolver::solve(Crowd& crowd, const Point3D* targets, TaskPool* pool) const
+{
+  if (m_links.empty() || crowd.size() == 0) {
+    return 0;
+  }
+
+  size_t blocks = (crowd.size() + LANES - 1) / LANES;
+  std::vector<size_t> solved(pool ? pool->thread_count() : 1, 0);
+  IKSolveJob job(*this, crowd, targets, solved);
+  if (pool) {
+    pool->run(job, blocks, SOLVE_GRAIN);
+  }
+  else {
+    job.run(0, blocks, 0);
+  }
+
+  size_t total = 0;
+  for (std::vector<size_t>::const_iterator it = solved.begin(); it != solved.end(); ++it) {
+    total += *it;
+  }
+  return total;
+}
+
+bool IKSolver::solve_source(const Point3D& target) const
+{
+  const SkeletonTemplate& s = *m_skeleton;
+  if (m_links.empty()) {
+    return false;
+  }
+
+  std::vector<double> x(s.joint_count()), y(s.joint_count());
+  if (!x.empty()) {
+    s.current_pose(&x[0], &y[0]);
+  }
+  double lx[MAX_LINKS], ly[MAX_LINKS];
+  for (size_t k = 0; k < m_links.size(); ++k) {
+    int j = m_links[k].joint;
+    lx[k] = j >= 0 ? x[j] : 0;
+    ly[k] = j >= 0 ? y[j] : 0;
+  }
+  AffineTransform base = s.world_transform(s.parent(m_links[0].node),
+                                           s.current_root_transform(),
+                                           x.empty() ? NULL : &x[0],
+                                           y.empty() ? NULL : &y[0]);
+
+  // One problem, in every lane
+  Block block;
+  for (int l = 0; l < LANES; ++l) {
+    load(block, l, base, target, lx, ly);
+  }
+  solve_block(block);
+  store(block, 0, lx, ly);
+
+  for (size_t k = 0; k < m_links.size(); ++k) {
+    if (m_links[k].joint >= 0) {
+      s.source_joint(m_links[k].joint)->set_angles(lx[k], ly[k]);
+    }
+  }
+  return block.error[0] <= m_tolerance * m_tolerance;
+}
+
+Point3D IKSolver::effector(const Crowd& crowd, size_t instance) const
+{
+  if (m_links.empty()) {
+    return Point3D();
+  }
+  return crowd.world_transform(instance, m_links.back().node) * Point3D();
+}
+
+size_t IKSolver::solve_instances(Crowd& crowd, const Point3D* targets, size_t first,
+                                 size_t count, Block& block) const
+{
+  const SkeletonTemplate& s = *m_skeleton;
+  int base_node = s.parent(m_links[0].node);
+  double x[MAX_LINKS], y[MAX_LINKS];
+
+  // Lanes past the last instance repeat it
+  for (int l = 0; l < LANES; ++l) {
+    size_t i = first + std::min(size_t(l), count - 1);
+    for (size_t k = 0; k < m_links.size(); ++k) {
+      int j = m_links[k].joint;
+      x[k] = j >= 0 ? crowd.angle_x(i, j) : 0;
+      y[k] = j >= 0 ? crowd.angle_y(i, j) : 0;
+    }
+    load(block, l, crowd.world_transform(i, base_node), targets[i], x, y);
+  }
+
+  solve_block(block);
+
+  size_t solved = 0;
+  for (size_t l = 0; l < count; ++l) {
+    store(block, l, x, y);
+    for (size_t k = 0; k < m_links.size(); ++k) {
+      if (m_links[k].joint >= 0) {
+        crowd.set_angles(first + l, m_links[k].joint, x[k], y[k]);
+      }
+    }
+    solved += block.error[l] <= m_tolerance * m_tolerance;
+  }
+  return solved;
+}
+
+/*
+ * Turns as cosine and sine
+ */
+
+// Determinants no bigger than this are singular
+static const double DEGENERATE = 1e-24;
+
+IKSolver::TurnRange IKSolver::turn_range(double min, double init, double max)
+{
+  TurnRange range;
+  range.min = min;
+  range.max = max;
+
+  double lo = (min - init) * M_PI / 180, hi = (max - init) * M_PI / 180;
+  double mid = (lo + hi) / 2;
+  range.mid_c = cos(mid);
+  range.mid_s = sin(mid);
+  // A range of a whole turn or more never clamps
+  range.half_cos = hi - lo >= 2 * M_PI ? -2 : cos((hi - lo) / 2);
+  range.lo_c = cos(lo);
+  range.lo_s = sin(lo);
+  range.hi_c = cos(hi);
+  range.hi_s = sin(hi);
+  return range;
+}
+
+// A turn is within range when it is no further from the middle than
+// half the range's width, that is when the cosine of the difference is
+// no less than that of the half width. Outside, it goes to whichever
+// end is nearer.
+bool IKSolver::clamp_turn(const TurnRange& range, double& c, double& s)
+{
+  if (c * range.mid_c + s * range.mid_s >= range.half_cos) {
+    return false;
+  }
+  if (c * range.lo_c + s * range.lo_s >= c * range.hi_c + s * range.hi_s) {
+    c = range.lo_c;
+    s = range.lo_s;
+  }
+  else {
+    c = range.hi_c;
+    s = range.hi_s;
+  }
+  return true;
+}
+
+// Turn (c, s) on by about angle radians, without trigonometry: by
+// twice the arctangent of half of it, near enough the same when small,
+// and never more than half a turn when not
+bool IKSolver::turn(const TurnRange& range, double angle, double& c, double& s)
+{
+  double h = angle / 2, d = 1 / (1 + h * h);
+  double tc = (1 - h * h) * d, ts = 2 * h * d;
+  double nc = c * tc - s * ts;
+  s = s * tc + c * ts;
+  c = nc;
+  return clamp_turn(range, c, s);
+}
+
+// The angle a turn from init leaves a joint at, brought into its
+// range by whole turns
+double IKSolver::turn_angle(const TurnRange& range, double init, double c, double s)
+{
+  double angle = init + atan2(s, c) * 180 / M_PI;
+  if (angle < range.min) {
+    angle += 360 * ceil((range.min - angle) / 360);
+  }
+  else if (angle > range.max) {
+    angle -= 360 * ceil((angle - range.max) / 360);
+  }
+  // Only rounding is left outside
+  return std::min(std::max(angle, range.min), range.max);
+}
+
+// Turn (c, s) halfway to (mid_c, mid_s), the middle of a range
+static void bisect_turn(double mid_c, double mid_s, double& c, double& s)
+{
+  double bc = c + mid_c, bs = s + mid_s;
+  double length = sqrt(bc * bc + bs * bs);
+  if (length > 0) {
+    c = bc / length;
+    s = bs / length;
+  }
+}
+
+/*
+ * Blocks
+ */
+
+void IKSolver::load(Block& block, int lane, const AffineTransform& base,
+                    const Point3D& target, const double* x, const double* y) const
+{
+  Point3D t = base.invert() * target;
+  block.tx[lane] = t[0];
+  block.ty[lane] = t[1];
+  block.tz[lane] = t[2];
+
+  for (size_t k = 0; k < m_links.size(); ++k) {
+    const Link& link = m_links[k];
+    if (link.joint < 0) {
+      continue;
+    }
+    double dx = (x[k] - link.init_x) * M_PI / 180, dy = (y[k] - link.init_y) * M_PI / 180;
+    block.xc[k][lane] = cos(dx);
+    block.xs[k][lane] = sin(dx);
+    block.yc[k][lane] = cos(dy);
+    block.ys[k][lane] = sin(dy);
+    block.x_free[k][lane] = block.y_free[k][lane] = 1;
+  }
+  block.error[lane] = block.last_error[lane] = HUGE_VAL;
+  block.stalls[lane] = 0;
+  block.best_error[lane] = HUGE_VAL;
+}
+
+void IKSolver::store(const Block& block, int lane, double* x, double* y) const
+{
+  for (size_t k = 0; k < m_links.size(); ++k) {
+    const Link& link = m_links[k];
+    if (link.joint < 0) {
+      x[k] = y[k] = 0;
+      continue;
+    }
+    x[k] = turn_angle(link.x, link.init_x, block.xc[k][lane], block.xs[k][lane]);
+    y[k] = turn_angle(link.y, link.init_y, block.yc[k][lane], block.ys[k][lane]);
+  }
+}
+
+void IKSolver::solve_block(Block& block) const
+{
+  double tolerance = m_tolerance * m_tolerance;
+  for (int i = 0; i < m_iterations; ++i) {
+    pose(block);
+    bool done = true;
+    for (int l = 0; l < LANES; ++l) {
+      done &= block.error[l] <= tolerance;
+    }
+    if (done) {
+      return;
+    }
+    if (recover(block, tolerance)) {
+      pose(block);
+    }
+    for (int l = 0; l < LANES; ++l) {
+      block.last_error[l] = block.error[l];
+    }
+    step(block);
+  }
+  pose(block);
+  restore_best(block);
+}
+
+void IKSolver::pose(Block& block) const
+{
+  // The frame of the link being visited, in the base frame: its x, y
+  // and z axes in f[0..2], f[3..5] and f[6..8], its origin in f[9..11]
+  double f[12][LANES];
+  for (int i = 0; i < 12; ++i) {
+    for (int l = 0; l < LANES; ++l) {
+      f[i][l] = i == 0 || i == 4 || i == 8;
+    }
+  }
+
+  int links = m_links.size();
+  for (int k = 0; k < links; ++k) {
+    const Link& link = m_links[k];
+    if (link.joint >= 0) {
+      const double* xc = block.xc[k];
+      const double* xs = block.xs[k];
+      const double* yc = block.yc[k];
+      const double* ys = block.ys[k];
+      for (int l = 0; l < LANES; ++l) {
+        // A joint turns about the parent's origin: about its z axis,
+        // then about the x axis that leaves
+        block.ox[k][l] = f[9][l];
+        block.oy[k][l] = f[10][l];
+        block.oz[k][l] = f[11][l];
+        block.zx[k][l] = f[6][l];
+        block.zy[k][l] = f[7][l];
+        block.zz[k][l] = f[8][l];
+
+        double x0 = f[0][l], x1 = f[1][l], x2 = f[2][l];
+        double y0 = f[3][l], y1 = f[4][l], y2 = f[5][l];
+        double z0 = f[6][l], z1 = f[7][l], z2 = f[8][l];
+        block.xx[k][l] = f[0][l] = yc[l] * x0 + ys[l] * y0;
+        block.xy[k][l] = f[1][l] = yc[l] * x1 + ys[l] * y1;
+        block.xz[k][l] = f[2][l] = yc[l] * x2 + ys[l] * y2;
+        y0 = yc[l] * y0 - ys[l] * x0;
+        y1 = yc[l] * y1 - ys[l] * x1;
+        y2 = yc[l] * y2 - ys[l] * x2;
+        f[3][l] = xc[l] * y0 + xs[l] * z0;
+        f[4][l] = xc[l] * y1 + xs[l] * z1;
+        f[5][l] = xc[l] * y2 + xs[l] * z2;
+        f[6][l] = xc[l] * z0 - xs[l] * y0;
+        f[7][l] = xc[l] * z1 - xs[l] * y1;
+        f[8][l] = xc[l] * z2 - xs[l] * y2;
+      }
+    }
+
+    // Then the initial transform
+    const AffineTransform& m = link.init;
+    for (int l = 0; l < LANES; ++l) {
+      double r[9];
+      for (int i = 0; i < 3; ++i) {
+        for (int c = 0; c < 3; ++c) {
+          r[c * 3 + i] = f[i][l] * m[0][c] + f[3 + i][l] * m[1][c] + f[6 + i][l] * m[2][c];
+        }
+        f[9 + i][l] += f[i][l] * m[0][3] + f[3 + i][l] * m[1][3] + f[6 + i][l] * m[2][3];
+      }
+      for (int i = 0; i < 9; ++i) {
+        f[i][l] = r[i];
+      }
+    }
+  }
+
+  for (int l = 0; l < LANES; ++l) {
+    block.ex[l] = f[9][l];
+    block.ey[l] = f[10][l];
+    block.ez[l] = f[11][l];
+    double dx = block.tx[l] - f[9][l];
+    double dy = block.ty[l] - f[10][l];
+    double dz = block.tz[l] - f[11][l];
+    block.error[l] = dx * dx + dy * dy + dz * dz;
+  }
+}
+
+// Damping is the squared error times this. Far from the target, where
+// the chain's linear picture of itself is poor, steps are short; near
+// it they approach Gauss-Newton's, which converge quadratically.
+static const double DAMPING = 1;
+
+void IKSolver::step(Block& block) const
+{
+  int links = m_links.size();
+
+  // The Jacobian: how the effector moves as each turn does, the axis
+  // crossed with the lever from the pivot to the effector
+  for (int k = 0; k < links; ++k) {
+    if (m_links[k].joint < 0) {
+      continue;
+    }
+    for (int l = 0; l < LANES; ++l) {
+      double rx = block.ex[l] - block.ox[k][l];
+      double ry = block.ey[l] - block.oy[k][l];
+      double rz = block.ez[l] - block.oz[k][l];
+      double ax = block.xx[k][l], ay = block.xy[k][l], az = block.xz[k][l];
+      block.xx[k][l] = ay * rz - az * ry;
+      block.xy[k][l] = az * rx - ax * rz;
+      block.xz[k][l] = ax * ry - ay * rx;
+      ax = block.zx[k][l];
+      ay = block.zy[k][l];
+      az = block.zz[k][l];
+      block.zx[k][l] = ay * rz - az * ry;
+      block.zy[k][l] = az * rx - ax * rz;
+      block.zz[k][l] = ax * ry - ay * rx;
+    }
+  }
+
+  // J * J^T plus the damping, leaving out turns held at an end of
+  // their range, so the rest make up for them
+  double a00[LANES], a01[LANES], a02[LANES], a11[LANES], a12[LANES], a22[LANES];
+  for (int l = 0; l < LANES; ++l) {
+    a00[l] = a11[l] = a22[l] = DAMPING * block.error[l];
+    a01[l] = a02[l] = a12[l] = 0;
+  }
+  for (int k = 0; k < links; ++k) {
+    if (m_links[k].joint < 0) {
+      continue;
+    }
+    for (int l = 0; l < LANES; ++l) {
+      double w = block.x_free[k][l];
+      double jx = block.xx[k][l] * w, jy = block.xy[k][l] * w, jz = block.xz[k][l] * w;
+      a00[l] += jx * jx;
+      a01[l] += jx * jy;
+      a02[l] += jx * jz;
+      a11[l] += jy * jy;
+      a12[l] += jy * jz;
+      a22[l] += jz * jz;
+      w = block.y_free[k][l];
+      jx = block.zx[k][l] * w;
+      jy = block.zy[k][l] * w;
+      jz = block.zz[k][l] * w;
+      a00[l] += jx * jx;
+      a01[l] += jx * jy;
+      a02[l] += jx * jz;
+      a11[l] += jy * jy;
+      a12[l] += jy * jz;
+      a22[l] += jz * jz;
+    }
+  }
+
+  // w = (J * J^T + damping)^-1 * (target - effector), by the adjugate
+  double wx[LANES], wy[LANES], wz[LANES];
+  for (int l = 0; l < LANES; ++l) {
+    double c00 = a11[l] * a22[l] - a12[l] * a12[l];
+    double c01 = a02[l] * a12[l] - a01[l] * a22[l];
+    double c02 = a01[l] * a12[l] - a02[l] * a11[l];
+    double c11 = a00[l] * a22[l] - a02[l] * a02[l];
+    double c12 = a01[l] * a02[l] - a00[l] * a12[l];
+    double c22 = a00[l] * a11[l] - a01[l] * a01[l];
+    double det = a00[l] * c00 + a01[l] * c01 + a02[l] * c02;
+    double inv = det > DEGENERATE ? 1 / det : 0;
+    double dx = block.tx[l] - block.ex[l];
+    double dy = block.ty[l] - block.ey[l];
+    double dz = block.tz[l] - block.ez[l];
+    wx[l] = (c00 * dx + c01 * dy + c02 * dz) * inv;
+    wy[l] = (c01 * dx + c11 * dy + c12 * dz) * inv;
+    wz[l] = (c02 * dx + c12 * dy + c22 * dz) * inv;
+  }
+
+  // and every turn by J^T * w. One that would go past an end of its
+  // range stops there, and is held out of the next step.
+  for (int k = 0; k < links; ++k) {
+    const Link& link = m_links[k];
+    if (link.joint < 0) {
+      continue;
+    }
+    for (int l = 0; l < LANES; ++l) {
+      double dx = block.xx[k][l] * wx[l] + block.xy[k][l] * wy[l] + block.xz[k][l] * wz[l];
+      double dy = block.zx[k][l] * wx[l] + block.zy[k][l] * wy[l] + block.zz[k][l] * wz[l];
+      block.x_free[k][l] = !turn(link.x, dx, block.xc[k][l], block.xs[k][l]);
+      block.y_free[k][l] = !turn(link.y, dy, block.yc[k][l], block.ys[k][l]);
+    }
+  }
+}
+
+// A lane whose step took off less than this fraction of its error has
+// stalled
+static const double STALL_PROGRESS = 0.1;
+
+bool IKSolver::recover(Block& block, double tolerance) const
+{
+  // Typically a joint held at one end of a one-sided range, such as a
+  // straight knee that can only bend one way: the step keeps asking it
+  // to go past the end, so it stays held and the rest of the chain
+  // cannot make up the difference. Bisecting the turn and the middle of
+  // its range gives the next steps somewhere to go. A lane that stalls
+  // again is in a pose the chain cannot leave on its own, so then
+  // every turn is moved.
+  int links = m_links.size();
+  double stalled[LANES], all[LANES];
+  for (int l = 0; l < LANES; ++l) {
+    stalled[l] = 0;
+  }
+  for (int k = 0; k < links; ++k) {
+    const Link& link = m_links[k];
+    if (link.joint < 0) {
+      continue;
+    }
+    // A turn with no range is always held, and no help
+    double x_moves = link.x.max > link.x.min, y_moves = link.y.max > link.y.min;
+    for (int l = 0; l < LANES; ++l) {
+      stalled[l] += x_moves * !block.x_free[k][l] + y_moves * !block.y_free[k][l];
+    }
+  }
+  bool any = false;
+  for (int l = 0; l < LANES; ++l) {
+    // A lane with nothing held is only slow, as when out of reach
+    stalled[l] = stalled[l] && block.error[l] > tolerance &&
+      block.error[l] > (1 - STALL_PROGRESS) * block.last_error[l];
+    block.stalls[l] += stalled[l];
+    all[l] = block.stalls[l] > 1;
+    any |= stalled[l] != 0;
+  }
+  if (!any) {
+    return false;
+  }
+
+  // Where a lane stalls is as near as it has come since the last
+  // time, so it is kept if it is the nearest yet
+  double keep[LANES];
+  for (int l = 0; l < LANES; ++l) {
+    keep[l] = stalled[l] && block.error[l] < block.best_error[l];
+    if (keep[l]) {
+      block.best_error[l] = block.error[l];
+    }
+  }
+
+  for (int k = 0; k < links; ++k) {
+    const Link& link = m_links[k];
+    if (link.joint < 0) {
+      continue;
+    }
+    for (int l = 0; l < LANES; ++l) {
+      if (keep[l]) {
+        block.best_xc[k][l] = block.xc[k][l];
+        block.best_xs[k][l] = block.xs[k][l];
+        block.best_yc[k][l] = block.yc[k][l];
+        block.best_ys[k][l] = block.ys[k][l];
+      }
+      if (stalled[l] && (all[l] || !block.x_free[k][l])) {
+        bisect_turn(link.x.mid_c, link.x.mid_s, block.xc[k][l], block.xs[k][l]);
+        block.x_free[k][l] = 1;
+      }
+      if (stalled[l] && (all[l] || !block.y_free[k][l])) {
+        bisect_turn(link.y.mid_c, link.y.mid_s, block.yc[k][l], block.ys[k][l]);
+        block.y_free[k][l] = 1;
+      }
+    }
+  }
+  return true;
+}
+
+void IKSolver::restore_best(Block& block) const
+{
+  int links = m_links.size();
+  for (int l = 0; l < LANES; ++l) {
+    if (block.best_error[l] >= block.error[l]) {
+      continue;
+    }
+    for (int k = 0; k < links; ++k) {
+      if (m_links[k].joint < 0) {
+        continue;
+      }
+      block.xc[k][l] = block.best_xc[k][l];
+      block.xs[k][l] = block.best_xs[k][l];
+      block.yc[k][l] = block.best_yc[k][l];
+      block.ys[k][l] = block.best_ys[k][l];
+    }
+    block.error[l] = block.best_error[l];
+  }
+}
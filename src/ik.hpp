@@ -0,0 +1,154 @@
+#ifndef CS488_IK_HPP
+#define CS488_IK_HPP
+
+#include <string>
+#include <vector>
+#include "algebra.hpp"
+#include "affine.hpp"
+
+class SkeletonTemplate;
+class Crowd;
+class TaskPool;
+
+// Inverse kinematics for one chain of a SkeletonTemplate: the path
+// from a joint down to a node below it, whose origin (the end
+// effector) is to be brought to a target. Only the joints on the
+// chain turn, and each stays within its x and y ranges.
+//
+// The solver is damped least squares. Each iteration poses the chain,
+// takes the Jacobian of the effector's position in every turn, and
+// moves all the turns at once along J^T (J J^T + d I)^-1 e, where e is
+// what is left to go and d grows with its square; a turn that hits an
+// end of its range stays there and is held out of the next step. A
+// problem whose step gets it no nearer, as when a knee that bends one
+// way only is held straight, has its held turns moved halfway to the
+// middle of their ranges, and all of them once that has not helped.
+// Turns are kept as cosine and sine pairs, stepped and clamped as
+// such, so iterations are arithmetic only.
+//
+// Problems are solved LANES at a time, every quantity stored lane by
+// lane, so each stage of an iteration is one loop over the lanes
+// through contiguous arrays, and a crowd's blocks of problems are
+// shared among a TaskPool's threads.
+class IKSolver {
+public:
+  enum { LANES = 8, MAX_LINKS = 32 };
+
+  explicit IKSolver(const SkeletonTemplate* skeleton);
+
+  // Solve for the chain from the node named from down to the node
+  // named to. Returns false, leaving no chain, unless to is below
+  // from, from is below the root, and the path holds a joint and at
+  // most MAX_LINKS nodes.
+  bool set_chain(const std::string& from, const std::string& to);
+  bool has_chain() const { return !m_links.empty(); }
+  // Joint slots on the chain, nearest the root first
+  void chain_joints(std::vector<int>& joints) const;
+
+  // Iterations per problem at most, and how near the effector must come
+  // to the target to stop early. Distances are measured in the frame
+  // of from's parent, which is the target's own unless something
+  // above the chain scales.
+  void set_iterations(int iterations) { m_iterations = iterations; }
+  void set_tolerance(double tolerance) { m_tolerance = tolerance; }
+
+  // Turn the chain of every instance of crowd so its effector reaches
+  // for targets[i], given in the frame Crowd::part_transforms() gives
+  // transforms in. Returns how many came within tolerance.
+  size_t solve(Crowd& crowd, const Point3D* targets, TaskPool* pool = NULL) const;
+
+  // The same for the template's source scene as it is posed now, with
+  // target in the frame its root is placed in. The chain's joints,
+  // the very JointNodes the template was compiled from, are posed
+  // with JointNode::set_angles(). Returns false if the target was not
+  // reached.
+  bool solve_source(const Point3D& target) const;
+
+  // The effector of an instance as it is posed now
+  Point3D effector(const Crowd& crowd, size_t instance) const;
+
+private:
+  // The range a joint may turn through about one axis, relative to
+  // its initial angle, in the form clamp_turn() wants
+  struct TurnRange {
+    double min, max;            // absolute angles, in degrees
+    double mid_c, mid_s;        // the middle of the range
+    double half_cos;            // cosine of half its width, or -2
+    double lo_c, lo_s, hi_c, hi_s;
+  };
+
+  struct Link {
+    int node;
+    int joint;                  // slot, or -1 if the node is not one
+    AffineTransform init, init_inverse;
+    double init_x, init_y;
+    TurnRange x, y;
+  };
+
+  // Every problem of a block, lane by lane
+  struct Block {
+    // Target, in the frame of from's parent
+    double tx[LANES], ty[LANES], tz[LANES];
+    // Each link's turns as cosine and sine, about x and about z, and
+    // whether they are free of the ends of their ranges
+    double xc[MAX_LINKS][LANES], xs[MAX_LINKS][LANES];
+    double yc[MAX_LINKS][LANES], ys[MAX_LINKS][LANES];
+    double x_free[MAX_LINKS][LANES], y_free[MAX_LINKS][LANES];
+    // As last posed: where each link turns, the axes it turns about
+    // (the Jacobian's columns, once step() has made them so), and the
+    // effector
+    double ox[MAX_LINKS][LANES], oy[MAX_LINKS][LANES], oz[MAX_LINKS][LANES];
+    double xx[MAX_LINKS][LANES], xy[MAX_LINKS][LANES], xz[MAX_LINKS][LANES];
+    double zx[MAX_LINKS][LANES], zy[MAX_LINKS][LANES], zz[MAX_LINKS][LANES];
+    double ex[LANES], ey[LANES], ez[LANES];
+    // Squared distance from effector to target, and what it was
+    // before the last step
+    double error[LANES], last_error[LANES];
+    // Steps that have brought the lane no nearer
+    double stalls[LANES];
+    // The nearest pose recover() has moved the lane from, to go back
+    // to if it ends up further away
+    double best_xc[MAX_LINKS][LANES], best_xs[MAX_LINKS][LANES];
+    double best_yc[MAX_LINKS][LANES], best_ys[MAX_LINKS][LANES];
+    double best_error[LANES];
+  };
+
+  friend class IKSolveJob;
+
+  static TurnRange turn_range(double min, double init, double max);
+  static bool clamp_turn(const TurnRange& range, double& c, double& s);
+  static bool turn(const TurnRange& range, double angle, double& c, double& s);
+  static double turn_angle(const TurnRange& range, double init, double c, double s);
+
+  // Load lane of block with a problem: base is the world transform of
+  // from's parent, x and y the angles of each link, joint or not
+  void load(Block& block, int lane, const AffineTransform& base, const Point3D& target,
+            const double* x, const double* y) const;
+  // The angles a lane of block has reached, as load() takes them
+  void store(const Block& block, int lane, double* x, double* y) const;
+  // Step until every lane is within tolerance or out of iterations
+  void solve_block(Block& block) const;
+  // Pose every lane's chain, and measure its error
+  void pose(Block& block) const;
+  // Move every lane's turns one damped least squares step
+  void step(Block& block) const;
+  // Turn the held turns of every lane that the last step brought no
+  // nearer part of the way back to the middle of their ranges, or all
+  // its turns if it has stalled before. Returns false if no lane had
+  // stalled.
+  bool recover(Block& block, double tolerance) const;
+  // Put every lane that recover() has left further away than it was
+  // back in its nearest pose
+  void restore_best(Block& block) const;
+  // Solve instances [first, first + count) of crowd, count <= LANES.
+  // Returns how many were reached.
+  size_t solve_instances(Crowd& crowd, const Point3D* targets, size_t first,
+                         size_t count, Block& block) const;
+
+  const SkeletonTemplate* m_skeleton;
+  std::vector<Link> m_links;
+  int m_iterations;
+  double m_tolerance;
+};
+
+#endif
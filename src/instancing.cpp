@@ -0,0 +1,360 @@
+#include "instancing.hpp"
+#include "flatscene.hpp"
+#include "scene.hpp"
+#include "crowd.hpp"
+#include <cstdio>
+#include <cstddef>
+#include <iostream>
+
+static const char* vertex_source =
+  "#version 330 core\n"
+  "layout(location = 0) in vec3 position;\n"
+  "layout(location = 1) in mat4 model;\n"
+  "layout(location = 5) in mat3 normal_matrix;\n"
+  "layout(location = 8) in vec4 diffuse;\n"
+  "layout(location = 9) in vec3 specular;\n"
+  "uniform mat4 view;\n"
+  "uniform mat4 projection;\n"
+  "out vec3 v_normal;\n"
+  "out vec3 v_diffuse;\n"
+  "out vec3 v_specular;\n"
+  "out float v_shininess;\n"
+  "void main() {\n"
+  "  gl_Position = projection * view * model * vec4(position, 1.0);\n"
+  "  // On the unit sphere the position is also the normal.\n"
+  "  v_normal = mat3(view) * (normal_matrix * position);\n"
+  "  v_diffuse = diffuse.rgb;\n"
+  "  v_specular = specular;\n"
+  "  v_shininess = diffuse.a;\n"
+  "}\n";
+
+static const char* fragment_source =
+  "#version 330 core\n"
+  "uniform vec3 light_dir;\n"
+  "in vec3 v_normal;\n"
+  "in vec3 v_diffuse;\n"
+  "in vec3 v_specular;\n"
+  "in float v_shininess;\n"
+  "out vec4 colour;\n"
+  "void main() {\n"
+  "  vec3 n = normalize(v_normal);\n"
+  "  float ndotl = max(dot(n, light_dir), 0.0);\n"
+  "  // Default global ambient (0.2) times default material ambient (0.2)\n"
+  "  vec3 c = vec3(0.04) + v_diffuse * ndotl;\n"
+  "  if (ndotl > 0.0) {\n"
+  "    vec3 h = normalize(light_dir + vec3(0.0, 0.0, 1.0));\n"
+  "    c += v_specular * pow(max(dot(n, h), 0.0), v_shininess);\n"
+  "  }\n"
+  "  colour = vec4(c, 1.0);\n"
+  "}\n";
+
+static GLuint compile_shader(GLenum type, const char* source)
+{
+  GLuint shader = glCreateShader(type);
+  glShaderSource(shader, 1, &source, NULL);
+  glCompileShader(shader);
+
+  GLint ok = 0;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    std::cerr << "Instanced renderer: shader error: " << log << std::endl;
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+// Copy a row-major matrix into a column-major float array
+static void to_gl(const Matrix4x4& m, GLfloat* out)
+{
+  for (int r = 0; r < 4; ++r) {
+    for (int c = 0; c < 4; ++c) {
+      out[4*c + r] = m[r][c];
+    }
+  }
+}
+
+InstancedRenderer::InstancedRenderer()
+  : m_program(0),
+    m_vao(0),
+    m_instance_buffer(0),
+    m_view_loc(-1),
+    m_projection_loc(-1),
+    m_light_loc(-1)
+{
+}
+
+InstancedRenderer::~InstancedRenderer()
+{
+  // GL objects die with the context that created them.
+}
+
+bool InstancedRenderer::init()
+{
+  if (m_program) {
+    return true;
+  }
+
+  int major = 0, minor = 0;
+  const char* version = (const char*)glGetString(GL_VERSION);
+  if (!version || sscanf(version, "%d.%d", &major, &minor) != 2 ||
+      major < 3 || (major == 3 && minor < 3)) {
+    return false;
+  }
+
+  GLuint vs = compile_shader(GL_VERTEX_SHADER, vertex_source);
+  GLuint fs = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+  if (!vs || !fs) {
+    if (vs) glDeleteShader(vs);
+    if (fs) glDeleteShader(fs);
+    return false;
+  }
+
+  GLuint program = glCreateProgram();
+  glAttachShader(program, vs);
+  glAttachShader(program, fs);
+  glLinkProgram(program);
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+
+  GLint ok = 0;
+  glGetProgramiv(program, GL_LINK_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+    glGetProgramInfoLog(program, sizeof(log), NULL, log);
+    std::cerr << "Instanced renderer: link error: " << log << std::endl;
+    glDeleteProgram(program);
+    return false;
+  }
+
+  m_program = program;
+  m_view_loc = glGetUniformLocation(m_program, "view");
+  m_projection_loc = glGetUniformLocation(m_program, "projection");
+  m_light_loc = glGetUniformLocation(m_program, "light_dir");
+
+  glGenVertexArrays(1, &m_vao);
+  glGenBuffers(1, &m_instance_buffer);
+
+  // The per-instance attributes advance once per instance
+  glBindVertexArray(m_vao);
+  glBindBuffer(GL_ARRAY_BUFFER, m_instance_buffer);
+  for (GLuint loc = 1; loc <= 9; ++loc) {
+    glEnableVertexAttribArray(loc);
+    glVertexAttribDivisor(loc, 1);
+  }
+  glEnableVertexAttribArray(0);
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  Sphere::upload_meshes();
+  return true;
+}
+
+void InstancedRenderer::bind_instances(size_t first)
+{
+  const GLsizei stride = sizeof(Instance);
+  const char* base = (const char*)(first * sizeof(Instance));
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_instance_buffer);
+  for (int c = 0; c < 4; ++c) {
+    glVertexAttribPointer(1 + c, 4, GL_FLOAT, GL_FALSE, stride,
+                          base + offsetof(Instance, model) + 4 * c * sizeof(GLfloat));
+  }
+  for (int c = 0; c < 3; ++c) {
+    glVertexAttribPointer(5 + c, 3, GL_FLOAT, GL_FALSE, stride,
+                          base + offsetof(Instance, normal) + 3 * c * sizeof(GLfloat));
+  }
+  glVertexAttribPointer(8, 4, GL_FLOAT, GL_FALSE, stride,
+                        base + offsetof(Instance, diffuse));
+  glVertexAttribPointer(9, 3, GL_FLOAT, GL_FALSE, stride,
+                        base + offsetof(Instance, specular));
+}
+
+void InstancedRenderer::pack_material(const Material* material, Instance& inst)
+{
+  Colour kd(1.0), ks(0.1);
+  double shininess = 10;
+  const PhongMaterial* phong = dynamic_cast<const PhongMaterial*>(material);
+  if (phong) {
+    kd = phong->get_kd();
+    ks = phong->get_ks();
+    shininess = phong->get_shininess();
+  }
+  inst.diffuse[0] = kd.R();
+  inst.diffuse[1] = kd.G();
+  inst.diffuse[2] = kd.B();
+  inst.diffuse[3] = shininess;
+  inst.specular[0] = ks.R();
+  inst.specular[1] = ks.G();
+  inst.specular[2] = ks.B();
+}
+
+void InstancedRenderer::pack(const AffineTransform& w, const Instance& material,
+                             Instance& inst)
+{
+  w.to_gl(inst.model);
+
+  // Normals transform by the inverse transpose of the linear part,
+  // which up to scale is its cofactor matrix. Keep the sign of the
+  // determinant so mirrored parts still face outwards.
+  double c[3][3];
+  for (int r = 0; r < 3; ++r) {
+    for (int k = 0; k < 3; ++k) {
+      int r1 = (r + 1) % 3, r2 = (r + 2) % 3;
+      int k1 = (k + 1) % 3, k2 = (k + 2) % 3;
+      c[r][k] = w[r1][k1] * w[r2][k2] - w[r1][k2] * w[r2][k1];
+    }
+  }
+  double det = w[0][0] * c[0][0] + w[0][1] * c[0][1] + w[0][2] * c[0][2];
+  double sign = det < 0 ? -1 : 1;
+  for (int r = 0; r < 3; ++r) {
+    for (int k = 0; k < 3; ++k) {
+      inst.normal[3*k + r] = sign * c[r][k];
+    }
+  }
+
+  std::copy(material.diffuse, material.diffuse + 4, inst.diffuse);
+  std::copy(material.specular, material.specular + 3, inst.specular);
+}
+
+void InstancedRenderer::draw(const FlatScene& scene, const Matrix4x4& view,
+                             const Matrix4x4& projection,
+                             const Vector3D& light_dir, FrameStats* stats)
+{
+  size_t count = scene.geometry_count();
+  if (!m_program || count == 0) {
+    return;
+  }
+
+  // Instances are grouped by level of detail, so count each level to
+  // find where its run starts.
+  const int levels = Sphere::LOD_LEVELS;
+  m_level_start.assign(levels + 1, 0);
+  for (size_t g = 0; g < count; ++g) {
+    if (scene.geometry_visible(g)) {
+      m_level_start[scene.geometry_lod(g) + 1]++;
+    }
+  }
+  for (int l = 0; l < levels; ++l) {
+    m_level_start[l + 1] += m_level_start[l];
+  }
+
+  // Resolve the colours of each distinct material once. The extra
+  // last slot is the selection highlight.
+  m_materials.resize(scene.material_count() + 1);
+  for (size_t m = 0; m <= scene.material_count(); ++m) {
+    pack_material(m < scene.material_count() ? scene.material(m) : NULL, m_materials[m]);
+  }
+
+  m_instances.resize(m_level_start[levels]);
+  m_level_next.assign(m_level_start.begin(), m_level_start.end() - 1);
+  for (size_t g = 0; g < count; ++g) {
+    if (!scene.geometry_visible(g)) {
+      continue;
+    }
+    int m = scene.geometry_selected(g) || scene.geometry_material(g) < 0 ?
+      scene.material_count() : scene.geometry_material(g);
+    pack(scene.world(scene.geometry_node(g)), m_materials[m],
+         m_instances[m_level_next[scene.geometry_lod(g)]++]);
+  }
+
+  submit(view, projection, light_dir, stats);
+}
+
+void InstancedRenderer::draw(const Crowd& crowd, const AffineTransform* parts,
+                             const int* lods, const Matrix4x4& view,
+                             const Matrix4x4& projection,
+                             const Vector3D& light_dir, FrameStats* stats)
+{
+  const SkeletonTemplate& skeleton = crowd.skeleton();
+  size_t per_instance = skeleton.part_count();
+  size_t count = crowd.size() * per_instance;
+  if (!m_program || count == 0) {
+    return;
+  }
+
+  const int levels = Sphere::LOD_LEVELS;
+  m_level_start.assign(levels + 1, 0);
+  for (size_t k = 0; k < count; ++k) {
+    if (lods[k] >= 0) {
+      m_level_start[lods[k] + 1]++;
+    }
+  }
+  for (int l = 0; l < levels; ++l) {
+    m_level_start[l + 1] += m_level_start[l];
+  }
+
+  // Parts without a material take the last slot's defaults
+  m_materials.resize(skeleton.material_count() + 1);
+  for (size_t m = 0; m <= skeleton.material_count(); ++m) {
+    pack_material(m < skeleton.material_count() ? skeleton.material(m) : NULL,
+                  m_materials[m]);
+  }
+
+  m_instances.resize(m_level_start[levels]);
+  m_level_next.assign(m_level_start.begin(), m_level_start.end() - 1);
+  for (size_t k = 0; k < count; ++k) {
+    if (lods[k] < 0) {
+      continue;
+    }
+    int m = skeleton.part_material(k % per_instance);
+    pack(parts[k], m_materials[m < 0 ? skeleton.material_count() : m],
+         m_instances[m_level_next[lods[k]]++]);
+  }
+
+  submit(view, projection, light_dir, stats);
+}
+
+void InstancedRenderer::submit(const Matrix4x4& view, const Matrix4x4& projection,
+                               const Vector3D& light_dir, FrameStats* stats)
+{
+  const int levels = Sphere::LOD_LEVELS;
+  size_t count = m_instances.size();
+  if (count == 0) {
+    // Everything was culled
+    return;
+  }
+
+  GLfloat view_gl[16], projection_gl[16];
+  to_gl(view, view_gl);
+  to_gl(projection, projection_gl);
+
+  glUseProgram(m_program);
+  glUniformMatrix4fv(m_view_loc, 1, GL_FALSE, view_gl);
+  glUniformMatrix4fv(m_projection_loc, 1, GL_FALSE, projection_gl);
+  glUniform3f(m_light_loc, light_dir[0], light_dir[1], light_dir[2]);
+
+  glBindVertexArray(m_vao);
+  glBindBuffer(GL_ARRAY_BUFFER, m_instance_buffer);
+  glBufferData(GL_ARRAY_BUFFER, count * sizeof(Instance), &m_instances[0],
+               GL_STREAM_DRAW);
+
+  for (int l = 0; l < levels; ++l) {
+    size_t first = m_level_start[l];
+    size_t n = m_level_start[l + 1] - first;
+    if (n == 0) {
+      continue;
+    }
+
+    const SphereMesh& mesh = Sphere::shared_mesh(l);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertex_buffer());
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.index_buffer());
+    bind_instances(first);
+
+    glDrawElementsInstanced(GL_TRIANGLES, mesh.index_count(),
+                            GL_UNSIGNED_INT, 0, n);
+
+    if (stats) {
+      stats->draws++;
+      stats->triangles += n * mesh.triangle_count();
+      stats->lod_counts[l] += n;
+    }
+  }
+
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glUseProgram(0);
+}
@@ -0,0 +1,79 @@
+#ifndef CS488_INSTANCING_HPP
+#define CS488_INSTANCING_HPP
+
+#include <vector>
+#include <GL/gl.h>
+#include "algebra.hpp"
+#include "affine.hpp"
+#include "framestats.hpp"
+
+class FlatScene;
+class Crowd;
+class Material;
+
+// Draws every sphere in a FlatScene or a Crowd with instanced calls, using only
+// GL 3.3 core profile features (so it also runs on Mesa's llvmpipe).
+// Each frame the world matrices, normal matrices and material colours
+// of all geometry nodes (or crowd parts) are packed into one instance buffer; spheres
+// that share a level of detail are then drawn by a single
+// glDrawElementsInstanced call.
+//
+// The lighting matches the fixed-function setup in the viewer: one
+// white directional light, the default global ambient term and a
+// non-local viewer.
+class InstancedRenderer {
+public:
+  InstancedRenderer();
+  ~InstancedRenderer();
+
+  // Compile the shaders and create the buffers. Needs a current GL
+  // context; returns false (and leaves the renderer unusable) if the
+  // context is older than 3.3 or the shaders fail to build.
+  bool init();
+  bool is_ready() const { return m_program != 0; }
+
+  // Draw the scene's visible geometry. view and projection are
+  // row-major; light_dir is the light direction in eye space. Restores
+  // the fixed-function pipeline before returning.
+  void draw(const FlatScene& scene, const Matrix4x4& view,
+            const Matrix4x4& projection, const Vector3D& light_dir,
+            FrameStats* stats = NULL);
+  // Draw a crowd. parts and lods hold every part's world transform and
+  // level of detail, in the order Crowd::part_transforms() gives them;
+  // parts at a negative level are skipped.
+  void draw(const Crowd& crowd, const AffineTransform* parts, const int* lods,
+            const Matrix4x4& view, const Matrix4x4& projection,
+            const Vector3D& light_dir, FrameStats* stats = NULL);
+
+private:
+  struct Instance {
+    GLfloat model[16];     // column-major world matrix
+    GLfloat normal[9];     // column-major normal matrix
+    GLfloat diffuse[4];    // rgb, shininess
+    GLfloat specular[3];
+  };
+
+  // The colours of material, or the defaults if it is NULL or not
+  // a PhongMaterial
+  static void pack_material(const Material* material, Instance& inst);
+  // An instance drawn with world transform w and material's colours
+  static void pack(const AffineTransform& w, const Instance& material, Instance& inst);
+  // Upload m_instances, grouped by level as m_level_start says, and
+  // draw each level with one call
+  void submit(const Matrix4x4& view, const Matrix4x4& projection,
+              const Vector3D& light_dir, FrameStats* stats);
+  void bind_instances(size_t first);
+
+  GLuint m_program;
+  GLuint m_vao;
+  GLuint m_instance_buffer;
+  GLint m_view_loc, m_projection_loc, m_light_loc;
+
+  // Scratch space reused from frame to frame
+  std::vector<Instance> m_instances;
+  std::vector<Instance> m_materials;
+  std::vector<size_t> m_level_start;
+  std::vector<size_t> m_level_next;
+};
+
+#endif
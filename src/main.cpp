@@ -1,25 +1,110 @@
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
 #include <gtkmm.h>
 #include <gtkglmm.h>
 #include "appwindow.hpp"
-#include "scene_lua.hpp"
+#include "scene_cache.hpp"
+#include "headless.hpp"
+
+static void usage(const char* name)
+{
+  std::cerr << "Usage: " << name << " [--profile file.{csv,json}]"
+            << " [--animation file] [--crowd N] [scene.lua]" << std::endl
+            << "       " << name << " --headless [--size WxH] [--frames N]"
+            << " [--output file.{ppm,png}] [--profile file.{csv,json}]"
+            << " [--animation file] [--crowd N] [scene.lua]" << std::endl;
+}
+
+// Read the options of either mode and the scene name. Returns false,
+// having printed the usage, on anything it does not know.
+static bool parse_arguments(int argc, char** argv, bool headless,
+                            HeadlessOptions& options, std::string& scene)
+{
+  for (int i = 1; i < argc; ++i) {
+    if (headless && strcmp(argv[i], "--headless") == 0) {
+      continue;
+    }
+    else if (headless && strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2 ||
+          options.width <= 0 || options.height <= 0) {
+        usage(argv[0]);
+        return false;
+      }
+    }
+    else if (headless && strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      options.frames = atoi(argv[++i]);
+    }
+    else if (headless && strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      options.output = argv[++i];
+    }
+    else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      // Frame timings, written when the program finishes
+      options.profile = argv[++i];
+    }
+    else if (strcmp(argv[i], "--animation") == 0 && i + 1 < argc) {
+      options.animation = argv[++i];
+    }
+    else if (strcmp(argv[i], "--crowd") == 0 && i + 1 < argc) {
+      // Copies of the puppet to show behind it
+      int count = atoi(argv[++i]);
+      if (count < 0) {
+        usage(argv[0]);
+        return false;
+      }
+      options.crowd = count;
+    }
+    else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return false;
+    }
+    else {
+      scene = argv[i];
+    }
+  }
+  return true;
+}
 
 int main(int argc, char** argv)
 {
+  // Headless rendering must be decided before GTK goes looking for a
+  // display.
+  bool headless = false;
+  for (int i = 1; i < argc; ++i) {
+    headless |= strcmp(argv[i], "--headless") == 0;
+  }
+
+  HeadlessOptions options;
+  std::string scene = "puppet.lua";
+  if (headless) {
+    if (!parse_arguments(argc, argv, true, options, scene)) {
+      return 1;
+    }
+    SceneNode* root = load_scene(scene);
+    if (!root) {
+      std::cerr << "Could not open " << scene << std::endl;
+      return 1;
+    }
+    return render_headless(root, options);
+  }
+
   // Construct our main loop
   Gtk::Main kit(argc, argv);
 
   // Initialize OpenGL
   Gtk::GL::init(argc, argv);
 
-  std::string filename = "puppet.lua";
-  if (argc >= 2) {
-    filename = argv[1];
+  // What GTK has left is ours
+  if (!parse_arguments(argc, argv, false, options, scene)) {
+    return 1;
   }
-  // This is how you might import a scene.
-  SceneNode* root = import_lua(filename);
+
+  // This is how you might import a scene. The script only runs when
+  // its compiled cache is missing or out of date.
+  SceneNode* root = load_scene(scene);
   if (!root) {
-    std::cerr << "Could not open " << filename << std::endl;
+    std::cerr << "Could not open " << scene << std::endl;
     return 1;
   }
   
@@ -27,7 +112,21 @@ int main(int argc, char** argv)
   AppWindow window;
 
   window.set_scene_node(root);
+  window.set_scene_file(scene);
+  window.set_profiling(!options.profile.empty());
+  if (options.crowd) {
+    window.set_crowd(options.crowd);
+  }
+  if (!options.animation.empty() && !window.load_animation(options.animation)) {
+    std::cerr << "Could not read " << options.animation << std::endl;
+    return 1;
+  }
   // And run the application!
   Gtk::Main::run(window);
-}
 
+  if (!options.profile.empty() && !window.save_profile(options.profile)) {
+    std::cerr << "Could not write " << options.profile << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -4,6 +4,11 @@ Material::~Material()
 {
 }
 
+bool Material::same_gl_state(const Material& other) const
+{
+  return this == &other;
+}
+
 PhongMaterial::PhongMaterial(const Colour& kd, const Colour& ks, double shininess)
   : m_kd(kd), m_ks(ks), m_shininess(shininess)
 {
@@ -25,8 +30,59 @@ void PhongMaterial::apply_gl() const
   // Perform OpenGL calls necessary to set up this material.
 }
 
+void apply_default_material_gl()
+{
+  GLfloat materialColor[] = {1.0f, 1.0f, 1.0f, 1.0};
+  GLfloat materialSpecular[] = {0.1f, 0.1f, 0.1f, 1.0};
+
+  glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, materialColor);
+  glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, materialSpecular);
+  glMateriali(GL_FRONT_AND_BACK, GL_SHININESS, 10);
+}
+
 
 
 
 
 
+
+bool PhongMaterial::same_gl_state(const Material& other) const
+{
+  const PhongMaterial* phong = dynamic_cast<const PhongMaterial*>(&other);
+  return phong &&
+    m_kd.R() == phong->m_kd.R() && m_kd.G() == phong->m_kd.G() && m_kd.B() == phong->m_kd.B() &&
+    m_ks.R() == phong->m_ks.R() && m_ks.G() == phong->m_ks.G() && m_ks.B() == phong->m_ks.B() &&
+    // apply_gl() passes the shininess as an integer
+    (int)m_shininess == (int)phong->m_shininess;
+}
+
+int material_slot(std::vector<const Material*>& materials, const Material* material)
+{
+  if (!material) {
+    return -1;
+  }
+  for (size_t i = 0; i < materials.size(); ++i) {
+    if (materials[i] == material || materials[i]->same_gl_state(*material)) {
+      return i;
+    }
+  }
+  materials.push_back(material);
+  return materials.size() - 1;
+}
+
+void order_by_material(const std::vector<int>& slots, size_t material_count,
+                       std::vector<int>& order)
+{
+  // Counting sort, with slot -1 counted first
+  std::vector<int> start(material_count + 2, 0);
+  for (size_t i = 0; i < slots.size(); ++i) {
+    start[slots[i] + 2]++;
+  }
+  for (size_t m = 1; m < start.size(); ++m) {
+    start[m] += start[m - 1];
+  }
+  order.resize(slots.size());
+  for (size_t i = 0; i < slots.size(); ++i) {
+    order[start[slots[i] + 1]++] = i;
+  }
+}
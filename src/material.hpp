@@ -2,6 +2,7 @@
 #define CS488_MATERIAL_HPP
 
 #include "algebra.hpp"
+#include <vector>
 #include <gtkmm.h>
 #include <gtkglmm.h>
 
@@ -10,6 +11,10 @@ public:
   virtual ~Material();
   virtual void apply_gl() const = 0;
 
+  // True if applying other would leave GL in the same state as
+  // applying this material
+  virtual bool same_gl_state(const Material& other) const;
+
 protected:
   Material()
   {
@@ -22,6 +27,11 @@ public:
   virtual ~PhongMaterial();
 
   virtual void apply_gl() const;
+  virtual bool same_gl_state(const Material& other) const;
+
+  const Colour& get_kd() const { return m_kd; }
+  const Colour& get_ks() const { return m_ks; }
+  double get_shininess() const { return m_shininess; }
 
 private:
   Colour m_kd;
@@ -30,5 +40,21 @@ private:
   double m_shininess;
 };
 
+// Set the material drawn by geometry that has none of its own, the
+// same one InstancedRenderer packs for it.
+void apply_default_material_gl();
+
+// The index in materials of material, or of one that sets the same GL
+// state, adding it if there is none; -1 for no material. Nodes share
+// materials, and scripts often make the same one twice, so the draws
+// of both share a slot.
+int material_slot(std::vector<const Material*>& materials, const Material* material);
+
+// Fill order with the indices of slots, the material slot of each
+// draw, sorted by slot: those without a material first, and each
+// slot's in the order given, so a pass over them sets every material
+// once. material_count is the number of slots.
+void order_by_material(const std::vector<int>& slots, size_t material_count,
+                       std::vector<int>& order);
 
 #endif
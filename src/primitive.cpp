@@ -1,19 +1,152 @@
 #include "primitive.hpp"
 
+SphereMesh::SphereMesh(int slices, int stacks)
+  : m_slices(slices),
+    m_stacks(stacks),
+    m_vbo(0),
+    m_ibo(0)
+{
+  // One ring of (slices + 1) vertices per stack boundary; the seam
+  // vertex is duplicated so every quad indexes a distinct column.
+  for (int i = 0; i <= stacks; ++i) {
+    double phi = M_PI * i / stacks;
+    for (int j = 0; j <= slices; ++j) {
+      double theta = 2 * M_PI * j / slices;
+      m_vertices.push_back(sin(phi) * cos(theta));
+      m_vertices.push_back(sin(phi) * sin(theta));
+      m_vertices.push_back(cos(phi));
+    }
+  }
+
+  for (int i = 0; i < stacks; ++i) {
+    for (int j = 0; j < slices; ++j) {
+      GLuint a = i * (slices + 1) + j;
+      GLuint b = a + slices + 1;
+
+      // Counter-clockwise when seen from outside the sphere
+      if (i != 0) {
+        m_indices.push_back(a);
+        m_indices.push_back(b);
+        m_indices.push_back(a + 1);
+      }
+      if (i != stacks - 1) {
+        m_indices.push_back(a + 1);
+        m_indices.push_back(b);
+        m_indices.push_back(b + 1);
+      }
+    }
+  }
+}
+
+SphereMesh::~SphereMesh()
+{
+  // The buffers belong to whichever GL context was current at
+  // upload(); by the time static meshes are destroyed it is gone.
+}
+
+void SphereMesh::upload()
+{
+  if (m_vbo) {
+    return;
+  }
+
+  glGenBuffers(1, &m_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+  glBufferData(GL_ARRAY_BUFFER, m_vertices.size() * sizeof(GLfloat),
+               &m_vertices[0], GL_STATIC_DRAW);
+
+  glGenBuffers(1, &m_ibo);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(GLuint),
+               &m_indices[0], GL_STATIC_DRAW);
+
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void SphereMesh::draw() const
+{
+  if (!m_vbo) {
+    const_cast<SphereMesh*>(this)->upload();
+  }
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_NORMAL_ARRAY);
+  glVertexPointer(3, GL_FLOAT, 0, 0);
+  glNormalPointer(GL_FLOAT, 0, 0);
+
+  glDrawElements(GL_TRIANGLES, m_indices.size(), GL_UNSIGNED_INT, 0);
+
+  glDisableClientState(GL_NORMAL_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 Primitive::~Primitive()
 {
 }
 
+int Primitive::lod_for_radius(double pixels) const
+{
+  int levels = lod_levels();
+  if (pixels < 0) {
+    return levels - 1;
+  }
+  int level = 0;
+  while (level < levels - 1 && pixels > lod_max_radius(level)) {
+    ++level;
+  }
+  return level;
+}
+
 Sphere::~Sphere()
 {
-  gluDeleteQuadric(m_Sphere);
 }
 
-Sphere::Sphere() {
-  m_Sphere = gluNewQuadric();
+Sphere::Sphere()
+{
+}
+
+// Tessellation and intended on-screen radius of each level. The
+// finest matches the old gluSphere(150, 150) call.
+static const int sphere_lod_slices[Sphere::LOD_LEVELS] = { 8, 16, 32, 64, 150 };
+static const double sphere_lod_radius[Sphere::LOD_LEVELS] = { 6, 20, 60, 160, 1e30 };
+
+SphereMesh& Sphere::shared_mesh(int level)
+{
+  static SphereMesh* meshes[LOD_LEVELS] = { 0 };
+  if (!meshes[level]) {
+    meshes[level] = new SphereMesh(sphere_lod_slices[level], sphere_lod_slices[level]);
+  }
+  return *meshes[level];
+}
+
+void Sphere::upload_meshes()
+{
+  for (int i = 0; i < LOD_LEVELS; ++i) {
+    shared_mesh(i).upload();
+  }
+}
+
+double Sphere::lod_max_radius(int level) const
+{
+  return sphere_lod_radius[level];
+}
+
+size_t Sphere::triangle_count(int level) const
+{
+  return shared_mesh(level).triangle_count();
 }
 
 void Sphere::walk_gl(bool picking) const
 {
-  gluSphere(m_Sphere,1,150,150); 
+  shared_mesh().draw();
+}
+
+void Sphere::walk_gl_lod(int level) const
+{
+  shared_mesh(level).draw();
 }
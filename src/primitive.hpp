@@ -2,13 +2,56 @@
 #define CS488_PRIMITIVE_HPP
 
 #include "algebra.hpp"
+#include <vector>
 #include <GL/gl.h>
 #include <GL/glu.h>
 
+// A triangulated unit sphere, centred at the origin with its poles on
+// the z axis (the same layout gluSphere uses). The mesh is kept in a
+// vertex buffer and an index buffer once a GL context is available,
+// and drawn with a single glDrawElements call. For a unit sphere each
+// vertex position is also its normal, so one array serves both.
+class SphereMesh {
+public:
+  SphereMesh(int slices, int stacks);
+  ~SphereMesh();
+
+  // Create the GL buffers. Needs a current GL context; draw() calls
+  // it on first use if nobody has done so yet.
+  void upload();
+  void draw() const;
+
+  size_t triangle_count() const { return m_indices.size() / 3; }
+
+  // Buffer objects, valid after upload(). Indices are GL_UNSIGNED_INT
+  // and each vertex is three floats.
+  GLuint vertex_buffer() const { return m_vbo; }
+  GLuint index_buffer() const { return m_ibo; }
+  GLsizei index_count() const { return m_indices.size(); }
+
+private:
+  int m_slices, m_stacks;
+  std::vector<GLfloat> m_vertices;
+  std::vector<GLuint> m_indices;
+  GLuint m_vbo, m_ibo;
+};
+
 class Primitive {
 public:
   virtual ~Primitive();
   virtual void walk_gl(bool picking) const = 0;
+
+  // Levels of detail, coarsest first. The finest level is what
+  // walk_gl() draws; primitives without a chain have just that one.
+  virtual int lod_levels() const { return 1; }
+  // Largest on-screen radius, in pixels, that a level is meant for
+  virtual double lod_max_radius(int /*level*/) const { return 1e30; }
+  virtual size_t triangle_count(int /*level*/) const { return 0; }
+  virtual void walk_gl_lod(int /*level*/) const { walk_gl(false); }
+
+  // The coarsest level meant for an on-screen radius of pixels, or
+  // the finest if pixels is negative (too close to tell)
+  int lod_for_radius(double pixels) const;
 };
 
 class Sphere : public Primitive {
@@ -16,8 +59,19 @@ public:
   Sphere();
   virtual ~Sphere();
   virtual void walk_gl(bool picking) const;
-private:
-  GLUquadricObj* m_Sphere;
+
+  enum { LOD_LEVELS = 5 };
+
+  virtual int lod_levels() const { return LOD_LEVELS; }
+  virtual double lod_max_radius(int level) const;
+  virtual size_t triangle_count(int level) const;
+  virtual void walk_gl_lod(int level) const;
+
+  // The unit sphere meshes shared by every Sphere primitive, from
+  // coarsest to finest.
+  static SphereMesh& shared_mesh(int level = LOD_LEVELS - 1);
+  // Upload every level; needs a current GL context.
+  static void upload_meshes();
 };
 
 #endif
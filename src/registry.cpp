@@ -0,0 +1,170 @@
+#include "registry.hpp"
+#include "scene.hpp"
+
+SceneRegistry::SceneRegistry()
+  : m_sphere(NULL)
+{
+}
+
+SceneRegistry::~SceneRegistry()
+{
+  for (size_t id = 0; id < m_nodes.size(); ++id) {
+    SceneNode* node = m_nodes[id];
+    if (!node) {
+      continue;
+    }
+    // Detach first so the node does not try to remove itself
+    node->m_registry = NULL;
+    if (m_heap[id]) {
+      delete node;
+    }
+    else {
+      node->~SceneNode();
+    }
+  }
+
+  for (std::vector<Material*>::iterator it = m_materials.begin(); it != m_materials.end(); ++it) {
+    (*it)->~Material();
+  }
+  if (m_sphere) {
+    m_sphere->~Sphere();
+  }
+  // m_arena then frees all of their memory at once
+}
+
+SceneNode* SceneRegistry::create_node(const std::string& name)
+{
+  SceneNode* node = new (m_arena) SceneNode(name);
+  m_heap[add(node)] = 0;
+  return node;
+}
+
+JointNode* SceneRegistry::create_joint(const std::string& name)
+{
+  JointNode* node = new (m_arena) JointNode(name);
+  m_heap[add(node)] = 0;
+  return node;
+}
+
+GeometryNode* SceneRegistry::create_geometry(const std::string& name,
+                                             Primitive* primitive)
+{
+  GeometryNode* node = new (m_arena) GeometryNode(name, primitive);
+  m_heap[add(node)] = 0;
+  return node;
+}
+
+PhongMaterial* SceneRegistry::create_material(const Colour& kd, const Colour& ks,
+                                              double shininess)
+{
+  PhongMaterial* material = new (m_arena) PhongMaterial(kd, ks, shininess);
+  m_materials.push_back(material);
+  return material;
+}
+
+Sphere* SceneRegistry::sphere()
+{
+  if (!m_sphere) {
+    m_sphere = new (m_arena) Sphere();
+  }
+  return m_sphere;
+}
+
+int SceneRegistry::add(SceneNode* node)
+{
+  int id;
+  if (m_free.empty()) {
+    id = m_nodes.size();
+    m_nodes.push_back(node);
+    m_heap.push_back(1);
+    m_generation.push_back(0);
+  }
+  else {
+    id = m_free.back();
+    m_free.pop_back();
+    m_nodes[id] = node;
+    m_heap[id] = 1;
+  }
+
+  node->m_id = id;
+  node->m_registry = this;
+  // Keeps the first node of a name if there is one already
+  m_names.insert(NameMap::value_type(node->m_name, node));
+  return id;
+}
+
+void SceneRegistry::remove(SceneNode* node)
+{
+  int id = node->m_id;
+  if (this->node(id) != node) {
+    return;
+  }
+
+  m_nodes[id] = NULL;
+  ++m_generation[id];
+  m_free.push_back(id);
+  node->m_id = -1;
+  node->m_registry = NULL;
+
+  NameMap::iterator it = m_names.find(node->m_name);
+  if (it != m_names.end() && it->second == node) {
+    m_names.erase(it);
+    // Hand the name to another node carrying it, if any. Names are
+    // rarely shared, so the scan is rare too.
+    for (std::vector<SceneNode*>::const_iterator n = m_nodes.begin(); n != m_nodes.end(); ++n) {
+      if (*n && (*n)->m_name == node->m_name) {
+        m_names.insert(NameMap::value_type(node->m_name, *n));
+        break;
+      }
+    }
+  }
+}
+
+void SceneRegistry::destroy(SceneNode* node)
+{
+  int id = node->m_id;
+  if (this->node(id) != node) {
+    return;
+  }
+
+  bool heap = m_heap[id];
+  remove(node);
+  if (heap) {
+    delete node;
+  }
+  else {
+    node->~SceneNode();
+  }
+}
+
+JointNode* SceneRegistry::joint(int id) const
+{
+  SceneNode* n = node(id);
+  return n && n->is_joint() ? static_cast<JointNode*>(n) : NULL;
+}
+
+SceneRegistry::Handle SceneRegistry::handle(const SceneNode* node) const
+{
+  Handle h;
+  h.id = node->m_id;
+  h.generation = m_generation[h.id];
+  return h;
+}
+
+JointNode* SceneRegistry::joint(const Handle& handle) const
+{
+  SceneNode* n = node(handle);
+  return n && n->is_joint() ? static_cast<JointNode*>(n) : NULL;
+}
+
+SceneNode* SceneRegistry::find(const std::string& name) const
+{
+  NameMap::const_iterator it = m_names.find(name);
+  return it != m_names.end() ? it->second : NULL;
+}
+
+JointNode* SceneRegistry::find_joint(const std::string& name) const
+{
+  SceneNode* n = find(name);
+  return n && n->is_joint() ? static_cast<JointNode*>(n) : NULL;
+}
@@ -0,0 +1,120 @@
+#ifndef CS488_REGISTRY_HPP
+#define CS488_REGISTRY_HPP
+
+#include <string>
+#include <vector>
+#include <tr1/unordered_map>
+#include "algebra.hpp"
+#include "arena.hpp"
+
+class SceneNode;
+class JointNode;
+class GeometryNode;
+class Material;
+class PhongMaterial;
+class Primitive;
+class Sphere;
+
+// The nodes of one loaded scene, by id and by name.
+//
+// Ids are dense indices handed out by add(): a freed id is given to
+// the next node added, so they stay small enough to index arrays
+// with. Anything that keeps an id past the next remove() should keep
+// a Handle instead, which also holds the id's generation and so
+// never resolves to a later node given the same id. Looking a node
+// up by id or by name takes constant time, so picking, undo and
+// anything driving poses from outside resolve nodes here instead of
+// walking the tree.
+//
+// The registry owns the scene: its nodes, materials and primitives.
+// The create_*() functions build them in the registry's arena, so a
+// scene loaded in one go is laid out in the order it was built, and
+// deleting the registry frees all of it at once.
+class SceneRegistry {
+public:
+  // A node's id and the generation of the id when it was given out
+  struct Handle {
+    int id;
+    unsigned int generation;
+  };
+
+  SceneRegistry();
+  ~SceneRegistry();
+
+  // Build a node in the arena and add() it. Such nodes are freed with
+  // destroy(), never delete.
+  SceneNode* create_node(const std::string& name);
+  JointNode* create_joint(const std::string& name);
+  GeometryNode* create_geometry(const std::string& name, Primitive* primitive);
+
+  // Materials, and the scene's single Sphere, which holds no state of
+  // its own; they live until the registry goes.
+  PhongMaterial* create_material(const Colour& kd, const Colour& ks,
+                                 double shininess);
+  Sphere* sphere();
+
+  // Give node an id and index it by name. Returns the id. A node made
+  // with plain new becomes the registry's to delete; such a node
+  // deleted on its own removes itself.
+  int add(SceneNode* node);
+  // Forget node and free its id
+  void remove(SceneNode* node);
+  // Remove and destroy a node, however it was made. Detach it from its
+  // parent first; its children are left alone.
+  void destroy(SceneNode* node);
+
+  // The node with this id, or NULL if the id is not in use
+  SceneNode* node(int id) const
+  {
+    return id >= 0 && (size_t)id < m_nodes.size() ? m_nodes[id] : NULL;
+  }
+  // The same, but NULL unless the node is a JointNode
+  JointNode* joint(int id) const;
+
+  // How often id has been freed
+  unsigned int generation(int id) const { return m_generation[id]; }
+  // A handle on node, which must be registered here
+  Handle handle(const SceneNode* node) const;
+  // The node handle was taken on, or NULL if it has been removed
+  SceneNode* node(const Handle& handle) const
+  {
+    SceneNode* n = node(handle.id);
+    return n && m_generation[handle.id] == handle.generation ? n : NULL;
+  }
+  JointNode* joint(const Handle& handle) const;
+
+  // A node with this name, or NULL. Where several share the name it
+  // is one of them, the same one until it is removed.
+  SceneNode* find(const std::string& name) const;
+  JointNode* find_joint(const std::string& name) const;
+
+  // One more than the largest id ever handed out; arrays indexed by
+  // id need this many entries
+  size_t size() const { return m_nodes.size(); }
+  // Nodes currently registered
+  size_t count() const { return m_nodes.size() - m_free.size(); }
+
+  const SceneArena& arena() const { return m_arena; }
+
+private:
+  SceneRegistry(const SceneRegistry&);
+  SceneRegistry& operator=(const SceneRegistry&);
+
+  typedef std::tr1::unordered_map<std::string, SceneNode*> NameMap;
+
+  SceneArena m_arena;
+
+  // Indexed by id; NULL for free ids
+  std::vector<SceneNode*> m_nodes;
+  // Whether each node came from new rather than the arena
+  std::vector<unsigned char> m_heap;
+  // Bumped each time the id is freed
+  std::vector<unsigned int> m_generation;
+  std::vector<int> m_free;
+  NameMap m_names;
+
+  std::vector<Material*> m_materials;
+  Sphere* m_sphere;
+};
+
+#endif
@@ -0,0 +1,303 @@
+#include "renderer.hpp"
+#include "frameprofile.hpp"
+#include <iostream>
+#include <algorithm>
+#include <math.h>
+#include <GL/gl.h>
+#include <GL/glu.h>
+
+// Poses the crowd's visible instances, each thread in its own
+// scratch space, and chooses their parts' levels of detail. Culled
+// instances are left unposed at level -1. No hysteresis: the crowd
+// keeps no state between frames.
+class CrowdFrameJob : public TaskJob {
+public:
+  CrowdFrameJob(const Crowd& crowd, const unsigned char* visible, const Matrix4x4& view,
+                double pixels_per_unit, AffineTransform* parts, int* lods,
+                AffineTransform* scratch)
+    : m_crowd(crowd), m_visible(visible), m_view(view),
+      m_pixels_per_unit(pixels_per_unit), m_parts(parts), m_lods(lods),
+      m_scratch(scratch)
+  {
+  }
+
+  virtual void run(size_t begin, size_t end, int worker)
+  {
+    const SkeletonTemplate& skeleton = m_crowd.skeleton();
+    size_t per_instance = skeleton.part_count();
+    for (size_t i = begin; i < end; ++i) {
+      int* lods = m_lods + i * per_instance;
+      if (!m_visible[i]) {
+        std::fill(lods, lods + per_instance, -1);
+        continue;
+      }
+
+      AffineTransform* parts = m_parts + i * per_instance;
+      m_crowd.part_transforms(i, i + 1, parts, m_scratch + worker * skeleton.node_count());
+      for (size_t p = 0; p < per_instance; ++p) {
+        const Primitive* primitive = skeleton.part_primitive(p);
+        lods[p] = primitive->lod_levels() <= 1 ? 0 :
+          primitive->lod_for_radius(FlatScene::projected_radius(m_view, parts[p],
+                                                                m_pixels_per_unit));
+      }
+    }
+  }
+
+private:
+  const Crowd& m_crowd;
+  const unsigned char* m_visible;
+  const Matrix4x4& m_view;
+  double m_pixels_per_unit;
+  AffineTransform* m_parts;
+  int* m_lods;
+  AffineTransform* m_scratch;
+};
+
+SceneRenderer::SceneRenderer()
+  : z_buffer(false),
+    front_face(false),
+    back_face(false),
+    instancing(true),
+    culling(true),
+    timing(false),
+    m_root(NULL),
+    m_tasks(&TaskPool::shared()),
+    m_crowd(NULL),
+    m_crowd_shown(0),
+    m_width(1),
+    m_height(1)
+{
+}
+
+void SceneRenderer::set_scene_node(SceneNode* root)
+{
+  m_root = root;
+  m_flat.compile(root);
+}
+
+void SceneRenderer::init_gl()
+{
+  glShadeModel(GL_SMOOTH);
+  glClearColor( 0, 0, 0, 0.0 );
+  glEnable(GL_DEPTH_TEST);
+
+  // Build the shared sphere buffers while we have a context
+  Sphere::upload_meshes();
+
+  // Without GL 3.3 we stay on the fixed-function path
+  if (!m_instanced.init()) {
+    std::cerr << "Instanced rendering unavailable, using fixed function" << std::endl;
+  }
+}
+
+void SceneRenderer::sync()
+{
+  if (m_flat.is_stale()) {
+    m_flat.compile(m_root);
+  }
+  m_flat.update_transforms(m_tasks);
+}
+
+void SceneRenderer::render(int width, int height)
+{
+  m_width = width;
+  m_height = height;
+
+  // Set up for perspective drawing 
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  glViewport(0, 0, width, height);
+  gluPerspective(40.0, (GLfloat)width/(GLfloat)height, 0.1, 1000.0);
+
+  // change to model view for drawing
+  glMatrixMode(GL_MODELVIEW);
+
+  if (z_buffer) {
+    glEnable(GL_DEPTH_TEST);
+  }
+
+  if (back_face || front_face) {
+    glEnable(GL_CULL_FACE);
+    if (back_face && front_face)
+      glCullFace(GL_FRONT_AND_BACK);
+    else if (back_face) 
+      glCullFace(GL_BACK);
+    else
+      glCullFace(GL_FRONT);
+  }
+
+  // Clear framebuffer
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  // Set up lighting
+  glEnable(GL_NORMALIZE);
+  glEnable(GL_LIGHTING);
+  glEnable(GL_LIGHT0);
+
+  GLfloat ambientLight[] = {0.0, 0.0, 0.0};
+  GLfloat diffuseLight[] =  {1.0, 1.0, 1.0}; 
+  GLfloat specularLight[] = {1.0, 1.0, 1.0}; 
+  GLfloat position[] = { 0.0f, 0.0f, 10.0f, 0.0f };
+  
+  glLightfv(GL_LIGHT0, GL_AMBIENT, ambientLight);
+  glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuseLight);
+  glLightfv(GL_LIGHT0, GL_SPECULAR, specularLight);
+  glLightfv(GL_LIGHT0, GL_POSITION, position);
+
+  // Draw stuff
+  double start = timing ? FrameProfiler::now_us() : 0;
+  sync();
+  double synced = timing ? FrameProfiler::now_us() : 0;
+
+  m_stats.reset();
+  m_stats.update_us = synced - start;
+  GLdouble modelview[16];
+  glGetDoublev(GL_MODELVIEW_MATRIX, modelview);
+  GLdouble projection[16];
+  glGetDoublev(GL_PROJECTION_MATRIX, projection);
+  m_view = Matrix4x4(modelview).transpose();
+  m_projection = Matrix4x4(projection).transpose();
+
+  // Culled parts are neither given a level nor drawn
+  Frustum frustum(m_projection * m_view);
+  const Frustum* view_volume = culling ? &frustum : NULL;
+  m_flat.cull(view_volume, &m_stats);
+
+  double pixels_per_unit = height / (2 * tan(20.0 * M_PI / 180));
+  m_flat.select_lod(m_view, pixels_per_unit, &m_stats);
+  if (m_crowd) {
+    update_crowd(view_volume, pixels_per_unit);
+  }
+
+  if (instancing && m_instanced.is_ready()) {
+    // The light was positioned under the current modelview
+    Vector3D light = m_view * Vector3D(position[0], position[1], position[2]);
+    light.normalize();
+
+    m_instanced.draw(m_flat, m_view, m_projection, light, &m_stats);
+    if (m_crowd) {
+      m_instanced.draw(*m_crowd, &m_crowd_parts[0], &m_crowd_lod[0],
+                       m_view, m_projection, light, &m_stats);
+    }
+  }
+  else {
+    m_flat.walk_gl(false, &m_stats);
+    if (m_crowd) {
+      draw_crowd_gl();
+    }
+  }
+
+  // Only the time to issue the draws; the GPU may still be busy
+  if (timing) {
+    m_stats.traverse_us = FrameProfiler::now_us() - synced;
+  }
+}
+
+void SceneRenderer::update_crowd(const Frustum* frustum, double pixels_per_unit)
+{
+  const SkeletonTemplate& skeleton = m_crowd->skeleton();
+  size_t instances = m_crowd->size(), parts = skeleton.part_count();
+  m_crowd_parts.resize(instances * parts);
+  m_crowd_lod.resize(instances * parts);
+  m_crowd_visible.resize(instances);
+  m_crowd_shown = 0;
+  if (instances * parts == 0) {
+    return;
+  }
+
+  // Whole instances are culled, before the work of posing them
+  for (size_t i = 0; i < instances; ++i) {
+    m_crowd_visible[i] = !frustum || !frustum->outside(m_crowd->bounds(i));
+    m_crowd_shown += m_crowd_visible[i];
+  }
+  m_stats.visible += m_crowd_shown * parts;
+  m_stats.culled += (instances - m_crowd_shown) * parts;
+
+  int threads = m_tasks ? m_tasks->thread_count() : 1;
+  m_crowd_nodes.resize(skeleton.node_count() * threads);
+  CrowdFrameJob job(*m_crowd, &m_crowd_visible[0], m_view, pixels_per_unit,
+                    &m_crowd_parts[0], &m_crowd_lod[0], &m_crowd_nodes[0]);
+  if (m_tasks) {
+    m_tasks->run(job, instances, m_crowd->grain());
+  }
+  else {
+    job.run(0, instances, 0);
+  }
+}
+
+void SceneRenderer::draw_crowd_gl()
+{
+  const SkeletonTemplate& skeleton = m_crowd->skeleton();
+  size_t parts = skeleton.part_count();
+  const std::vector<int>& order = skeleton.draw_order();
+
+  if (m_crowd_shown == 0) {
+    return;
+  }
+
+  // The scene's materials are not the skeleton's slots, so the state
+  // it left is not trusted: start from no slot at all. Parts with no
+  // material get the default, as they do in a FlatScene.
+  int current = -2;
+  for (size_t k = 0; k < order.size(); ++k) {
+    int p = order[k];
+    int material = skeleton.part_material(p);
+    if (material != current) {
+      if (material == -1) {
+        apply_default_material_gl();
+      }
+      else {
+        skeleton.material(material)->apply_gl();
+      }
+      current = material;
+      m_stats.material_changes++;
+    }
+    else {
+      m_stats.material_changes_skipped++;
+    }
+    m_stats.material_changes_skipped += m_crowd_shown - 1;
+
+    const Primitive* primitive = skeleton.part_primitive(p);
+    for (size_t i = 0; i < m_crowd->size(); ++i) {
+      size_t slot = i * parts + p;
+      int level = m_crowd_lod[slot];
+      if (level < 0) {
+        continue;
+      }
+      double gl[16];
+      m_crowd_parts[slot].to_gl(gl);
+
+      glPushMatrix();
+      glMultMatrixd(gl);
+      primitive->walk_gl_lod(level);
+      glPopMatrix();
+
+      m_stats.draws++;
+      m_stats.triangles += primitive->triangle_count(level);
+      m_stats.lod_counts[level]++;
+    }
+  }
+}
+
+void SceneRenderer::pick_ray(double x, double y, Point3D& origin, Vector3D& dir) const
+{
+  // Map the near and far plane points under the cursor back through
+  // the projection and camera.
+  Matrix4x4 inv = (m_projection * m_view).invert();
+  double ndc_x = 2.0 * x / m_width - 1.0;
+  double ndc_y = 1.0 - 2.0 * y / m_height;
+
+  Point3D ends[2];
+  for (int k = 0; k < 2; ++k) {
+    double ndc[4] = { ndc_x, ndc_y, k ? 1.0 : -1.0, 1.0 };
+    double p[4];
+    for (int r = 0; r < 4; ++r) {
+      p[r] = inv[r][0] * ndc[0] + inv[r][1] * ndc[1] +
+             inv[r][2] * ndc[2] + inv[r][3] * ndc[3];
+    }
+    ends[k] = Point3D(p[0] / p[3], p[1] / p[3], p[2] / p[3]);
+  }
+
+  origin = ends[0];
+  dir = ends[1] - ends[0];
+}
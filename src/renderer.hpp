@@ -0,0 +1,87 @@
+#ifndef CS488_RENDERER_HPP
+#define CS488_RENDERER_HPP
+
+#include "scene.hpp"
+#include "flatscene.hpp"
+#include "instancing.hpp"
+#include "framestats.hpp"
+#include "crowd.hpp"
+#include "taskpool.hpp"
+
+// Draws a scene into whichever GL context is current. The interactive
+// Viewer and the headless renderer both go through this class, so they
+// share the traversal, level-of-detail, lighting and material code.
+class SceneRenderer {
+public:
+  SceneRenderer();
+
+  void set_scene_node(SceneNode* root);
+  SceneNode* get_scene_node() const { return m_root; }
+
+  // Draw crowd along with the scene, or nothing more if it is NULL.
+  // The crowd must stay alive while it is set.
+  void set_crowd(const Crowd* crowd) { m_crowd = crowd; }
+  const Crowd* get_crowd() const { return m_crowd; }
+
+  // The threads that update world transforms and pose the crowd; the
+  // shared pool unless set. NULL does it all on the calling thread.
+  void set_task_pool(TaskPool* pool) { m_tasks = pool; }
+  TaskPool* get_task_pool() const { return m_tasks; }
+
+  // One-time GL setup. Needs a current context.
+  void init_gl();
+
+  // Bring the flattened scene up to date with the node tree.
+  void sync();
+
+  // Draw one width x height frame, using the current GL modelview
+  // matrix as the camera.
+  void render(int width, int height);
+
+  // The ray through window point (x, y) of the last frame drawn, in
+  // the scene root's frame.
+  void pick_ray(double x, double y, Point3D& origin, Vector3D& dir) const;
+
+  FlatScene& scene() { return m_flat; }
+  const FrameStats& stats() const { return m_stats; }
+
+  // Drawing options
+  bool z_buffer, front_face, back_face;
+  // Draw through the instanced GL 3.3 path when it is available
+  bool instancing;
+  // Skip parts, subtrees and crowd instances outside the view frustum
+  bool culling;
+  // Time the transform update and the traversal into stats(). Off
+  // unless someone is profiling, as it reads the clock each frame.
+  bool timing;
+
+private:
+  // Cull the crowd's instances against frustum, unless it is NULL,
+  // then evaluate the parts of the rest and choose their levels
+  void update_crowd(const Frustum* frustum, double pixels_per_unit);
+  // The fixed-function crowd draw: part by part in material order,
+  // every instance of a part in turn
+  void draw_crowd_gl();
+
+  SceneNode* m_root;
+  FlatScene m_flat;
+  InstancedRenderer m_instanced;
+  FrameStats m_stats;
+
+  TaskPool* m_tasks;
+
+  const Crowd* m_crowd;
+  // Every part of every instance, and its level; scratch, as are the
+  // nodes of the instances being posed, per thread
+  std::vector<AffineTransform> m_crowd_parts, m_crowd_nodes;
+  std::vector<int> m_crowd_lod;
+  // Instances inside the frustum, and how many
+  std::vector<unsigned char> m_crowd_visible;
+  size_t m_crowd_shown;
+
+  // Camera of the last frame drawn
+  Matrix4x4 m_view, m_projection;
+  int m_width, m_height;
+};
+
+#endif
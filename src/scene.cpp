@@ -1,93 +1,119 @@
 #include "scene.hpp"
 #include <iostream>
 
-int id = 0;
-
 SceneNode::SceneNode(const std::string& name)
   : m_name(name),
-    m_id(id++),
-    m_current_id(0),
-    picked(true),
-    moved(false),
-    selected(false)
+    m_id(-1),
+    selected(false),
+    m_dirty(true),
+    m_inv_dirty(true),
+    m_parent(NULL),
+    m_flat(NULL),
+    m_flat_index(-1),
+    m_registry(NULL)
 {
 }
 
 SceneNode::~SceneNode()
 {
+  if (m_registry) {
+    m_registry->remove(this);
+  }
 }
 
 void SceneNode::walk_gl(bool picking) 
 {
-  glMultMatrixd(m_trans.transpose().begin());
-
+  // Geometry nodes load their own cached world matrix, so interior
+  // nodes have nothing to push or undo.
   for (ChildList::const_iterator it = m_children.begin(); it != m_children.end(); it++) {
     (*it)->walk_gl(picking);    
   }
+}
 
-  glMultMatrixd(m_trans.invert().transpose().begin());
+const AffineTransform& SceneNode::get_world_transform()
+{
+  if (m_dirty) {
+    if (m_parent) {
+      m_world = m_parent->get_world_transform() * m_trans;
+    }
+    else {
+      m_world = m_trans;
+    }
+    m_world.to_gl(m_world_gl);
+    m_dirty = false;
+  }
+  return m_world;
 }
 
-void SceneNode::rotate(char axis, double angle)
+const double* SceneNode::get_world_gl()
 {
-  Matrix4x4 r;
+  get_world_transform();
+  return m_world_gl;
+}
+
+const AffineTransform& SceneNode::get_world_inverse()
+{
+  if (m_inv_dirty) {
+    m_world_inv = get_world_transform().invert();
+    m_inv_dirty = false;
+  }
+  return m_world_inv;
+}
 
-  if (axis == 'x') {
-    r[1][1] = cos(angle*M_PI/180);
-    r[1][2] = -sin(angle*M_PI/180);
-    r[2][1] = sin(angle*M_PI/180);
-    r[2][2] = cos(angle*M_PI/180);
+void SceneNode::mark_dirty()
+{
+  if (m_flat) {
+    m_flat->invalidate(m_flat_index);
   }
-  else if (axis == 'y') {
-    r[0][0] = cos(angle*M_PI/180);
-    r[2][2] = cos(angle*M_PI/180);
-    r[0][2] = sin(angle*M_PI/180);
-    r[2][0] = -sin(angle*M_PI/180);
+  mark_subtree_dirty();
+}
+
+void SceneNode::mark_subtree_dirty()
+{
+  // A dirty node's subtree is already dirty, so there is nothing left
+  // to propagate.
+  if (m_dirty) {
+    return;
   }
-  else if (axis == 'z') {
-    r[0][0] = cos(angle*M_PI/180);
-    r[0][1] = -sin(angle*M_PI/180);
-    r[1][0] = sin(angle*M_PI/180);
-    r[1][1] = cos(angle*M_PI/180);
+
+  m_dirty = true;
+  m_inv_dirty = true;
+  for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {
+    (*it)->mark_subtree_dirty();
   }
+}
+
+void SceneNode::rotate(char axis, double angle)
+{
+  AffineTransform r = Rotation(angle, axis);
 
   m_init = m_init * r;
   m_trans = m_trans * r ;  
+  mark_dirty();
 }
 
 void SceneNode::scale(const Vector3D& amount)
 {
-  Matrix4x4 r;
-
-  r[0][0] = amount[0];
-  r[1][1] = amount[1];
-  r[2][2] = amount[2];
+  AffineTransform r = Scaling(amount);
 
   m_init = m_init * r;
   m_trans = m_trans * r;
+  mark_dirty();
 }
 
 void SceneNode::translate(const Vector3D& amount)
 {
-  Matrix4x4 r;
-
-  r[0][3] = amount[0];
-  r[1][3] = amount[1];
-  r[2][3] = amount[2];
+  AffineTransform r = Translation(amount);
 
   m_init = m_init * r;
   m_trans = m_trans * r;
+  mark_dirty();
 }
 
 void SceneNode::mytranslate(const Vector3D& amount)
 {
-  Matrix4x4 r;
-
-  r[0][3] = amount[0];
-  r[1][3] = amount[1];
-  r[2][3] = amount[2];
-
-  m_trans = m_trans * r;
+  m_trans = m_trans * Translation(amount);
+  mark_dirty();
 }
 
 
@@ -109,12 +135,9 @@ JointNode::~JointNode()
 
 void JointNode::walk_gl(bool picking) 
 {
-  glMultMatrixd(m_trans.transpose().begin());
   for (ChildList::const_iterator it = m_children.begin(); it != m_children.end(); it++) {  
     (*it)->walk_gl(picking);
   }
-
-  glMultMatrixd(m_trans.invert().transpose().begin());
 }
 
 bool JointNode::is_joint() const
@@ -140,6 +163,15 @@ void JointNode::set_joint_y(double min, double init, double max)
 
 }
 
+void JointNode::set_angles(double x, double y)
+{
+  m_joint_x.change = x;
+  m_joint_y.change = y;
+  m_trans = Rotation(y - m_joint_y.init, 'z') *
+    Rotation(x - m_joint_x.init, 'x') * m_init;
+  mark_dirty();
+}
+
 GeometryNode::GeometryNode(const std::string& name, Primitive* primitive)
   : SceneNode(name),
     m_primitive(primitive),
@@ -153,61 +185,27 @@ GeometryNode::~GeometryNode()
 {
 }
 
-void GeometryNode::walk_gl(bool picking) 
+const Material* GeometryNode::get_material() const
 {
-  glMultMatrixd(m_trans.transpose().begin());
+  return m_material;
+}
 
-  if (m_material != NULL && m_current_id != m_id  && picking == false) {
-    if (picked) {
-      selected = false;
-      m_material->apply_gl();
-    }
-    else {
-      selected = true;
-      GLfloat materialColor[] = {1.0f, 1.0f, 1.0f, 1.0};
-      GLfloat materialSpecular[] = {0.1f, 0.1f, 0.1f, 1.0};
-
-      //The color emitted by the material
-      glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, materialColor);
-      glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, materialSpecular);
-      glMateriali(GL_FRONT_AND_BACK, GL_SHININESS, 10); 
-    }    
-  }
-  else if (picking == false  && moved) {
-      
-      GLfloat materialColor[] = {1.0f, 1.0f, 1.0f, 1.0};
-      GLfloat materialSpecular[] = {0.1f, 0.1f, 0.1f, 1.0};
-
-      //The color emitted by the material
-      glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, materialColor);
-      glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, materialSpecular);
-      glMateriali(GL_FRONT_AND_BACK, GL_SHININESS, 10); 
-      moved = false;
-      picked = false;
-      selected = true;
-  }
-  else if (picking == false) {
-    if (picked) {
-      picked = false;
-      selected = true;
-      GLfloat materialColor[] = {1.0f, 1.0f, 1.0f, 1.0};
-      GLfloat materialSpecular[] = {0.1f, 0.1f, 0.1f, 1.0};
-
-      //The color emitted by the material
-      glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, materialColor);
-      glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, materialSpecular);
-      glMateriali(GL_FRONT_AND_BACK, GL_SHININESS, 10); 
-    }
-    else {
-      picked = true;
-      selected = false;
-      m_material->apply_gl();
-    }
-  }
+Material* GeometryNode::get_material()
+{
+  return m_material;
+}
+
+void GeometryNode::walk_gl(bool picking) 
+{
+  glPushMatrix();
+  glMultMatrixd(get_world_gl());
 
   if (picking) {
     glPushName(m_id);
   }
+  else {
+    apply_material_gl();
+  }
 
   m_primitive->walk_gl(picking);
 
@@ -215,11 +213,33 @@ void GeometryNode::walk_gl(bool picking)
     glPopName();
   }
 
+  glPopMatrix();
+
   for (ChildList::const_iterator it = m_children.begin(); it != m_children.end(); it++) {
     (*it)->walk_gl(picking);
   }
+}
+
+void GeometryNode::apply_material_gl() const
+{
+  if (selected) {
+    apply_highlight_gl();
+  }
+  else if (m_material != NULL) {
+    m_material->apply_gl();
+  }
+  else {
+    apply_default_material_gl();
+  }
+}
+
+void GeometryNode::apply_highlight_gl()
+{
+  GLfloat materialColor[] = {1.0f, 1.0f, 1.0f, 1.0};
+  GLfloat materialSpecular[] = {0.1f, 0.1f, 0.1f, 1.0};
 
-  glMultMatrixd(m_trans.invert().transpose().begin());
-  
+  //The color emitted by the material
+  glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, materialColor);
+  glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, materialSpecular);
+  glMateriali(GL_FRONT_AND_BACK, GL_SHININESS, 10); 
 }
- 
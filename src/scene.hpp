@@ -6,21 +6,28 @@
 #include "primitive.hpp"
 #include "material.hpp"
 #include "a3.hpp"
+#include "flatscene.hpp"
+#include "registry.hpp"
 #include <GL/gl.h>
 #include <GL/glu.h>
 
 
 class SceneNode {
 
+  friend class FlatScene;
+  friend class SceneRegistry;
+
 public:
   SceneNode(const std::string& name);
   void reset_origin() {
       m_trans = m_init;
+      mark_dirty();
   }
 
   virtual void reset_trans() {
     for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {      
       m_trans = m_init;
+      mark_dirty();
       (*it)->reset_trans();
     }
   }
@@ -29,82 +36,68 @@ public:
   
   virtual void walk_gl(bool picking = false);
   
-  virtual void set_picked(int id, double x, double y) {
-    m_current_id = id;
-
-    for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {  
-      (*it)->set_picked(m_current_id, x, y);
-    }
-  }
-
-  virtual void push_transformation(std::vector<Matrix4x4> &trans_stack, 
-                                   std::vector<int> &id_stack) {
-    for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {
-      (*it)->push_transformation(trans_stack,id_stack);
-    }
-  }
-
-
-  virtual bool pop_transformation(std::vector<Matrix4x4> &trans_stack, 
-                                  std::vector<int> &id_stack,
-                                  std::vector<Matrix4x4> &redo_stack,
-                                  std::vector<int> &redo_ids) {
-    bool done = false;
-    if (!id_stack.empty()) {
-      for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {
-        done = (*it)->pop_transformation(trans_stack, id_stack, redo_stack, redo_ids);
-        if (done)
-          break;
-      }
-    }
-  }
-
-  virtual bool redo_transformation(std::vector<Matrix4x4> &redo_stack,
-                                   std::vector<int> &redo_ids) {
-    bool done = false;
-    if (!redo_ids.empty()) {
-      for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {
-        done = (*it)->redo_transformation(redo_stack, redo_ids);
-        if (done)
-          break;
-      }
-    }    
+  const AffineTransform& get_transform() const { return m_trans; }
+  const AffineTransform& get_inverse() const { return m_invtrans; }
+
+  // The transform the scene file gave the node, which reset_origin()
+  // and reset_trans() return to. Setting it also sets the current
+  // transform, as the rotate/scale/translate calls do.
+  const AffineTransform& get_initial_transform() const { return m_init; }
+  void set_initial_transform(const AffineTransform& m)
+  {
+    m_init = m;
+    m_trans = m;
+    mark_dirty();
   }
 
-  const Matrix4x4& get_transform() const { return m_trans; }
-  const Matrix4x4& get_inverse() const { return m_invtrans; }
-
   void set_scene_node(SceneNode *rootnode);
 
-  void set_transform(const Matrix4x4& m)
+  void set_transform(const AffineTransform& m)
   {
     m_trans = m;
     m_invtrans = m.invert();
+    mark_dirty();
   }
 
-  void set_transform(const Matrix4x4& m, const Matrix4x4& i)
+  void set_transform(const AffineTransform& m, const AffineTransform& i)
   {
     m_trans = m;
     m_invtrans = i;
+    mark_dirty();
   }
 
+  // World transform cache. A node's world matrix is its parent's
+  // world matrix times m_trans. It is recomputed lazily, and only
+  // after mark_dirty() has been called on the node or an ancestor.
+  const AffineTransform& get_world_transform();
+  // The world matrix in column-major order, ready for glMultMatrixd.
+  const double* get_world_gl();
+  const AffineTransform& get_world_inverse();
+
+  // Invalidate the cached world matrices of this node's subtree.
+  void mark_dirty();
+
   void add_child(SceneNode* child)
   {
     m_children.push_back(child);
+    child->m_parent = this;
+    child->mark_dirty();
+    if (m_flat) {
+      m_flat->invalidate_structure();
+    }
   }
 
+  typedef std::list<SceneNode*> ChildList;
+  const ChildList& children() const { return m_children; }
+
   void remove_child(SceneNode* child)
   {
     m_children.remove(child);
-  }
-
-  void set_new_transform(const Matrix4x4& m) {
-    current_trans = m;
-  }
-
-  void reset_transform() {
-    Matrix4x4 I;
-    current_trans = I;
+    child->m_parent = NULL;
+    child->mark_dirty();
+    if (m_flat) {
+      m_flat->invalidate_structure();
+    }
   }
 
   // Callbacks to be implemented.
@@ -116,34 +109,53 @@ public:
   // Returns true if and only if this node is a JointNode
   virtual bool is_joint() const;
   
+  // The id given by the node's registry, or -1 if it has none
   virtual int get_id() {
     return m_id;
   }
 
-  virtual void set_moved() {
-    moved = true;
-  }
+  // The registry of the scene this node was loaded into, if any
+  SceneRegistry* registry() const { return m_registry; }
+
+  const std::string& get_name() const { return m_name; }
 
   virtual bool is_selected() {
     return selected;
   }
 
+  // Flip the highlight of a picked geometry node.
+  virtual void toggle_selected() {
+  }
+
 protected:
-  // Useful for picking
-  bool picked, moved, selected;
-  int m_id, m_current_id;
+  void mark_subtree_dirty();
+
+  bool selected;
+  int m_id;
 
   std::string m_name;
 
   // Transformations
-  Matrix4x4 m_trans;
-  Matrix4x4 m_invtrans;
-  Matrix4x4 current_trans;
-  Matrix4x4 m_init;
+  AffineTransform m_trans;
+  AffineTransform m_invtrans;
+  AffineTransform m_init;
+
+  // Cached world transforms, valid while m_dirty/m_inv_dirty are false.
+  // A dirty node always has a dirty subtree.
+  AffineTransform m_world;
+  double m_world_gl[16];
+  AffineTransform m_world_inv;
+  bool m_dirty, m_inv_dirty;
 
   // Hierarchy
-  typedef std::list<SceneNode*> ChildList;
+  SceneNode* m_parent;
   ChildList m_children;
+
+  // The compiled scene this node belongs to, if any
+  FlatScene* m_flat;
+  int m_flat_index;
+
+  SceneRegistry* m_registry;
 };
 
 class JointNode : public SceneNode {
@@ -155,107 +167,18 @@ public:
 
   virtual void reset_trans() {
     for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {      
-      m_trans = m_init;
+      set_angles(m_joint_x.init, m_joint_y.init);
       (*it)->reset_trans();
     }
   }
 
 
-  virtual void set_picked(int id, double x, double y) {
-    m_current_id = id;
-   
-    for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {  
-
-      if ((*it)->is_selected()) {
-	//apply transformation  
-	if ((x/60 + m_joint_x.change) < m_joint_x.max && 
-            (x/60 + m_joint_x.change) > m_joint_x.min) {
-	  m_joint_x.change += x/60;
-          m_trans = Rotation(x/60, 'x' ) * m_trans;
-          set_new_transform(Rotation(x/60, 'x' ) * current_trans);
-	}
-	if ((y/60 + m_joint_y.change) < m_joint_y.max && 
-            (y/60 + m_joint_y.change) > m_joint_y.min) {
-	  m_joint_y.change += y/60;
-          m_trans = Rotation(y/60, 'z') * m_trans;
-          set_new_transform(Rotation(y/60, 'z' ) * current_trans);
-	}
-	if (x != 0 && y != 0)
-	  (*it)->set_moved();
-
-      }
-
-      (*it)->set_picked(m_current_id, x, y);
-    }
-  }
-  
-  virtual void push_transformation(std::vector<Matrix4x4> &trans_stack, 
-                                   std::vector<int> &id_stack) {
-
-    for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {      
-      if ((*it)->is_selected()) {
-        trans_stack.push_back(current_trans);
-        id_stack.push_back((*it)->get_id());
-	reset_transform();
-      }
-      (*it)->push_transformation(trans_stack, id_stack);
-    }
-  }
-  
-
-  virtual bool pop_transformation(std::vector<Matrix4x4> &trans_stack, 
-                                  std::vector<int> &id_stack,
-                                  std::vector<Matrix4x4> &redo_stack,
-                                  std::vector<int> &redo_ids) {
-    bool done = false;
-    for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {
-      if (!id_stack.empty()) {
-        if ((*it)->get_id() == id_stack.back()) {
-          m_trans = trans_stack.back().invert() * m_trans;
-          redo_stack.push_back(trans_stack.back());
-          redo_ids.push_back(id_stack.back());
-          trans_stack.pop_back();
-          id_stack.pop_back();
-          m_joint_x.change = m_joint_x.init;
-          m_joint_y.change = m_joint_y.init;
-          return true;
-        }
-      }
-      done = (*it)->pop_transformation(trans_stack, id_stack, redo_stack, redo_ids);
-      if (done)
-        return true;
-    }
-  }
-
-  virtual bool redo_transformation(std::vector<Matrix4x4> &redo_stack,
-                                   std::vector<int> &redo_ids) {
-    bool done = false;
-    for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {
-      if (!redo_ids.empty()) {
-        if ((*it)->get_id() == redo_ids.back()) {
-          m_trans = redo_stack.back() * m_trans;
-          redo_stack.pop_back();
-          redo_ids.pop_back();
-          return true;
-        }
-      }
-      done = (*it)->redo_transformation(redo_stack, redo_ids);
-      if (done)
-        return true;
-    }    
-  }
-
-
   virtual bool is_joint() const;
 
   virtual int get_id() {
     return m_id;
   }
 
-  virtual void set_moved() {
-    moved = true;
-  }
-
   virtual bool is_selected() {
     return selected;
   }
@@ -263,11 +186,39 @@ public:
   void set_joint_x(double min, double init, double max);
   void set_joint_y(double min, double init, double max);
 
+  // Current angles, as limited by the joint ranges
+  double get_angle_x() const { return m_joint_x.change; }
+  double get_angle_y() const { return m_joint_y.change; }
+
+  // Pose the joint. Its transform is a function of the angles alone:
+  // the initial transform turned by the change in x, then in y, so a
+  // pose can be stored as its two angles. Used by undo and redo.
+  void set_angles(double x, double y);
+
+  // Turn the joint by x/60 and y/60 degrees for a mouse drag of (x, y)
+  // pixels, on each axis only if that stays inside its range.
+  void drag(double x, double y)
+  {
+    double angle_x = m_joint_x.change, angle_y = m_joint_y.change;
+    if ((x/60 + m_joint_x.change) < m_joint_x.max && 
+        (x/60 + m_joint_x.change) > m_joint_x.min) {
+      angle_x += x/60;
+    }
+    if ((y/60 + m_joint_y.change) < m_joint_y.max && 
+        (y/60 + m_joint_y.change) > m_joint_y.min) {
+      angle_y += y/60;
+    }
+    if (angle_x != m_joint_x.change || angle_y != m_joint_y.change) {
+      set_angles(angle_x, angle_y);
+    }
+  }
+
   struct JointRange {
     double min, init, max, change;
   };
 
-  std::vector<double> x_stack,y_stack;
+  const JointRange& get_joint_x() const { return m_joint_x; }
+  const JointRange& get_joint_y() const { return m_joint_y; }
 
 protected:
 
@@ -275,6 +226,9 @@ protected:
 };
 
 class GeometryNode : public SceneNode {
+
+  friend class FlatScene;
+
 public:
   GeometryNode(const std::string& name,
                Primitive* primitive);
@@ -282,71 +236,44 @@ public:
 
   virtual void walk_gl(bool picking = false) ;
 
-  virtual void set_picked(int id, double x, double y) {
-    m_current_id = id;
-
-    for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {  
-      (*it)->set_picked(m_current_id, x, y);
-    }
-  }
-
   const Material* get_material() const;
   Material* get_material();
 
   void set_material(Material* material)
   {
     m_material = material;
+    // The flat scene groups its draws by material
+    if (m_flat) {
+      m_flat->invalidate_structure();
+    }
   }
 
+  Primitive* get_primitive() const { return m_primitive; }
+
   virtual void reset_trans() {
     for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {      
       m_trans = m_init;
+      mark_dirty();
       (*it)->reset_trans();
     }
   }
 
-  virtual void push_transformation(std::vector<Matrix4x4> &trans_stack, 
-                                   std::vector<int> &id_stack) {
-    for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {
-      (*it)->push_transformation(trans_stack, id_stack);
-    }
-  }
-
-  virtual bool pop_transformation(std::vector<Matrix4x4> &trans_stack, 
-                                  std::vector<int> &id_stack,
-                                  std::vector<Matrix4x4> &redo_stack,
-                                  std::vector<int> &redo_ids) {
-    Matrix4x4 tmp;
-    bool done = false;
-    for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {
-      done = (*it)->pop_transformation(trans_stack, id_stack, redo_stack, redo_ids);
-      if (done)
-        return true;
-    }
-  }
-
-  virtual bool redo_transformation(std::vector<Matrix4x4> &redo_stack,
-                                   std::vector<int> &redo_ids) {
-    Matrix4x4 tmp;
-    bool done = false;
-    for (ChildList::iterator it = m_children.begin(); it != m_children.end(); it++) {
-      done = (*it)->redo_transformation(redo_stack, redo_ids);
-      if (done)
-        return true;
-    }    
-  }
-  
   virtual int get_id() {
     return m_id;
   }
 
-  virtual void set_moved() {
-    moved = true;
-  }
-
   virtual bool is_selected() {
     return selected;
   }
+
+  virtual void toggle_selected() {
+    selected = !selected;
+  }
+
+  // Set up the GL material for this node: the highlight colour when
+  // selected, otherwise its own material.
+  void apply_material_gl() const;
+  static void apply_highlight_gl();
   
 protected:
   Material* m_material;
@@ -0,0 +1,335 @@
+#include "scene_cache.hpp"
+#include "scene_lua.hpp"
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char SCENE_CACHE_MAGIC[8] = { 'P', 'U', 'P', 'S', 'C', 'E', 'N', 'E' };
+static const uint32_t SCENE_CACHE_BYTE_ORDER = 0x01020304;
+
+bool hash_file(const std::string& filename, uint64_t& hash)
+{
+  std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+  if (!in) {
+    return false;
+  }
+
+  hash = 14695981039346656037ULL;
+  char buffer[65536];
+  while (in) {
+    in.read(buffer, sizeof(buffer));
+    for (std::streamsize i = 0; i < in.gcount(); ++i) {
+      hash = (hash ^ (unsigned char)buffer[i]) * 1099511628211ULL;
+    }
+  }
+  return in.eof();
+}
+
+/*
+ * Writing
+ */
+
+struct SceneCacheWriter {
+  std::vector<SceneCacheMaterial> materials;
+  std::map<Material*, int> material_index;
+  std::vector<SceneCacheNode> nodes;
+  std::string names;
+
+  bool add(SceneNode* node, int parent);
+  int add_material(Material* material);
+};
+
+int SceneCacheWriter::add_material(Material* material)
+{
+  std::map<Material*, int>::iterator it = material_index.find(material);
+  if (it != material_index.end()) {
+    return it->second;
+  }
+
+  PhongMaterial* phong = dynamic_cast<PhongMaterial*>(material);
+  if (!phong) {
+    return -2;
+  }
+  SceneCacheMaterial record;
+  const Colour& kd = phong->get_kd();
+  const Colour& ks = phong->get_ks();
+  record.kd[0] = kd.R();
+  record.kd[1] = kd.G();
+  record.kd[2] = kd.B();
+  record.ks[0] = ks.R();
+  record.ks[1] = ks.G();
+  record.ks[2] = ks.B();
+  record.shininess = phong->get_shininess();
+
+  int index = materials.size();
+  materials.push_back(record);
+  material_index[material] = index;
+  return index;
+}
+
+bool SceneCacheWriter::add(SceneNode* node, int parent)
+{
+  SceneCacheNode record;
+  memset(&record, 0, sizeof(record));
+  record.type = SceneCacheNode::PLAIN;
+  record.parent = parent;
+  record.material = -1;
+  record.primitive = SceneCacheNode::NO_PRIMITIVE;
+  record.name = names.size();
+  names.append(node->get_name().c_str(), node->get_name().size() + 1);
+
+  const AffineTransform& init = node->get_initial_transform();
+  std::copy(init.begin(), init.end(), record.init);
+
+  GeometryNode* geometry = dynamic_cast<GeometryNode*>(node);
+  if (geometry) {
+    record.type = SceneCacheNode::GEOMETRY;
+    if (!dynamic_cast<Sphere*>(geometry->get_primitive())) {
+      std::cerr << "Cannot cache " << node->get_name()
+                << ": unknown primitive" << std::endl;
+      return false;
+    }
+    record.primitive = SceneCacheNode::SPHERE;
+    if (geometry->get_material()) {
+      record.material = add_material(geometry->get_material());
+      if (record.material < 0) {
+        std::cerr << "Cannot cache " << node->get_name()
+                  << ": unknown material" << std::endl;
+        return false;
+      }
+    }
+  }
+  else if (node->is_joint()) {
+    JointNode* joint = static_cast<JointNode*>(node);
+    const JointNode::JointRange& x = joint->get_joint_x();
+    const JointNode::JointRange& y = joint->get_joint_y();
+    record.type = SceneCacheNode::JOINT;
+    record.joint_x[0] = x.min;
+    record.joint_x[1] = x.init;
+    record.joint_x[2] = x.max;
+    record.joint_y[0] = y.min;
+    record.joint_y[1] = y.init;
+    record.joint_y[2] = y.max;
+  }
+
+  int index = nodes.size();
+  nodes.push_back(record);
+
+  for (SceneNode::ChildList::const_iterator it = node->children().begin();
+       it != node->children().end(); ++it) {
+    if (!add(*it, index)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool write_scene_cache(const std::string& filename, SceneNode* root,
+                       uint64_t source_hash)
+{
+  SceneCacheWriter writer;
+  if (!root || !writer.add(root, -1)) {
+    return false;
+  }
+
+  SceneCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+  header.version = SCENE_CACHE_VERSION;
+  header.byte_order = SCENE_CACHE_BYTE_ORDER;
+  header.source_hash = source_hash;
+  header.material_count = writer.materials.size();
+  header.node_count = writer.nodes.size();
+  // Pad the name block so a following file section would stay aligned
+  writer.names.resize((writer.names.size() + 7) & ~(size_t)7, '\0');
+  header.name_bytes = writer.names.size();
+
+  // Write to a temporary name and rename, so a reader never maps a
+  // half-written file
+  std::string temporary = filename + ".tmp";
+  {
+    std::ofstream out(temporary.c_str(), std::ios::out | std::ios::binary);
+    out.write((const char*)&header, sizeof(header));
+    if (!writer.materials.empty()) {
+      out.write((const char*)&writer.materials[0],
+                writer.materials.size() * sizeof(SceneCacheMaterial));
+    }
+    out.write((const char*)&writer.nodes[0],
+              writer.nodes.size() * sizeof(SceneCacheNode));
+    out.write(writer.names.data(), writer.names.size());
+    if (!out) {
+      unlink(temporary.c_str());
+      return false;
+    }
+  }
+  if (rename(temporary.c_str(), filename.c_str()) != 0) {
+    unlink(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Reading
+ */
+
+// A read-only mapping of a whole file
+class MappedFile {
+public:
+  MappedFile(const std::string& filename)
+    : m_data(NULL), m_size(0)
+  {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        m_data = (const char*)data;
+        m_size = st.st_size;
+      }
+    }
+    close(fd);
+  }
+
+  ~MappedFile()
+  {
+    if (m_data) {
+      munmap((void*)m_data, m_size);
+    }
+  }
+
+  const char* data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+private:
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+  const char* m_data;
+  size_t m_size;
+};
+
+SceneNode* read_scene_cache(const std::string& filename, uint64_t source_hash)
+{
+  MappedFile file(filename);
+  if (!file.data() || file.size() < sizeof(SceneCacheHeader)) {
+    return NULL;
+  }
+
+  const SceneCacheHeader* header = (const SceneCacheHeader*)file.data();
+  if (memcmp(header->magic, SCENE_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SCENE_CACHE_VERSION ||
+      header->byte_order != SCENE_CACHE_BYTE_ORDER ||
+      header->source_hash != source_hash ||
+      header->node_count == 0) {
+    return NULL;
+  }
+
+  size_t expected = sizeof(SceneCacheHeader) +
+    (size_t)header->material_count * sizeof(SceneCacheMaterial) +
+    (size_t)header->node_count * sizeof(SceneCacheNode) +
+    header->name_bytes;
+  if (file.size() != expected) {
+    return NULL;
+  }
+
+  const SceneCacheMaterial* material_records =
+    (const SceneCacheMaterial*)(header + 1);
+  const SceneCacheNode* records =
+    (const SceneCacheNode*)(material_records + header->material_count);
+  const char* names = (const char*)(records + header->node_count);
+  if (header->name_bytes == 0 || names[header->name_bytes - 1] != '\0') {
+    return NULL;
+  }
+
+  // Check every reference before building anything
+  for (uint32_t i = 0; i < header->node_count; ++i) {
+    const SceneCacheNode& r = records[i];
+    if (r.type > SceneCacheNode::GEOMETRY ||
+        r.parent >= (int32_t)i || (r.parent < 0) != (i == 0) ||
+        r.material >= (int32_t)header->material_count || r.material < -1 ||
+        r.name >= header->name_bytes ||
+        (r.type == SceneCacheNode::GEOMETRY) != (r.primitive == SceneCacheNode::SPHERE)) {
+      std::cerr << filename << ": damaged scene cache" << std::endl;
+      return NULL;
+    }
+  }
+
+  SceneRegistry* registry = new SceneRegistry();
+  std::vector<Material*> materials(header->material_count);
+  for (uint32_t i = 0; i < header->material_count; ++i) {
+    const SceneCacheMaterial& m = material_records[i];
+    materials[i] = registry->create_material(Colour(m.kd[0], m.kd[1], m.kd[2]),
+                                             Colour(m.ks[0], m.ks[1], m.ks[2]),
+                                             m.shininess);
+  }
+
+  std::vector<SceneNode*> nodes(header->node_count);
+  for (uint32_t i = 0; i < header->node_count; ++i) {
+    const SceneCacheNode& r = records[i];
+    const char* name = names + r.name;
+
+    SceneNode* node;
+    if (r.type == SceneCacheNode::JOINT) {
+      JointNode* joint = registry->create_joint(name);
+      joint->set_joint_x(r.joint_x[0], r.joint_x[1], r.joint_x[2]);
+      joint->set_joint_y(r.joint_y[0], r.joint_y[1], r.joint_y[2]);
+      node = joint;
+    }
+    else if (r.type == SceneCacheNode::GEOMETRY) {
+      GeometryNode* geometry = registry->create_geometry(name, registry->sphere());
+      if (r.material >= 0) {
+        geometry->set_material(materials[r.material]);
+      }
+      node = geometry;
+    }
+    else {
+      node = registry->create_node(name);
+    }
+
+    AffineTransform init;
+    std::copy(r.init, r.init + 12, init[0]);
+    node->set_initial_transform(init);
+
+    nodes[i] = node;
+    if (r.parent >= 0) {
+      nodes[r.parent]->add_child(node);
+    }
+  }
+  return nodes[0];
+}
+
+std::string scene_cache_name(const std::string& script)
+{
+  return script + ".cache";
+}
+
+SceneNode* load_scene(const std::string& script)
+{
+  uint64_t hash;
+  if (!hash_file(script, hash)) {
+    return import_lua(script);
+  }
+
+  std::string cache = scene_cache_name(script);
+  SceneNode* root = read_scene_cache(cache, hash);
+  if (root) {
+    return root;
+  }
+
+  root = import_lua(script);
+  if (root && !write_scene_cache(cache, root, hash)) {
+    std::cerr << "Could not write scene cache " << cache << std::endl;
+  }
+  return root;
+}
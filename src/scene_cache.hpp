@@ -0,0 +1,85 @@
+#ifndef CS488_SCENE_CACHE_HPP
+#define CS488_SCENE_CACHE_HPP
+
+#include <string>
+#include <stdint.h>
+#include "scene.hpp"
+
+// A compiled scene: the node tree a Lua script builds, written to a
+// binary file so that later launches can skip the interpreter.
+//
+// The file is a header, the materials, the nodes in depth-first order
+// (parents before children) and a block of NUL-terminated names. All
+// records are fixed size and in native byte order. The loader maps the
+// file and builds nodes straight from the mapped records.
+//
+// The header records the hash of the script the cache was compiled
+// from. A cache whose hash, version or byte order does not match is
+// ignored. Only the script itself is hashed, not files it loads with
+// dofile or require.
+
+enum {
+  SCENE_CACHE_VERSION = 1
+};
+
+struct SceneCacheHeader {
+  char magic[8];            // "PUPSCENE"
+  uint32_t version;         // SCENE_CACHE_VERSION
+  uint32_t byte_order;      // 0x01020304 as the writer stored it
+  uint64_t source_hash;
+  uint32_t material_count;
+  uint32_t node_count;
+  uint32_t name_bytes;
+  uint32_t reserved;
+};
+
+struct SceneCacheMaterial {
+  double kd[3];
+  double ks[3];
+  double shininess;
+};
+
+struct SceneCacheNode {
+  enum Type {
+    PLAIN,
+    JOINT,
+    GEOMETRY
+  };
+  enum PrimitiveType {
+    NO_PRIMITIVE,
+    SPHERE
+  };
+
+  uint32_t type;
+  int32_t parent;           // index of the parent record, or -1
+  int32_t material;         // index of the material record, or -1
+  uint32_t primitive;
+  uint32_t name;            // offset into the name block
+  uint32_t reserved;
+  double init[12];          // m_init, row-major 3x4
+  double joint_x[3];        // min, init, max
+  double joint_y[3];
+};
+
+// 64-bit FNV-1a hash of a file's contents. Returns false if the file
+// cannot be read.
+bool hash_file(const std::string& filename, uint64_t& hash);
+
+// Write the tree under root to filename. Fails if the tree uses a
+// primitive or material the format cannot describe.
+bool write_scene_cache(const std::string& filename, SceneNode* root,
+                       uint64_t source_hash);
+
+// Load a cache written by write_scene_cache(), or return NULL if it is
+// missing, damaged or was compiled from a different script. As with
+// import_lua(), the nodes belong to root->registry().
+SceneNode* read_scene_cache(const std::string& filename, uint64_t source_hash);
+
+// Where the cache of a script is kept
+std::string scene_cache_name(const std::string& script);
+
+// Load a Lua scene through its cache, running the script (and writing
+// a fresh cache) only when it has changed since the cache was made.
+SceneNode* load_scene(const std::string& script);
+
+#endif
@@ -78,6 +78,16 @@ struct gr_material_ud {
   Material* material;
 };
 
+// The registry of the scene being imported. Everything the script
+// creates is built by, and belongs to, it.
+static SceneRegistry* scene_registry(lua_State* L)
+{
+  lua_getfield(L, LUA_REGISTRYINDEX, "gr.registry");
+  SceneRegistry* registry = (SceneRegistry*)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return registry;
+}
+
 // Create a node
 extern "C"
 int gr_node_cmd(lua_State* L)
@@ -88,7 +98,7 @@ int gr_node_cmd(lua_State* L)
   data->node = 0;
 
   const char* name = luaL_checkstring(L, 1);
-  data->node = new SceneNode(name);
+  data->node = scene_registry(L)->create_node(name);
 
   luaL_getmetatable(L, "gr.node");
   lua_setmetatable(L, -2);
@@ -106,7 +116,7 @@ int gr_joint_cmd(lua_State* L)
   data->node = 0;
 
   const char* name = luaL_checkstring(L, 1);
-  JointNode* node = new JointNode(name);
+  JointNode* node = scene_registry(L)->create_joint(name);
 
   luaL_checktype(L, 2, LUA_TTABLE);
   luaL_argcheck(L, luaL_getn(L, 2) == 3, 2, "Three-tuple expected");
@@ -143,7 +153,8 @@ int gr_sphere_cmd(lua_State* L)
   data->node = 0;
   
   const char* name = luaL_checkstring(L, 1);
-  data->node = new GeometryNode(name, new Sphere());
+  SceneRegistry* registry = scene_registry(L);
+  data->node = registry->create_geometry(name, registry->sphere());
 
   luaL_getmetatable(L, "gr.node");
   lua_setmetatable(L, -2);
@@ -176,9 +187,9 @@ int gr_material_cmd(lua_State* L)
   }
   double shininess = luaL_checknumber(L, 3);
   
-  data->material = new PhongMaterial(Colour(kd[0], kd[1], kd[2]),
-                                     Colour(ks[0], ks[1], ks[2]),
-                                     shininess);
+  data->material = scene_registry(L)->create_material(Colour(kd[0], kd[1], kd[2]),
+                                                      Colour(ks[0], ks[1], ks[2]),
+                                                      shininess);
 
   luaL_newmetatable(L, "gr.material");
   lua_setmetatable(L, -2);
@@ -311,7 +322,8 @@ int gr_node_gc_cmd(lua_State* L)
 
   // Note that we don't delete the node here. This is because we still
   // want the scene to be around when we close the lua interpreter,
-  // but at that point everything will be garbage collected.
+  // but at that point everything will be garbage collected. The
+  // scene's SceneRegistry owns the node.
   //
   // If data->node happened to be a reference-counting pointer, this
   // will in fact just decrease lua's reference to it, so it's not a
@@ -382,10 +394,16 @@ SceneNode* import_lua(const std::string& filename)
   // Load the gr functions
   luaL_openlib(L, "gr", grlib_functions, 0);
 
+  // The nodes the script creates belong to this scene's registry
+  SceneRegistry* registry = new SceneRegistry();
+  lua_pushlightuserdata(L, registry);
+  lua_setfield(L, LUA_REGISTRYINDEX, "gr.registry");
+
   GRLUA_DEBUG("Parsing the scene");
   // Now parse the actual scene
   if (luaL_loadfile(L, filename.c_str()) || lua_pcall(L, 0, 1, 0)) {
     std::cerr << "Error loading " << filename << ": " << lua_tostring(L, -1) << std::endl;
+    delete registry;
     return 0;
   }
 
@@ -395,6 +413,7 @@ SceneNode* import_lua(const std::string& filename)
   gr_node_ud* data = (gr_node_ud*)luaL_checkudata(L, -1, "gr.node");
   if (!data) {
     std::cerr << "Error loading " << filename << ": Must return the root node." << std::endl;
+    delete registry;
     return 0;
   }
 
@@ -4,6 +4,8 @@
 #include <string>
 #include "scene.hpp"
 
+// Load the scene a Lua script returns. Its nodes belong to a new
+// SceneRegistry, root->registry(); deleting that frees the scene.
 SceneNode* import_lua(const std::string& filename);
 
 #endif
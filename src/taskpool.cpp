@@ -0,0 +1,198 @@
+#include "taskpool.hpp"
+#include <cstdlib>
+#include <sched.h>
+#include <unistd.h>
+
+TaskPool::TaskPool(int threads)
+  : m_generation(0),
+    m_busy(0),
+    m_stopping(false),
+    m_job(NULL),
+    m_grain(1),
+    m_remaining(0)
+{
+  if (threads <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? cpus : 1;
+  }
+
+  pthread_mutex_init(&m_lock, NULL);
+  pthread_cond_init(&m_wake, NULL);
+  pthread_cond_init(&m_idle, NULL);
+
+  for (int i = 0; i < threads; ++i) {
+    Worker* worker = new Worker;
+    worker->pool = this;
+    worker->index = i;
+    pthread_mutex_init(&worker->lock, NULL);
+
+    // Worker 0 is whoever calls run()
+    if (i > 0 && pthread_create(&worker->thread, NULL, thread_main, worker) != 0) {
+      pthread_mutex_destroy(&worker->lock);
+      delete worker;
+      break;
+    }
+    m_workers.push_back(worker);
+  }
+}
+
+TaskPool::~TaskPool()
+{
+  pthread_mutex_lock(&m_lock);
+  m_stopping = true;
+  pthread_cond_broadcast(&m_wake);
+  pthread_mutex_unlock(&m_lock);
+
+  for (size_t i = 0; i < m_workers.size(); ++i) {
+    if (i > 0) {
+      pthread_join(m_workers[i]->thread, NULL);
+    }
+    pthread_mutex_destroy(&m_workers[i]->lock);
+    delete m_workers[i];
+  }
+
+  pthread_cond_destroy(&m_idle);
+  pthread_cond_destroy(&m_wake);
+  pthread_mutex_destroy(&m_lock);
+}
+
+TaskPool& TaskPool::shared()
+{
+  // Never destroyed: its threads may outlive other static objects
+  static TaskPool* pool = NULL;
+  if (!pool) {
+    const char* threads = getenv("PUPPET_THREADS");
+    pool = new TaskPool(threads ? atoi(threads) : 0);
+  }
+  return *pool;
+}
+
+void* TaskPool::thread_main(void* arg)
+{
+  Worker* worker = static_cast<Worker*>(arg);
+  TaskPool* pool = worker->pool;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&pool->m_lock);
+  for (;;) {
+    // A job that finished before we woke leaves m_job empty
+    while (!pool->m_stopping && (pool->m_generation == seen || !pool->m_job)) {
+      pthread_cond_wait(&pool->m_wake, &pool->m_lock);
+    }
+    if (pool->m_stopping) {
+      break;
+    }
+    seen = pool->m_generation;
+    pool->m_busy++;
+    TaskJob* job = pool->m_job;
+    size_t grain = pool->m_grain;
+    pthread_mutex_unlock(&pool->m_lock);
+
+    pool->work(worker->index, job, grain);
+
+    pthread_mutex_lock(&pool->m_lock);
+    if (--pool->m_busy == 0) {
+      pthread_cond_signal(&pool->m_idle);
+    }
+  }
+  pthread_mutex_unlock(&pool->m_lock);
+  return NULL;
+}
+
+void TaskPool::run(TaskJob& job, size_t count, size_t grain)
+{
+  if (grain == 0) {
+    grain = 1;
+  }
+  int threads = m_workers.size();
+  if (threads == 1 || count <= grain) {
+    if (count) {
+      job.run(0, count, 0);
+    }
+    return;
+  }
+
+  // Start every thread on an equal share; stealing evens out the rest
+  for (int i = 0; i < threads; ++i) {
+    Range range = { count * i / threads, count * (i + 1) / threads };
+    if (range.begin < range.end) {
+      m_workers[i]->ranges.push_back(range);
+    }
+  }
+  m_remaining = count;
+
+  pthread_mutex_lock(&m_lock);
+  m_job = &job;
+  m_grain = grain;
+  m_generation++;
+  pthread_cond_broadcast(&m_wake);
+  pthread_mutex_unlock(&m_lock);
+
+  work(0, &job, grain);
+
+  // Every piece is done, but a thread may still be looking for more;
+  // it must not find the next job's ranges with this job in hand
+  pthread_mutex_lock(&m_lock);
+  m_job = NULL;
+  while (m_busy > 0) {
+    pthread_cond_wait(&m_idle, &m_lock);
+  }
+  pthread_mutex_unlock(&m_lock);
+}
+
+bool TaskPool::take(int index, Range& range)
+{
+  Worker* self = m_workers[index];
+  pthread_mutex_lock(&self->lock);
+  bool found = !self->ranges.empty();
+  if (found) {
+    range = self->ranges.back();
+    self->ranges.pop_back();
+  }
+  pthread_mutex_unlock(&self->lock);
+  if (found) {
+    return true;
+  }
+
+  int threads = m_workers.size();
+  for (int k = 1; k < threads && !found; ++k) {
+    Worker* victim = m_workers[(index + k) % threads];
+    pthread_mutex_lock(&victim->lock);
+    found = !victim->ranges.empty();
+    if (found) {
+      range = victim->ranges.front();
+      victim->ranges.pop_front();
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return found;
+}
+
+void TaskPool::work(int index, TaskJob* job, size_t grain)
+{
+  Worker* self = m_workers[index];
+
+  for (;;) {
+    Range range;
+    if (!take(index, range)) {
+      // Others are finishing the last pieces
+      if (__sync_fetch_and_add(&m_remaining, 0) == 0) {
+        return;
+      }
+      sched_yield();
+      continue;
+    }
+
+    // Leave the halves we split off for ourselves or for thieves
+    while (range.end - range.begin > grain) {
+      Range rest = { range.begin + (range.end - range.begin) / 2, range.end };
+      pthread_mutex_lock(&self->lock);
+      self->ranges.push_back(rest);
+      pthread_mutex_unlock(&self->lock);
+      range.end = rest.begin;
+    }
+
+    job->run(range.begin, range.end, index);
+    __sync_sub_and_fetch(&m_remaining, range.end - range.begin);
+  }
+}
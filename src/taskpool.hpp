@@ -0,0 +1,84 @@
+#ifndef CS488_TASKPOOL_HPP
+#define CS488_TASKPOOL_HPP
+
+#include <deque>
+#include <vector>
+#include <stddef.h>
+#include <pthread.h>
+
+// Work handed to a TaskPool: run() is called on disjoint pieces of
+// the range [0, count) given to TaskPool::run(), several at once on
+// different threads, so it must only touch what its piece owns.
+class TaskJob {
+public:
+  virtual ~TaskJob() {}
+  // worker says which thread is running the piece, from 0 to
+  // TaskPool::thread_count() - 1, for indexing per-thread scratch
+  virtual void run(size_t begin, size_t end, int worker) = 0;
+};
+
+// A fixed set of threads that share out index ranges by work
+// stealing. Each thread keeps a deque of ranges; it splits the range
+// it takes until a piece is no bigger than the grain, keeping the
+// first half and pushing the second onto its own deque. An idle
+// thread steals the oldest, and so largest, range from another's
+// deque, so uneven pieces balance themselves without a central queue.
+//
+// The thread calling run() works as worker 0, so a pool of one
+// thread runs everything inline and starts no threads at all.
+class TaskPool {
+public:
+  // threads counts the caller; 0 means one per online CPU
+  explicit TaskPool(int threads = 0);
+  ~TaskPool();
+
+  int thread_count() const { return m_workers.size(); }
+
+  // Run job over [0, count) in pieces of at most grain indices, and
+  // return once every piece is done. Not reentrant: a job must not
+  // run() on the pool running it.
+  void run(TaskJob& job, size_t count, size_t grain = 1);
+
+  // A pool with a thread per CPU, started on first use, or as many as
+  // the PUPPET_THREADS environment variable asks for
+  static TaskPool& shared();
+
+private:
+  TaskPool(const TaskPool&);
+  TaskPool& operator=(const TaskPool&);
+
+  struct Range {
+    size_t begin, end;
+  };
+
+  struct Worker {
+    TaskPool* pool;
+    int index;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    std::deque<Range> ranges;
+  };
+
+  static void* thread_main(void* worker);
+  // Do pieces of job until none are left anywhere
+  void work(int index, TaskJob* job, size_t grain);
+  // Take a range from the back of our own deque or the front of
+  // another's
+  bool take(int index, Range& range);
+
+  std::vector<Worker*> m_workers;
+
+  // Guards the fields below, which wake the threads for each job
+  pthread_mutex_t m_lock;
+  pthread_cond_t m_wake, m_idle;
+  unsigned long m_generation;
+  int m_busy;
+  bool m_stopping;
+  TaskJob* m_job;
+  size_t m_grain;
+
+  // Indices of the current job not yet done; updated atomically
+  volatile size_t m_remaining;
+};
+
+#endif
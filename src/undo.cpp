@@ -0,0 +1,259 @@
+#include "undo.hpp"
+#include "scene.hpp"
+#include <math.h>
+
+const double UndoHistory::ANGLE_QUANTUM = 0.01;
+
+// Largest change an Edit can hold, in quanta
+static const long MAX_QUANTA = 32767;
+
+UndoHistory::UndoHistory(size_t max_bytes, size_t snapshot_interval)
+  : m_max_bytes(max_bytes),
+    m_snapshot_interval(snapshot_interval ? snapshot_interval : 1),
+    m_registry(NULL),
+    m_applied(0)
+{
+  clear();
+}
+
+void UndoHistory::set_registry(SceneRegistry* registry)
+{
+  m_registry = registry;
+  clear();
+}
+
+void UndoHistory::set_limits(size_t max_bytes, size_t snapshot_interval)
+{
+  m_max_bytes = max_bytes;
+  m_snapshot_interval = snapshot_interval ? snapshot_interval : 1;
+  enforce_limit();
+}
+
+int UndoHistory::joint_index(JointNode* joint)
+{
+  int id = joint->get_id();
+  if (!m_registry || joint->registry() != m_registry) {
+    return -1;
+  }
+  if ((size_t)id >= m_joint_index.size()) {
+    m_joint_index.resize(m_registry->size(), -1);
+  }
+  SceneRegistry::Handle handle = m_registry->handle(joint);
+  int index = m_joint_index[id];
+  if (index < 0 || m_joints[index].generation != handle.generation) {
+    m_joint_index[id] = m_joints.size();
+    m_joints.push_back(handle);
+    m_origin.push_back(joint->get_angle_x());
+    m_origin.push_back(joint->get_angle_y());
+  }
+  return m_joint_index[id];
+}
+
+JointNode* UndoHistory::joint(unsigned int index) const
+{
+  return m_registry ? m_registry->joint(m_joints[index]) : NULL;
+}
+
+void UndoHistory::begin_step(const std::vector<JointNode*>& joints)
+{
+  m_pending.clear();
+  for (std::vector<JointNode*>::const_iterator it = joints.begin(); it != joints.end(); ++it) {
+    int index = joint_index(*it);
+    if (index < 0) {
+      continue;
+    }
+    Pending p;
+    p.joint = index;
+    p.x = (*it)->get_angle_x();
+    p.y = (*it)->get_angle_y();
+    m_pending.push_back(p);
+  }
+}
+
+// The change from before to after in whole quanta
+static long quanta(double before, double after)
+{
+  return (long)floor((after - before) / UndoHistory::ANGLE_QUANTUM + 0.5);
+}
+
+static short quantize(double before, double after)
+{
+  long q = quanta(before, after);
+  if (q > MAX_QUANTA) {
+    q = MAX_QUANTA;
+  }
+  else if (q < -MAX_QUANTA) {
+    q = -MAX_QUANTA;
+  }
+  return (short)q;
+}
+
+bool UndoHistory::end_step()
+{
+  std::vector<Edit> edits;
+  for (std::vector<Pending>::const_iterator it = m_pending.begin(); it != m_pending.end(); ++it) {
+    JointNode* joint = this->joint(it->joint);
+    if (!joint) {
+      continue;
+    }
+    double x = joint->get_angle_x();
+    double y = joint->get_angle_y();
+    if (x == it->x && y == it->y) {
+      continue;
+    }
+
+    // Leave the joint exactly where undo and redo will put it
+    Edit edit;
+    edit.joint = it->joint;
+    edit.dx = quantize(it->x, x);
+    edit.dy = quantize(it->y, y);
+    joint->set_angles(it->x + edit.dx * ANGLE_QUANTUM,
+                      it->y + edit.dy * ANGLE_QUANTUM);
+    if (edit.dx != 0 || edit.dy != 0) {
+      edits.push_back(edit);
+    }
+  }
+  m_pending.clear();
+
+  // Nothing moved, so whatever had been undone can still be redone
+  if (edits.empty()) {
+    return false;
+  }
+
+  // A new step replaces whatever had been undone
+  m_edits.resize(m_steps[m_applied]);
+  m_steps.resize(m_applied + 1);
+  while (m_snapshots.back().state > m_applied) {
+    m_snapshots.pop_back();
+  }
+  m_edits.insert(m_edits.end(), edits.begin(), edits.end());
+  m_steps.push_back(m_edits.size());
+  ++m_applied;
+
+  if (m_applied - m_snapshots.back().state >= m_snapshot_interval) {
+    take_snapshot();
+  }
+  enforce_limit();
+  return true;
+}
+
+void UndoHistory::apply(size_t step, int sign)
+{
+  // Later edits in a step may build on earlier ones, so undo goes
+  // backwards
+  size_t begin = m_steps[step], end = m_steps[step + 1];
+  for (size_t n = begin; n < end; ++n) {
+    const Edit& e = m_edits[sign > 0 ? n : begin + end - 1 - n];
+    JointNode* joint = this->joint(e.joint);
+    if (!joint) {
+      continue;
+    }
+    joint->set_angles(joint->get_angle_x() + sign * e.dx * ANGLE_QUANTUM,
+                      joint->get_angle_y() + sign * e.dy * ANGLE_QUANTUM);
+  }
+}
+
+bool UndoHistory::undo()
+{
+  if (m_applied == 0) {
+    return false;
+  }
+
+  --m_applied;
+  apply(m_applied, -1);
+  restore_snapshot(m_applied);
+  return true;
+}
+
+bool UndoHistory::redo()
+{
+  if (m_applied + 1 >= m_steps.size()) {
+    return false;
+  }
+
+  apply(m_applied, 1);
+  ++m_applied;
+  restore_snapshot(m_applied);
+  return true;
+}
+
+void UndoHistory::take_snapshot()
+{
+  m_snapshots.push_back(Snapshot());
+  Snapshot& s = m_snapshots.back();
+  s.state = m_applied;
+  s.quanta.reserve(2 * m_joints.size());
+  for (size_t j = 0; j < m_joints.size(); ++j) {
+    JointNode* joint = this->joint(j);
+    s.quanta.push_back(joint ? quanta(m_origin[2*j], joint->get_angle_x()) : 0);
+    s.quanta.push_back(joint ? quanta(m_origin[2*j + 1], joint->get_angle_y()) : 0);
+  }
+}
+
+void UndoHistory::restore_snapshot(size_t state)
+{
+  std::vector<Snapshot>::const_reverse_iterator s = m_snapshots.rbegin();
+  while (s != m_snapshots.rend() && s->state > state) {
+    ++s;
+  }
+  if (s == m_snapshots.rend() || s->state != state) {
+    return;
+  }
+
+  // Only joints that have drifted need touching
+  for (size_t j = 0; j < s->quanta.size() / 2; ++j) {
+    double x = m_origin[2*j] + s->quanta[2*j] * ANGLE_QUANTUM;
+    double y = m_origin[2*j + 1] + s->quanta[2*j + 1] * ANGLE_QUANTUM;
+    JointNode* joint = this->joint(j);
+    if (joint && (joint->get_angle_x() != x || joint->get_angle_y() != y)) {
+      joint->set_angles(x, y);
+    }
+  }
+}
+
+void UndoHistory::enforce_limit()
+{
+  // Cut at the second snapshot, as long as that keeps the current
+  // state reachable
+  while (memory_usage() > m_max_bytes && m_snapshots.size() > 1 &&
+         m_snapshots[1].state <= m_applied) {
+    size_t cut = m_snapshots[1].state;
+    unsigned int first = m_steps[cut];
+
+    m_edits.erase(m_edits.begin(), m_edits.begin() + first);
+    m_steps.erase(m_steps.begin(), m_steps.begin() + cut);
+    for (std::vector<unsigned int>::iterator it = m_steps.begin(); it != m_steps.end(); ++it) {
+      *it -= first;
+    }
+    m_snapshots.erase(m_snapshots.begin());
+    for (std::vector<Snapshot>::iterator it = m_snapshots.begin(); it != m_snapshots.end(); ++it) {
+      it->state -= cut;
+    }
+    m_applied -= cut;
+  }
+}
+
+size_t UndoHistory::memory_usage() const
+{
+  size_t bytes = m_edits.size() * sizeof(Edit) +
+    m_steps.size() * sizeof(unsigned int) +
+    m_joints.size() * (sizeof(SceneRegistry::Handle) + 2 * sizeof(double)) +
+    m_joint_index.size() * sizeof(int);
+  for (std::vector<Snapshot>::const_iterator it = m_snapshots.begin(); it != m_snapshots.end(); ++it) {
+    bytes += sizeof(Snapshot) + it->quanta.size() * sizeof(int);
+  }
+  return bytes;
+}
+
+void UndoHistory::clear()
+{
+  m_joints.clear();
+  m_joint_index.clear();
+  m_origin.clear();
+  m_edits.clear();
+  m_steps.assign(1, 0);
+  m_applied = 0;
+  m_snapshots.assign(1, Snapshot());
+  m_snapshots[0].state = 0;
+  m_pending.clear();
+}
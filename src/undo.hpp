@@ -0,0 +1,126 @@
+#ifndef CS488_UNDO_HPP
+#define CS488_UNDO_HPP
+
+#include <vector>
+#include <stddef.h>
+#include "registry.hpp"
+
+class JointNode;
+
+// Undo/redo history of joint edits, kept as a command log.
+//
+// Each entry names the joint it changed by a handle from the scene's
+// SceneRegistry, so undoing or redoing a step touches only that step's
+// joints and never searches the scene; a joint deleted since is
+// skipped, even once its id has gone to another joint. A step (one
+// drag in the viewer) may move several joints; they are undone and
+// redone together.
+//
+// A joint's pose is a function of its two angles, so an edit is just
+// the change in those angles, quantized to ANGLE_QUANTUM degrees: 8
+// bytes, where a pair of transforms would be 192. Every
+// snapshot_interval steps the history also records the angles of every
+// joint it knows, in quanta from where it first saw the joint. Undo
+// and redo restore those when they reach one, so rounding cannot
+// build up, and they are where old history is cut off: once the
+// history holds more than max_bytes, the steps before the
+// second-oldest snapshot are dropped.
+class UndoHistory {
+public:
+  // Angles are recorded to this many degrees
+  static const double ANGLE_QUANTUM;
+
+  enum {
+    DEFAULT_MAX_BYTES = 1 << 20,
+    DEFAULT_SNAPSHOT_INTERVAL = 64
+  };
+
+  UndoHistory(size_t max_bytes = DEFAULT_MAX_BYTES,
+              size_t snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL);
+
+  // The scene whose joints are recorded. Changing it clears the
+  // history.
+  void set_registry(SceneRegistry* registry);
+
+  // Change the memory cap and snapshot spacing. A lower cap takes
+  // effect at once, as far as the snapshots allow.
+  void set_limits(size_t max_bytes, size_t snapshot_interval);
+
+  // Start a step that may move the given joints; their poses now are
+  // what undo will return to. Joints outside the registry are
+  // ignored.
+  void begin_step(const std::vector<JointNode*>& joints);
+  // Record whichever of those joints have moved since begin_step() as
+  // one step, discarding anything that could be redone. The joints are
+  // snapped to the recorded angles. Returns false (and records
+  // nothing) if none moved.
+  bool end_step();
+
+  // Undo or redo one step. Return false if there is none.
+  bool undo();
+  bool redo();
+
+  size_t undo_count() const { return m_applied; }
+  size_t redo_count() const { return m_steps.size() - 1 - m_applied; }
+
+  // Bytes held by the recorded steps, snapshots and joint table. This
+  // is what max_bytes limits, though the steps back to the last
+  // snapshot but one are always kept.
+  size_t memory_usage() const;
+
+  void clear();
+
+private:
+  // One joint edit: an index into m_joints and the change in its
+  // angles, in units of ANGLE_QUANTUM
+  struct Edit {
+    unsigned int joint;
+    short dx, dy;
+  };
+
+  // The angles of joints [0, quanta.size() / 2) after state steps,
+  // relative to m_origin
+  struct Snapshot {
+    size_t state;
+    std::vector<int> quanta;
+  };
+
+  struct Pending {
+    unsigned int joint;
+    double x, y;
+  };
+
+  int joint_index(JointNode* joint);
+  JointNode* joint(unsigned int index) const;
+  void apply(size_t step, int sign);
+  void take_snapshot();
+  void restore_snapshot(size_t state);
+  void enforce_limit();
+
+  size_t m_max_bytes, m_snapshot_interval;
+
+  SceneRegistry* m_registry;
+
+  // Handles on every joint the history has seen, in the order it
+  // first saw them, and their angles at that point, x then y
+  std::vector<SceneRegistry::Handle> m_joints;
+  std::vector<double> m_origin;
+  // Index into m_joints by registry id, or -1. The entry may be for an
+  // earlier holder of the id.
+  std::vector<int> m_joint_index;
+
+  // Edits of every step, oldest first. Step s is
+  // m_edits[m_steps[s] .. m_steps[s + 1]).
+  std::vector<Edit> m_edits;
+  std::vector<unsigned int> m_steps;
+  // Steps currently applied; the rest can be redone
+  size_t m_applied;
+
+  // Oldest first. The first is always of state 0, the oldest pose the
+  // history can return to.
+  std::vector<Snapshot> m_snapshots;
+
+  std::vector<Pending> m_pending;
+};
+
+#endif
@@ -1,10 +1,16 @@
 #include "viewer.hpp"
 #include "algebra.hpp"
+#include "scene_cache.hpp"
 #include <iostream>
 #include <math.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include <stdio.h>
+#include <string.h>
+
+// Frames are drawn at most this often; GTK 2 cannot tell us the
+// display's refresh rate, so assume the common 60 Hz
+static const double FRAME_INTERVAL_US = 1e6 / 60;
 
 Viewer::Viewer()
 {
@@ -34,10 +40,19 @@ Viewer::Viewer()
              Gdk::BUTTON_RELEASE_MASK    |
              Gdk::VISIBILITY_NOTIFY_MASK);
   
+  root = NULL;
   position = false;
-  back_face = false;
-  front_face = false;
-  z_buffer = false;
+  show_hud = false;
+  profiling = false;
+  hud_font_base = 0;
+  crowd_size = 1000;
+  crowd_skeleton = NULL;
+  crowd = NULL;
+  animation_clock_us = 0;
+  motion_pending = false;
+  frame_requested = false;
+  last_frame_us = 0;
+  motion_events = 0;
   buttonpressed[0] = false;
   buttonpressed[1] = false;
   buttonpressed[2] = false;
@@ -46,17 +61,21 @@ Viewer::Viewer()
 
 Viewer::~Viewer()
 {
-  // Nothing to do here right now.
+  frame_timer.disconnect();
+  animation_timer.disconnect();
+  drop_crowd();
 }
 
 void Viewer::redo() {
-  root->redo_transformation(redo_stack,redo_ids);
-  invalidate();
+  if (history.redo()) {
+    invalidate();
+  }
 }
 
 void Viewer::undo() {
-  root->pop_transformation(trans_stack, id_stack,redo_stack,redo_ids);
-  invalidate();
+  if (history.undo()) {
+    invalidate();
+  }
 }
 
 void Viewer::set_position() {
@@ -80,20 +99,139 @@ void Viewer::reset_orientation() {
 }
 
 void Viewer::set_z_buffer() {
-  z_buffer = 1 - z_buffer;
+  renderer.z_buffer = 1 - renderer.z_buffer;
   invalidate();
 }
 
 void Viewer::set_front_cull() {
-  front_face = 1 - front_face;
+  renderer.front_face = 1 - renderer.front_face;
   invalidate();
 }
 
 void Viewer::set_back_cull() {
-  back_face = 1 - back_face;
+  renderer.back_face = 1 - renderer.back_face;
+  invalidate();
+}
+
+void Viewer::set_frustum_cull() {
+  renderer.culling = 1 - renderer.culling;
   invalidate();
 }
 
+void Viewer::set_instancing() {
+  renderer.instancing = 1 - renderer.instancing;
+  invalidate();
+}
+
+void Viewer::set_crowd() {
+  if (crowd) {
+    drop_crowd();
+  }
+  else {
+    build_crowd();
+  }
+  invalidate();
+}
+
+void Viewer::set_crowd_size(size_t count) {
+  crowd_size = count;
+  if (crowd) {
+    build_crowd();
+    invalidate();
+  }
+}
+
+void Viewer::build_crowd() {
+  drop_crowd();
+  SceneNode* scene = renderer.get_scene_node();
+  if (!scene || crowd_size == 0) {
+    return;
+  }
+
+  crowd_skeleton = new SkeletonTemplate(scene);
+  crowd = new Crowd(crowd_skeleton);
+  crowd->spawn_grid(crowd_size, 2.2 * crowd_skeleton->radius());
+  renderer.set_crowd(crowd);
+}
+
+void Viewer::drop_crowd() {
+  renderer.set_crowd(NULL);
+  delete crowd;
+  delete crowd_skeleton;
+  crowd = NULL;
+  crowd_skeleton = NULL;
+}
+
+bool Viewer::load_animation(const std::string& filename) {
+  stop_animation();
+  animator.unbind();
+  return animation.load(filename);
+}
+
+void Viewer::play_animation() {
+  if (animation_timer.connected()) {
+    stop_animation();
+    return;
+  }
+  if (animation.joint_track_count() == 0 && animation.root_key_count() == 0) {
+    std::cerr << "No animation loaded" << std::endl;
+    return;
+  }
+
+  if (!animator.is_bound()) {
+    animator.bind(&animation, root->registry(), root);
+  }
+  if (!animator.is_playing()) {
+    animator.seek(0);
+  }
+  // The history records changes in angle, which playback is about to
+  // invalidate
+  history.clear();
+
+  animation_clock_us = FrameProfiler::now_us();
+  animation_timer = Glib::signal_timeout().connect(
+    sigc::mem_fun(*this, &Viewer::on_animation_timer),
+    (unsigned)(1000 / animator.rate()));
+}
+
+void Viewer::stop_animation() {
+  animation_timer.disconnect();
+}
+
+bool Viewer::on_animation_timer() {
+  // Timeouts drift and stall, so the player is told how much time
+  // really passed and keeps to its own steps
+  double now = FrameProfiler::now_us();
+  if (animator.advance((now - animation_clock_us) * 1e-6)) {
+    request_frame();
+  }
+  animation_clock_us = now;
+  return animator.is_playing();
+}
+
+void Viewer::set_hud() {
+  show_hud = !show_hud;
+  update_profiler();
+  invalidate();
+}
+
+void Viewer::set_profiling(bool on) {
+  profiling = on;
+  // A dump must hold every frame, not just the overlay's last few
+  profiler.set_keep_all(on);
+  update_profiler();
+}
+
+void Viewer::update_profiler() {
+  bool enabled = show_hud || profiling;
+  profiler.set_enabled(enabled);
+  renderer.timing = enabled;
+}
+
+bool Viewer::save_profile(const std::string& filename) const {
+  return profiler.save(filename);
+}
+
 void Viewer::invalidate()
 {
   // Force a rerender
@@ -101,8 +239,62 @@ void Viewer::invalidate()
   get_window()->invalidate_rect( allocation, false);
 }
 
+void Viewer::request_frame()
+{
+  if (frame_requested) {
+    return;
+  }
+  frame_requested = true;
+
+  double wait = last_frame_us + FRAME_INTERVAL_US - FrameProfiler::now_us();
+  if (wait <= 0) {
+    invalidate();
+  }
+  else {
+    frame_timer = Glib::signal_timeout().connect(
+      sigc::mem_fun(*this, &Viewer::on_frame_timer), (unsigned)ceil(wait * 1e-3));
+  }
+}
+
+bool Viewer::on_frame_timer()
+{
+  invalidate();
+  // One shot
+  return false;
+}
+
 void Viewer::set_scene_node(SceneNode *rootnode) {
   root = rootnode;
+  renderer.set_scene_node(root);
+  history.set_registry(root->registry());
+}
+
+void Viewer::set_scene_file(const std::string& filename) {
+  scene_file = filename;
+}
+
+void Viewer::reload_scene() {
+  SceneNode* fresh = load_scene(scene_file);
+  if (!fresh) {
+    std::cerr << "Could not open " << scene_file << std::endl;
+    return;
+  }
+
+  // The renderer lets go of the old nodes before they are freed
+  SceneNode* old = root;
+  bool had_crowd = crowd != NULL;
+  drag_joints.clear();
+  stop_animation();
+  animator.unbind();
+  drop_crowd();
+  set_scene_node(fresh);
+  if (old) {
+    delete old->registry();
+  }
+  if (had_crowd) {
+    build_crowd();
+  }
+  invalidate();
 }
 
 
@@ -120,9 +312,16 @@ void Viewer::on_realize()
   if (!gldrawable->gl_begin(get_gl_context()))
     return;
 
-  glShadeModel(GL_SMOOTH);
-  glClearColor( 0, 0, 0, 0.0 );
-  glEnable(GL_DEPTH_TEST);
+  renderer.init_gl();
+
+  // Bitmap glyphs for the stats overlay
+  hud_font_base = glGenLists(128);
+  Pango::FontDescription font_desc("Monospace 9");
+  if (!Gdk::GL::Font::use_pango_font(font_desc, 0, 128, hud_font_base)) {
+    std::cerr << "No font for the stats overlay" << std::endl;
+    glDeleteLists(hud_font_base, 128);
+    hud_font_base = 0;
+  }
 
   gldrawable->gl_end();
 }
@@ -136,56 +335,32 @@ bool Viewer::on_expose_event(GdkEventExpose* event)
   if (!gldrawable->gl_begin(get_gl_context()))
     return false;
 
-
-  // Set up for perspective drawing 
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  glViewport(0, 0, get_width(), get_height());
-  gluPerspective(40.0, (GLfloat)get_width()/(GLfloat)get_height(), 0.1, 1000.0);
-
-  // change to model view for drawing
-  glMatrixMode(GL_MODELVIEW);
-  //  glLoadIdentity();
-  // glRotatef( rot_angle, rotAxis[0], rotAxis[1], rotAxis[2] );
-
-  if (z_buffer) {
-    glEnable(GL_DEPTH_TEST);
-  }
-
-  if (back_face || front_face) {
-    glEnable(GL_CULL_FACE);
-    if (back_face && front_face)
-      glCullFace(GL_FRONT_AND_BACK);
-    else if (back_face) 
-      glCullFace(GL_BACK);
-    else
-      glCullFace(GL_FRONT);
+  // Pointer motion since the last frame. A timer still waiting to ask
+  // for this frame has nothing left to do.
+  frame_timer.disconnect();
+  frame_requested = false;
+  last_frame_us = FrameProfiler::now_us();
+  apply_motion();
+  if (crowd) {
+    crowd->follow_source();
   }
 
-  // Clear framebuffer
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-  // Set up lighting
-  glEnable(GL_NORMALIZE);
-  glEnable(GL_LIGHTING);
-  glEnable(GL_LIGHT0);
-
-  GLfloat ambientLight[] = {0.0, 0.0, 0.0};
-  GLfloat diffuseLight[] =  {1.0, 1.0, 1.0}; 
-  GLfloat specularLight[] = {1.0, 1.0, 1.0}; 
-  GLfloat position[] = { 0.0f, 0.0f, 10.0f, 0.0f };
-  
-  glLightfv(GL_LIGHT0, GL_AMBIENT, ambientLight);
-  glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuseLight);
-  glLightfv(GL_LIGHT0, GL_SPECULAR, specularLight);
-  glLightfv(GL_LIGHT0, GL_POSITION, position);
-
   // Draw stuff
-  root->walk_gl(false);
+  renderer.render(get_width(), get_height());
+  if (show_hud) {
+    draw_hud();
+  }
 
   // Swap the contents of the front and back buffers so we see what we
   // just drew. This should only be done if double buffering is enabled.
-  gldrawable->swap_buffers();
+  if (profiler.is_enabled()) {
+    double start = FrameProfiler::now_us();
+    gldrawable->swap_buffers();
+    profiler.add_frame(renderer.stats(), FrameProfiler::now_us() - start);
+  }
+  else {
+    gldrawable->swap_buffers();
+  }
 
   gldrawable->gl_end();
 
@@ -218,46 +393,6 @@ bool Viewer::on_configure_event(GdkEventConfigure* event)
   return true;
 }
 
-int Viewer::processHits (GLint hits, GLuint buffer[])
-{
-   unsigned int i, j;
-   GLuint names, *ptr, picked;
-   float min_z, z1;
-
-   min_z = 1000;
-   printf ("hits = %d\n", hits);
-   ptr = (GLuint *) buffer;
-   for (i = 0; i < hits; i++) { /*  for each hit  */
-      names = *ptr;
-      printf (" number of names for hit = %d\n", names); ptr++;
-
-      z1 = (float) *ptr/0x7fffffff;     
-      if ( z1 < min_z) {
-       	min_z = z1;
-      }
-      else {
-	continue;
-      }
-
-      printf("  z1 is %g;", (float) *ptr/0x7fffffff); ptr++;
-      printf(" z2 is %g\n", (float) *ptr/0x7fffffff); ptr++;
-      printf ("   the name is ");
-
-      if (std::abs(names) > 1000) {
-	continue;
-      }
-
-      for (j = 0; j < names; j++) {     /*  for each name */
-	picked = *ptr;
-	printf ("%d ", *ptr); ptr++;
-      }
-      printf ("\n");
-   }
-   return picked;
-}
-
-#define BUFSIZE 2048
-
 bool Viewer::on_button_press_event(GdkEventButton* event)
 {
   if (position) {
@@ -280,34 +415,32 @@ bool Viewer::on_button_press_event(GdkEventButton* event)
     }
   }
   else {
-    GLuint selectBuf[BUFSIZE];
-    GLint hits, picked;
-    GLint viewport[4]; 
-    glGetIntegerv (GL_VIEWPORT, viewport);
-    
-    glSelectBuffer (BUFSIZE, selectBuf);
-    (void) glRenderMode (GL_SELECT);
-    
-    glInitNames();
-    
-    glMatrixMode(GL_PROJECTION);
-    glPushMatrix();
-    glLoadIdentity();
-    gluPickMatrix ((GLdouble) event->x, 
-		   (GLdouble) (viewport[3] - event->y), 
-                   5.0, 5.0, viewport);
-    gluPerspective(40.0, (GLfloat)get_width()/(GLfloat)get_height(), 0.1, 1000.0);
-    
-    // Draw stuff
-    root->walk_gl(true);
-    
-    glMatrixMode(GL_PROJECTION);
-    glPopMatrix();
-    
-    hits = glRenderMode (GL_RENDER);
-    picked = processHits (hits, selectBuf);
-    
-    root->set_picked(picked,0,0);
+    renderer.sync();
+
+    Point3D origin;
+    Vector3D dir;
+    renderer.pick_ray(event->x, event->y, origin, dir);
+
+    int picked = -1;
+    FlatScene::Hit hit;
+    double start = profiler.is_enabled() ? FrameProfiler::now_us() : 0;
+    bool found = renderer.scene().pick(origin, dir, hit);
+    if (profiler.is_enabled()) {
+      profiler.add_pick(FrameProfiler::now_us() - start);
+    }
+    if (found) {
+      hit.node->toggle_selected();
+      picked = hit.node->get_id();
+    }
+
+    // Remember the joints this drag moves and the poses it starts from
+    std::vector<JointNode*> joints;
+    renderer.scene().selected_joints(joints);
+    history.begin_step(joints);
+    drag_joints.clear();
+    for (std::vector<JointNode*>::const_iterator it = joints.begin(); it != joints.end(); ++it) {
+      drag_joints.push_back(root->registry()->handle(*it));
+    }
     
     x1 = event->x;
     y1 = event->y;
@@ -321,6 +454,21 @@ bool Viewer::on_button_press_event(GdkEventButton* event)
 
 bool Viewer::on_button_release_event(GdkEventButton* event)
 {
+  // The drag ends where the pointer is, not where the last frame saw
+  // it, so apply the last motion before letting go of the button. The
+  // trackball turns the modelview matrix, so the context must be
+  // current; without one there is nothing to turn or draw.
+  if (motion_pending) {
+    Glib::RefPtr<Gdk::GL::Drawable> gldrawable = get_gl_drawable();
+    if (gldrawable && gldrawable->gl_begin(get_gl_context())) {
+      apply_motion();
+      gldrawable->gl_end();
+    }
+    motion_pending = false;
+    motion_events = 0;
+    invalidate();
+  }
+
   if (position) {
     if (event->button == 1)
       buttonpressed[0] = false;
@@ -330,8 +478,7 @@ bool Viewer::on_button_release_event(GdkEventButton* event)
       buttonpressed[2] = false;
   }
   else {
-    
-    root->push_transformation(trans_stack, id_stack);
+    history.end_step();
   }
 
   return true;
@@ -339,28 +486,43 @@ bool Viewer::on_button_release_event(GdkEventButton* event)
 
 bool Viewer::on_motion_notify_event(GdkEventMotion* event)
 {
+  motion_x = event->x;
+  motion_y = event->y;
+  motion_pending = true;
+  ++motion_events;
+  request_frame();
+  return true;
+}
+
+void Viewer::apply_motion()
+{
+  if (!motion_pending) {
+    return;
+  }
+  motion_pending = false;
+  int events = motion_events;
+  motion_events = 0;
+
   if (position) {
     if (buttonpressed[0] == true) {
       //translate along x,y axis
-      double dx = event->x - lastPoint[0];
-      double dy = event->y - lastPoint[1];
+      double dx = motion_x - lastPoint[0];
+      double dy = motion_y - lastPoint[1];
       root->mytranslate(Vector3D(dx/10,-dy/10,0));
-      invalidate();
-      lastPoint[0] = event->x;
-      lastPoint[1] = event->y;
+      lastPoint[0] = motion_x;
+      lastPoint[1] = motion_y;
     }
     else if (buttonpressed[1] == true ) {
       //translate along z axis
-      double dx = event->x - lastPoint[0];
-      double dy = event->y - lastPoint[1];
+      double dx = motion_x - lastPoint[0];
+      double dy = motion_y - lastPoint[1];
       root->mytranslate(Vector3D(0,0,dy/10));
-      invalidate();
-      lastPoint[0] = event->x;
-      lastPoint[1] = event->y;
+      lastPoint[0] = motion_x;
+      lastPoint[1] = motion_y;
     }
     else if (buttonpressed[2] == true) {
       //translate along virtual track ball
-      curPoint = trackBallMapping(event->x, event->y);      
+      curPoint = trackBallMapping(motion_x, motion_y);      
       Vector3D direction = curPoint - lastPoint;
       double velocity = direction.length();
       if (velocity > 0.0001) {
@@ -372,20 +534,24 @@ bool Viewer::on_motion_notify_event(GdkEventMotion* event)
         glLoadIdentity();
         glRotatef( rot_angle, rotAxis[0], rotAxis[1], rotAxis[2] );
         glMultMatrixf( (GLfloat *) matrix );
-        invalidate();
       }
     }
   }
   else {
 
-    dx = event->x - x1;
-    dy = event->y - y1;
+    dx = motion_x - x1;
+    dy = motion_y - y1;
     
-    root->set_picked(pick_id,dx,dy);
-    
-    invalidate();
+    // One turn for each motion event since the last frame, as when
+    // every event applied its own, so the rate follows the mouse and
+    // not the frame rate
+    for (std::vector<SceneRegistry::Handle>::const_iterator it = drag_joints.begin(); it != drag_joints.end(); ++it) {
+      JointNode* joint = root->registry()->joint(*it);
+      for (int e = 0; joint && e < events; ++e) {
+        joint->drag(dx, dy);
+      }
+    }
   }
-  return true;
 }
 
 void Viewer::draw_trackball_circle()
@@ -426,6 +592,56 @@ void Viewer::draw_trackball_circle()
   glDisable(GL_LINE_SMOOTH);
 }
 
+void Viewer::draw_hud()
+{
+  if (!hud_font_base) {
+    return;
+  }
+
+  const size_t frames = 30;
+  FrameProfiler::Frame avg = profiler.average(frames);
+  char lines[7][80];
+  snprintf(lines[0], sizeof(lines[0]), "%.1f fps  (%s)", profiler.frames_per_second(frames),
+           renderer.instancing ? "instanced" : "fixed function");
+  snprintf(lines[1], sizeof(lines[1]), "update   %8.3f ms", avg.update_us * 1e-3);
+  snprintf(lines[2], sizeof(lines[2]), "traverse %8.3f ms", avg.traverse_us * 1e-3);
+  snprintf(lines[3], sizeof(lines[3]), "pick     %8.3f ms  swap %8.3f ms",
+           avg.pick_us * 1e-3, avg.swap_us * 1e-3);
+  snprintf(lines[4], sizeof(lines[4]), "draws %lu  triangles %lu",
+           (unsigned long)avg.draws, (unsigned long)avg.triangles);
+  snprintf(lines[5], sizeof(lines[5]), "visible %lu  culled %lu",
+           (unsigned long)avg.visible, (unsigned long)avg.culled);
+  snprintf(lines[6], sizeof(lines[6]), "materials %lu  (%lu skipped)",
+           (unsigned long)avg.material_changes, (unsigned long)avg.material_changes_skipped);
+
+  // Window coordinates, leaving the camera on the modelview stack
+  // untouched
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+  glLoadIdentity();
+  glOrtho(0.0, get_width(), 0.0, get_height(), -1.0, 1.0);
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+
+  glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_LIST_BIT);
+  glDisable(GL_LIGHTING);
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_CULL_FACE);
+  glColor3f(1.0, 1.0, 0.0);
+  glListBase(hud_font_base);
+  for (int i = 0; i < 7; ++i) {
+    glRasterPos2i(8, get_height() - 16 * (i + 1));
+    glCallLists(strlen(lines[i]), GL_UNSIGNED_BYTE, lines[i]);
+  }
+  glPopAttrib();
+
+  glPopMatrix();
+  glMatrixMode(GL_PROJECTION);
+  glPopMatrix();
+  glMatrixMode(GL_MODELVIEW);
+}
+
 Vector3D Viewer::trackBallMapping(double x, double y) {
   Vector3D v;
   double d;
@@ -4,6 +4,11 @@
 #include <gtkmm.h>
 #include <gtkglmm.h>
 #include "scene.hpp"
+#include "renderer.hpp"
+#include "undo.hpp"
+#include "frameprofile.hpp"
+#include "animation.hpp"
+#include "crowd.hpp"
 // The "main" OpenGL widget
 class Viewer : public Gtk::GL::DrawingArea {
 public:
@@ -16,6 +21,10 @@ public:
   // call when the time is right.
   void invalidate();
   void set_scene_node(SceneNode *rootnode);
+  // The file the scene came from, for reload_scene()
+  void set_scene_file(const std::string& filename);
+  // Load the scene file again and free the old scene, all of it at once
+  void reload_scene();
 
   void redo();
   void undo();
@@ -26,15 +35,40 @@ public:
   void set_z_buffer();
   void set_front_cull();
   void set_back_cull();
+  // Skip parts outside the view; on by default
+  void set_frustum_cull();
+  void set_instancing();
+  // Load the clip play_animation() plays. Returns false, leaving no
+  // clip, if the file cannot be read.
+  bool load_animation(const std::string& filename);
+  // Start or stop playing the loaded clip
+  void play_animation();
+  // Show or hide a crowd of copies of the scene behind it, which
+  // follow its pose
+  void set_crowd();
+  // How many copies set_crowd() shows
+  void set_crowd_size(size_t count);
+  // Show or hide the frame stats overlay
+  void set_hud();
+  // Record every frame from now on, for save_profile()
+  void set_profiling(bool profiling);
+  bool save_profile(const std::string& filename) const;
   Vector3D trackBallMapping(double x, double y);
 
   SceneNode *root;
+  std::string scene_file;
+  // Draws root, and owns its flattened copy used for picking
+  SceneRenderer renderer;
   bool position;
-  std::vector<Matrix4x4> trans_stack;
-  std::vector<Matrix4x4> redo_stack;
-  std::vector<int> id_stack;
-  std::vector<int> redo_ids;
-  bool front_face, back_face, z_buffer;
+  // Joint edits made by dragging
+  UndoHistory history;
+  // Frame timings, recorded while the overlay is up or profiling is on
+  FrameProfiler profiler;
+  bool show_hud, profiling;
+  // The crowd shown, if any, and the template it was spawned from
+  size_t crowd_size;
+  SkeletonTemplate* crowd_skeleton;
+  Crowd* crowd;
   Vector3D curPoint, lastPoint, rotAxis;
   bool buttonpressed[3];
   GLfloat objectXform;
@@ -65,10 +99,47 @@ protected:
   // Assumes the context for the viewer is active.
   void draw_trackball_circle();
 
-  int processHits(GLint hits, GLuint buffer[]);
+  // Draw the averages of the last frames in the top left corner
+  void draw_hud();
+  void update_profiler();
+
+  // Display lists of the overlay's font, one per ASCII character
+  GLuint hud_font_base;
+
+  // Motion events only record where the pointer is; the next frame
+  // applies the latest position once, however many events came in.
+  void apply_motion();
+  // Ask for a frame: now if the last one is at least a refresh
+  // interval old, otherwise when it will be
+  void request_frame();
+  bool on_frame_timer();
+
+  // Poses the joints at the player's own rate, whatever the frame rate
+  bool on_animation_timer();
+  void stop_animation();
+
+  // Spawn the crowd from the scene as it is, or let it go
+  void build_crowd();
+  void drop_crowd();
+
+  AnimationClip animation;
+  AnimationPlayer animator;
+  sigc::connection animation_timer;
+  double animation_clock_us;
+
+  bool motion_pending;
+  double motion_x, motion_y;
+  // Motion events since the last frame applied one
+  int motion_events;
+  bool frame_requested;
+  double last_frame_us;
+  sigc::connection frame_timer;
 
   int pick_id;
+  // The joints the current drag moves
+  std::vector<SceneRegistry::Handle> drag_joints;
   double x1,y1,dx,dy;
+
 private:
 };
 